@@ -39,6 +39,14 @@ typedef unsigned spinlock_data_t;
 /* Initializer for use by SPINLOCK_INITIALIZER */
 #define SPINLOCK_DATA_INITIALIZER	0
 
+/*
+ * Ticket lock layout: the upper half of the word is the next ticket
+ * to hand out, the lower half the ticket being served. Both count
+ * modulo 65536; the lock is free when they are equal.
+ */
+#define SPINLOCK_DATA_NEXT(v)		((v) >> 16)
+#define SPINLOCK_DATA_OWNER(v)		((v) & 0xffff)
+
 /* Atomic operations on spinlock_data_t */
 SPINLOCK_INLINE
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
@@ -46,6 +54,10 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+unsigned spinlock_data_taketicket(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+void spinlock_data_nextowner(volatile spinlock_data_t *sd);
 
 ////////////////////////////////////////////////////////////
 
@@ -119,4 +131,60 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 }
 
 
+/*
+ * Take a ticket: atomically increment the upper half and return its
+ * previous value. The carry out of the word is simply lost, which is
+ * the wraparound we want.
+ */
+SPINLOCK_INLINE
+unsigned
+spinlock_data_taketicket(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"addu %1, %0, %3;"	/*   y = x + (1 << 16) */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (sd), "r" (1U << 16)
+		: "memory");
+	return SPINLOCK_DATA_NEXT(x);
+}
+
+/*
+ * Serve the next ticket: increment the lower half without carrying
+ * into the upper one. Only the holder does this, but other cpus may
+ * be taking tickets at the same time, hence LL/SC.
+ */
+SPINLOCK_INLINE
+void
+spinlock_data_nextowner(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+	spinlock_data_t t;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%3);"	/*   x = *sd */
+		"srl %2, %0, 16;"	/*   t = x & 0xffff0000 */
+		"sll %2, %2, 16;"
+		"addiu %1, %0, 1;"	/*   y = (x + 1) & 0xffff */
+		"andi %1, %1, 0xffff;"
+		"or %1, %1, %2;"	/*   y |= t */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y), "=&r" (t) : "r" (sd)
+		: "memory");
+}
+
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -117,10 +117,9 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;		/* first page to invalidate */
+	unsigned ts_npages;
+	volatile unsigned *ts_pending;	/* decremented when done, if set */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -152,7 +152,7 @@ mips_trap(struct trapframe *tf)
 	if (curthread != NULL && curthread->t_stack != NULL) {
 		KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
 		KASSERT((vaddr_t)tf < (vaddr_t)(curthread->t_stack
-						+ STACK_SIZE));
+						+ curthread->t_stacksize));
 	}
 
 	/* Interrupt? Call the interrupt handler and return. */
@@ -339,7 +339,8 @@ mips_trap(struct trapframe *tf)
 	}
 
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
-	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
+	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack +
+		curthread->t_stacksize;
 
 	/*
 	 * This assertion will fail if either
@@ -350,7 +351,8 @@ mips_trap(struct trapframe *tf)
 	 * kernel will (most likely) hang the system, so it's better
 	 * to find out now.
 	 */
-	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+	KASSERT(ON_STACK(curthread, cpustacks[curcpu->c_number]-1) &&
+		ON_STACK(curthread, tf));
 }
 
 /*
@@ -384,7 +386,8 @@ mips_usermode(struct trapframe *tf)
 	cpu_irqoff();
 
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
-	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
+	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack +
+		curthread->t_stacksize;
 
 	/*
 	 * This assertion will fail if either
@@ -401,7 +404,8 @@ mips_usermode(struct trapframe *tf)
 	 * either another thread's stack or in the kernel heap.
 	 * (Exercise: why?)
 	 */
-	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+	KASSERT(ON_STACK(curthread, cpustacks[curcpu->c_number]-1) &&
+		ON_STACK(curthread, tf));
 
 	/*
 	 * This actually does it. See exception-*.S.
@@ -35,6 +35,7 @@
 #include <current.h>
 #include <addrspace.h>
 #include <syscall.h>
+#include <copyinout.h>
 
 
 /*
@@ -80,7 +81,14 @@ syscall(struct trapframe *tf)
 {
 	int callno;
 	int32_t retval;
+	off_t retval64 = 0;	/* for calls returning 64 bits (lseek) */
+	bool is64 = false;
 	int err=0;
+#if OPT_SYSCALLS && OPT_FILE
+	off_t pos;
+	int whence;
+	uint32_t stackargs[2];
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -125,6 +133,67 @@ syscall(struct trapframe *tf)
 	      /* just ignore: do nothing */
 	        retval = 0;
                 break;
+	    case SYS_lseek:
+		/* 64-bit pos in a2/a3, whence on the stack */
+		pos = ((off_t)tf->tf_a2 << 32) | tf->tf_a3;
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+			     &whence, sizeof(int));
+		if (err) break;
+		err = sys_lseek((int)tf->tf_a0, pos, whence, &retval64);
+		is64 = true;
+		break;
+	    case SYS_pipe:
+		err = sys_pipe((userptr_t)tf->tf_a0, &retval);
+		break;
+	    case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, &retval);
+		break;
+	    case SYS_readv:
+		err = sys_readv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				(int)tf->tf_a2, &retval);
+		break;
+	    case SYS_writev:
+		err = sys_writev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (int)tf->tf_a2, &retval);
+		break;
+	    case SYS_copy_file_range:
+		/* len and flags on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+			     stackargs, sizeof(stackargs));
+		if (err) break;
+		err = sys_copy_file_range((int)tf->tf_a0,
+					  (userptr_t)tf->tf_a1,
+					  (int)tf->tf_a2,
+					  (userptr_t)tf->tf_a3,
+					  (size_t)stackargs[0],
+					  (unsigned)stackargs[1], &retval);
+		break;
+	    case SYS_fsync:
+		err = sys_fsync((int)tf->tf_a0);
+		break;
+	    case SYS_aio_setup:
+		err = sys_aio_setup((userptr_t)tf->tf_a0,
+				    (unsigned)tf->tf_a1, &retval);
+		break;
+	    case SYS_aio_enter:
+		err = sys_aio_enter((unsigned)tf->tf_a0,
+				    (unsigned)tf->tf_a1, &retval);
+		break;
+	    case SYS_pread:
+	    case SYS_pwrite:
+		/* a3 is padding, the 64-bit offset is on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+			     &pos, sizeof(off_t));
+		if (err) break;
+		if (callno == SYS_pread) {
+			err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+					(size_t)tf->tf_a2, pos, &retval);
+		}
+		else {
+			err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+					 (size_t)tf->tf_a2, pos, &retval);
+		}
+		break;
 #endif
 	    case SYS_write:
 	        retval = sys_write((int)tf->tf_a0,
@@ -184,7 +253,13 @@ syscall(struct trapframe *tf)
 	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		if (is64) {
+			tf->tf_v0 = (uint32_t)(retval64 >> 32);
+			tf->tf_v1 = (uint32_t)retval64;
+		}
+		else {
+			tf->tf_v0 = retval;
+		}
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 
@@ -91,7 +91,7 @@ cpu_machdep_init(struct cpu *c)
 		/* stack base address */
 		stackpointer = (vaddr_t) c->c_curthread->t_stack;
 		/* since stacks grow down, get the top */
-		stackpointer += STACK_SIZE;
+		stackpointer += c->c_curthread->t_stacksize;
 
 		cpustacks[c->c_number] = stackpointer;
 		cputhreads[c->c_number] = (vaddr_t)c->c_curthread;
@@ -307,3 +307,16 @@ cpu_halt(void)
 		wait();
         }
 }
+
+/*
+ * Read the cycle counter (c0_count). On System/161 writing the timer
+ * compare register restarts it, hence the warning in cpu.h.
+ */
+uint32_t
+cpu_cyclecount(void)
+{
+	uint32_t count;
+
+	__asm volatile("mfc0 %0,$9" : "=r" (count));
+	return count;
+}
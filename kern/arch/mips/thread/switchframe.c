@@ -64,7 +64,7 @@ switchframe_init(struct thread *thread,
          * get the other end of it. Then set up a switchframe on the
          * top of the stack.
          */
-        stacktop = ((vaddr_t)thread->t_stack) + STACK_SIZE;
+        stacktop = ((vaddr_t)thread->t_stack) + thread->t_stacksize;
         sf = ((struct switchframe *) stacktop) - 1;
 
         /* Zero out the switchframe. */
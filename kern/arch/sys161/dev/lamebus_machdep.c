@@ -76,6 +76,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Arm the on-chip timer NSECS nanoseconds from now. (The timer code
+ * in clock.c does the scheduling of the interrupts.)
+ */
+void
+mainbus_settimer(uint32_t nsecs)
+{
+	uint32_t count;
+
+	count = (uint64_t)nsecs * CPU_FREQUENCY / 1000000000;
+	if (count == 0) {
+		count = 1;
+	}
+	mips_timer_set(count);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -114,9 +130,10 @@ mainbus_bootstrap(void)
 	autoconf_lamebus(lamebus, 0);
 
 	/*
-	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * Now that the clock is attached, start the MIPS on-chip timer
+	 * for the hardclocks and the timeouts.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	hardclock_start();
 }
 
 /*
@@ -314,10 +331,8 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
-		hardclock();
+		/* Rearms the timer (this clears the interrupt) */
+		clock_interrupt();
 		seen = true;
 	}
 
@@ -45,6 +45,14 @@
  * debugging problems that occur early in initialization is awkward,
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
+ *
+ * Output from threads goes through a ring of CONSOLE_OUTPUT_BUFFER_SIZE
+ * chars: the writer only copies into it, and the write-done interrupt
+ * of the device sends the next char, so a whole line costs the writer
+ * one lock round and no context switches. Writers sleep when the ring
+ * is full, until it is half empty. Polled output (interrupt handlers,
+ * spinlocks held, panic) first sends what is still in the ring, so the
+ * order is kept.
  */
 
 #include <types.h>
@@ -55,6 +63,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
+#include <copyinout.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -72,6 +82,12 @@ static struct con_softc *the_console = NULL;
 static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
+/*
+ * Output is copied in from user space this much at a time, into a
+ * buffer on the stack.
+ */
+#define CONSOLE_WRITE_CHUNK 256
+
 //////////////////////////////////////////////////
 
 /*
@@ -109,28 +125,81 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Take the oldest char out of the output ring. Wake up the writers
+ * once it is half empty, so that they refill it in one go.
+ */
+static
+int
+con_out_take(struct con_softc *cs)
+{
+	int ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+	KASSERT(cs->cs_outcount > 0);
+
+	ch = cs->cs_outbuf[cs->cs_outtail];
+	cs->cs_outtail = (cs->cs_outtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount--;
+	if (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+	}
+	return ch;
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * If we already hold the ring lock (something in here went wrong),
+ * the ring is left alone.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (spinlock_do_i_hold(&cs->cs_outlock)) {
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_outlock);
+	while (cs->cs_outcount > 0) {
+		cs->cs_sendpolled(cs->cs_devdata, con_out_take(cs));
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
 
 /*
- * Print a character, using interrupts to wait for I/O completion.
+ * Print LEN chars through the output ring, using interrupts to wait
+ * for I/O completion. If the device is idle the first char is sent
+ * right away, the others by con_start.
  */
 static
 void
-putch_intr(struct con_softc *cs, int ch)
+putbuf_intr(struct con_softc *cs, const char *buf, size_t len)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		while (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE) {
+			wchan_sleep(cs->cs_outwchan, &cs->cs_outlock);
+		}
+		cs->cs_outbuf[cs->cs_outhead] = buf[i];
+		cs->cs_outhead =
+			(cs->cs_outhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_outcount++;
+
+		if (!cs->cs_outbusy) {
+			cs->cs_outbusy = true;
+			cs->cs_send(cs->cs_devdata, con_out_take(cs));
+		}
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 /*
@@ -178,13 +247,21 @@ con_input(void *vcs, int ch)
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Sends the next char of the output ring, if any.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	if (cs->cs_outcount == 0) {
+		cs->cs_outbusy = false;
+	}
+	else {
+		cs->cs_send(cs->cs_devdata, con_out_take(cs));
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -197,24 +274,72 @@ con_start(void *vcs)
  * not, and does not.
  */
 
+static
+bool
+con_must_poll(void)
+{
+	return curthread->t_in_interrupt ||
+		curthread->t_curspl > 0 ||
+		curcpu->c_spinlocks > 0;
+}
+
 void
 putch(int ch)
 {
 	struct con_softc *cs = the_console;
+	char c = ch;
 
 	if (cs==NULL) {
 		putch_delayed(ch);
 	}
-	else if (curthread->t_in_interrupt ||
-		 curthread->t_curspl > 0 ||
-		 curcpu->c_spinlocks > 0) {
+	else if (con_must_poll()) {
 		putch_polled(cs, ch);
 	}
 	else {
-		putch_intr(cs, ch);
+		putbuf_intr(cs, &c, 1);
+	}
+}
+
+void
+putbuf(const char *buf, size_t len)
+{
+	struct con_softc *cs = the_console;
+	size_t i;
+
+	if (cs != NULL && !con_must_poll()) {
+		putbuf_intr(cs, buf, len);
+		return;
+	}
+	for (i=0; i<len; i++) {
+		putch(buf[i]);
 	}
 }
 
+/*
+ * Print LEN chars of user memory at UBUF, CONSOLE_WRITE_CHUNK at a
+ * time: one copyin and one trip through the ring per chunk.
+ */
+int
+putbuf_user(const_userptr_t ubuf, size_t len)
+{
+	char kbuf[CONSOLE_WRITE_CHUNK];
+	size_t done, n;
+	int result;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		if (n > CONSOLE_WRITE_CHUNK) {
+			n = CONSOLE_WRITE_CHUNK;
+		}
+		result = copyin((const_userptr_t)((vaddr_t)ubuf + done), kbuf, n);
+		if (result) {
+			return result;
+		}
+		putbuf(kbuf, n);
+	}
+	return 0;
+}
+
 int
 getch(void)
 {
@@ -240,6 +365,39 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Print up to CONSOLE_WRITE_CHUNK chars of UIO, turning each newline
+ * into CR-LF.
+ */
+static
+int
+con_write(struct uio *uio)
+{
+	char kbuf[CONSOLE_WRITE_CHUNK];
+	size_t len, start, i;
+	int result;
+
+	len = uio->uio_resid;
+	if (len > CONSOLE_WRITE_CHUNK) {
+		len = CONSOLE_WRITE_CHUNK;
+	}
+	result = uiomove(kbuf, len, uio);
+	if (result) {
+		return result;
+	}
+
+	start = 0;
+	for (i=0; i<len; i++) {
+		if (kbuf[i] == '\n') {
+			putbuf(kbuf + start, i - start);
+			putbuf("\r\n", 2);
+			start = i + 1;
+		}
+	}
+	putbuf(kbuf + start, len - start);
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -276,15 +434,11 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			result = con_write(uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
 		}
 	}
 	lock_release(lk);
@@ -343,7 +497,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,30 +518,37 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	wc = wchan_create("console write");
+	if (wc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
 
+	spinlock_init(&cs->cs_outlock);
+	spinlock_setname(&cs->cs_outlock, "console");
+	cs->cs_outwchan = wc;
+	cs->cs_outhead = 0;
+	cs->cs_outtail = 0;
+	cs->cs_outcount = 0;
+	cs->cs_outbusy = false;
+
 	the_console = cs;
 	con_userlock_read = rlk;
 	con_userlock_write = wlk;
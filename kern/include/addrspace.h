@@ -37,6 +37,7 @@
 
 #include <vm.h>
 #include <segments.h>
+#include <workqueue.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -63,6 +64,8 @@ struct addrspace {
         struct segment* data;       
         struct segment* stack;
         struct pt_directory *pt;
+        int prefault;               /* prefault policy, see prefault.h */
+        struct work destroy_work;   /* for as_destroy_deferred() */
 
         // struct segment* heap;        /*no heap management for this assignment*/
 #endif
@@ -89,6 +92,12 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_deferred - same, but the private part (frames, swap,
+ *                page table) is done later by system_wq, for callers
+ *                that must not wait for it (process exit). The prefault
+ *                history and the text cache are updated before it
+ *                returns. The address space must no longer be anyone's.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -119,6 +128,7 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 #else
+void              as_destroy_deferred(struct addrspace *);
 int               as_define_region(struct addrspace *as, uint32_t type, uint32_t offset ,vaddr_t vaddr, size_t memsize,
 		        uint32_t filesiz, int readable, int writeable, int executable, int segNo, struct vnode *v);
 #endif
@@ -0,0 +1,25 @@
+#ifndef _AIO_H_
+#define _AIO_H_
+
+/*
+ * Asynchronous I/O, kernel side. See <kern/aio.h> for the rings.
+ *
+ * aio_setup() gives the current process its ring and AIO_NWORKERS
+ * kernel threads of its own to run the requests: they run in the
+ * address space of the process, so they read and write the ring and
+ * the I/O buffers directly. aio_destroy() stops them and must be
+ * called by the exiting process before its address space goes away;
+ * it closes the descriptors of the process first, so that requests
+ * blocked on its own pipes return.
+ */
+
+#include <kern/aio.h>
+
+#define AIO_NWORKERS 4
+
+struct proc;
+struct aio_ctx;
+
+void aio_destroy(struct proc *p);
+
+#endif /* _AIO_H_ */
@@ -38,16 +38,30 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, only when the
+ * CPU is not idle, for scheduling.
  */
 
 /* hardclocks per second */
 #define HZ  100
+#define NSEC_PER_HARDCLOCK  (1000000000 / HZ)
 
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * The timer interrupt is armed on demand (see clock.c).
+ *
+ * hardclock_start() is called by the MD code once gettime() works;
+ * clock_interrupt() is called by the MD code on every timer
+ * interrupt; clock_idle() and clock_unidle() are called by the idle
+ * loop to stop and restart the hardclocks of the current CPU.
+ */
+void hardclock_start(void);
+void clock_interrupt(void);
+void clock_idle(void);
+void clock_unidle(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -59,6 +73,12 @@ void timerclock(void);
  */
 void gettime(struct timespec *ret);
 
+/*
+ * clock_ns() returns the time of day in nanoseconds (0 during boot,
+ * before the clock device is attached).
+ */
+uint64_t clock_ns(void);
+
 /*
  * arithmetic on times
  *
@@ -73,11 +93,35 @@ void timespec_sub(const struct timespec *t1,
 		  const struct timespec *t2,
 		  struct timespec *ret);
 
+/*
+ * Timeouts: TO_FUNC(TO_ARG) is called from the timer interrupt, on
+ * some CPU, once the delay given to timeout_add() has passed. The
+ * struct timeout belongs to the caller and must stay around until
+ * the function has been called or timeout_cancel() returned true.
+ *
+ * timeout_add() fails with ENOMEM only if the queue cannot grow (it
+ * never grows when called from an interrupt handler).
+ * timeout_cancel() returns false if the function already ran or is
+ * running.
+ */
+struct timeout {
+	uint64_t to_when;		/* expiry, in clock_ns() time */
+	void (*to_func)(void *);
+	void *to_arg;
+	unsigned to_index;		/* position in the queue */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+int timeout_add(struct timeout *to, uint64_t delay_ns);
+bool timeout_cancel(struct timeout *to);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * thread_sleep_ns() does the same with nanoseconds.
  */
 void clocksleep(int seconds);
+void thread_sleep_ns(uint64_t ns);
 
 
 #endif /* _CLOCK_H_ */
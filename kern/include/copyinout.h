@@ -50,6 +50,10 @@
  * returns the actual length of string found in GOT. DEST is always
  * null-terminated on success. LEN and GOT include the null terminator.
  *
+ * copycheck only checks that LEN bytes at USERPTR lie in user space,
+ * without touching them; STOPLEN is how many of them do. It is for
+ * callers that validate several user buffers before starting I/O.
+ *
  * All of these functions return 0 on success, EFAULT if a memory
  * addressing error was encountered, or (for the string versions)
  * ENAMETOOLONG if the space available was insufficient.
@@ -68,6 +72,7 @@ int copyin(const_userptr_t usersrc, void *dest, size_t len);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
+int copycheck(const_userptr_t userptr, size_t len, size_t *stoplen);
 
 
 #endif /* _COPYINOUT_H_ */
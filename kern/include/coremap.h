@@ -9,12 +9,16 @@
  * free: freed and now available
  * dirty: requested by a user program
  * clean: still no required by ram_stealmem
+ * shared: read-only text page mapped by ref_count processes, never evicted
+ * dying: user page of an address space being destroyed, never evicted
 */
 enum status_t {
     fixed,
     free,
     dirty,
-    clean
+    clean,
+    shared,
+    dying
 };
 /**
  * vaddr in [0x80000000, 0x80000000+ram_size]
@@ -24,6 +28,8 @@ struct coremap_entry {
     enum status_t status;
     vaddr_t vaddr;
     unsigned int alloc_size;
+    unsigned int ref_count;
+    void *kmref;                /* kmalloc bookkeeping of a kernel heap page, NULL otherwise */
 };
 
 void coremap_init(void);
@@ -32,9 +38,19 @@ void coremap_shutdown(void);
 // 
 paddr_t page_alloc(vaddr_t vaddr);
 void page_free(paddr_t paddr);
+void coremap_disown(struct addrspace *as);
+
+// for shared text pages (see textcache.c)
+void page_share(paddr_t paddr);
+void page_ref(paddr_t paddr);
+unsigned int page_unref(paddr_t paddr);
 
 // for kernel
 vaddr_t alloc_kpages(unsigned long npages);
 void free_kpages(vaddr_t addr);
 
+// for kmalloc, O(1) lookup of the subpage allocator page owning a pointer
+void coremap_set_kmref(vaddr_t kvaddr, void *ref);
+int coremap_get_kmref(vaddr_t kvaddr, void **ref);
+
 #endif
\ No newline at end of file
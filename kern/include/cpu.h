@@ -35,6 +35,14 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct kmalloc_magazine;	/* Opaque, private to kmalloc.c */
+
+/* Free kernel stacks kept by each cpu for thread_fork (see thread.c) */
+#define CPU_STACKPOOL_MAX 8
+
+/* Priority levels of the run queues, 0 is the highest (see thread.c) */
+#define SCHED_NLEVELS 4
+
 
 /*
  * Per-cpu structure
@@ -60,14 +68,34 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	uint64_t c_nexttick;		/* clock_ns() of the next hardclock */
+	unsigned c_idleirqs;		/* Timer interrupts taken while idle */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct kmalloc_magazine *c_kmalloc_mag;	/* Cached free heap blocks */
+
+	/*
+	 * Free kernel stacks, all c_stackpool_size bytes big.
+	 * Protected by c_stackpool_lock (thread_set_stacksize
+	 * refills the pools of the other cpus).
+	 */
+	void *c_stackpool[CPU_STACKPOOL_MAX];
+	unsigned c_stackpool_count;
+	size_t c_stackpool_size;
+	unsigned c_stackpool_hits;	/* thread_fork served by the pool */
+	unsigned c_stackpool_misses;	/* ... or by alloc_kpages */
+	struct spinlock c_stackpool_lock;
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* One per priority */
+	unsigned c_runqueue_count;	/* Threads on all of c_runqueue[] */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_stolen;		/* Threads other cpus took from here */
+	unsigned c_steal_misses;	/* Went idle with nothing to take */
+	uint64_t c_idle_ns;		/* Time spent in cpu_idle */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -83,6 +111,7 @@ struct cpu {
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
 	 */
+	bool c_hatched;			/* Running, so it answers IPIs */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
@@ -142,6 +171,12 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Read the cycle counter of the current CPU. It is only good for
+ * measuring short intervals on one CPU, with interrupts off.
+ */
+uint32_t cpu_cyclecount(void);
+
 /*
  * Interprocessor interrupts.
  *
@@ -155,6 +190,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_all sends it to all the running CPUs except the
+ * current one, and waits until they have all done it.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +206,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_all(struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
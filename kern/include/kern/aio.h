@@ -0,0 +1,68 @@
+#ifndef _KERN_AIO_H_
+#define _KERN_AIO_H_
+
+/*
+ * Asynchronous I/O rings, shared between a process and the kernel.
+ *
+ * The process allocates AIO_RING_SIZE(n) bytes of its own memory (n a
+ * power of two up to AIO_MAX_ENTRIES) and hands them to aio_setup().
+ * The ring header is followed by n submission entries and then by n
+ * completion entries.
+ *
+ * To submit, the process fills in the entry at ar_sqtail % n and
+ * increments ar_sqtail; the kernel moves ar_sqhead on as it takes
+ * them. Completions are written by the kernel at ar_cqtail % n, the
+ * process reads them and increments ar_cqhead. aio_enter(to_submit,
+ * min_complete) takes up to TO_SUBMIT new submissions and then waits
+ * until at least MIN_COMPLETE completions are ready to be read.
+ *
+ * Requests run in parallel on kernel threads of the process, so they
+ * can complete in any order: sqe_data comes back as cqe_data to tell
+ * them apart. cqe_res is the number of bytes moved, or minus an error
+ * code.
+ */
+
+#define AIO_MAX_ENTRIES 256
+
+/* sqe_op */
+#define AIO_OP_NOP    0
+#define AIO_OP_READ   1
+#define AIO_OP_WRITE  2
+#define AIO_OP_FSYNC  3
+
+struct aio_ring {
+	volatile unsigned ar_sqhead;	/* written by the kernel */
+	volatile unsigned ar_sqtail;	/* written by the process */
+	volatile unsigned ar_cqhead;	/* written by the process */
+	volatile unsigned ar_cqtail;	/* written by the kernel */
+	unsigned ar_entries;		/* written by the kernel */
+	unsigned ar_pad;
+};
+
+struct aio_sqe {
+	int sqe_op;
+	int sqe_fd;
+#ifdef _KERNEL
+	userptr_t sqe_buf;
+#else
+	void *sqe_buf;
+#endif
+	size_t sqe_len;
+	off_t sqe_offset;		/* -1 for the file offset */
+	unsigned sqe_data;
+};
+
+struct aio_cqe {
+	unsigned cqe_data;
+	int cqe_res;
+};
+
+#define AIO_RING_SQES(ring) \
+	((struct aio_sqe *)((char *)(ring) + sizeof(struct aio_ring)))
+#define AIO_RING_CQES(ring, n) \
+	((struct aio_cqe *)(AIO_RING_SQES(ring) + (n)))
+#define AIO_RING_SIZE(n) \
+	(sizeof(struct aio_ring) + (n) * (sizeof(struct aio_sqe) + \
+					  sizeof(struct aio_cqe)))
+
+#endif /* _KERN_AIO_H_ */
@@ -0,0 +1,69 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches for frequently created kernel structures.
+ *
+ * A cache hands out objects of one size that are already in their
+ * "constructed" state: the constructor runs when an object is first
+ * made, not on every allocation, and objects must be given back in
+ * that same state (e.g. with their locks unheld and lists empty).
+ * Up to kc_maxfree freed objects are kept ready; beyond that, and when
+ * memory is short (kmem_cache_reap), the destructor runs and the
+ * memory goes back to kmalloc.
+ *
+ * Functions:
+ *     kmem_cache_create  - allocate a new cache. CTOR (may be NULL)
+ *                          returns 0 or an error code; DTOR may be NULL.
+ *                          Returns NULL on error.
+ *     kmem_cache_destroy - destroy a cache with no objects in use.
+ *     kmem_cache_alloc   - get a constructed object, NULL if out of memory.
+ *     kmem_cache_free    - give back an object, in constructed state.
+ *     kmem_cache_reap    - release the free objects of all caches.
+ *     kmem_cache_printstats - print the statistics of all caches (kh).
+ *
+ * Caches needed before kmalloc can make them (or just for convenience)
+ * can be static, set up with KMEM_CACHE_INITIALIZER.
+ */
+
+#include <spinlock.h>
+
+#define KMEM_CACHE_MAXFREE  16		/* objects kept per cache, at most */
+#define KMEM_CACHE_MAXBYTES (64*1024)	/* and no more than this many bytes */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects everything below */
+	void *kc_free[KMEM_CACHE_MAXFREE];	/* constructed, ready objects */
+	unsigned kc_nfree;
+	unsigned kc_maxfree;		/* 0 until first use */
+	bool kc_registered;		/* on the list of all caches */
+	struct kmem_cache *kc_next;
+
+	/* statistics */
+	unsigned kc_allocs;		/* kmem_cache_alloc calls */
+	unsigned kc_hits;		/* ...served with a ready object */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_constructed;	/* constructor runs */
+	unsigned kc_destructed;		/* destructor runs */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ .kc_name = (name), .kc_size = (size), \
+	  .kc_ctor = (ctor), .kc_dtor = (dtor), \
+	  .kc_lock = SPINLOCK_INITIALIZER }
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
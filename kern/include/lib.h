@@ -125,10 +125,19 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kmalloc_magazine_create makes the per-cpu cache of free blocks that
+ * cpu_create hangs on each struct cpu; it returns NULL if magazines
+ * are disabled.
+ *
+ * kheap_bootstrap is called once at boot to name the heap lock.
  */
+struct kmalloc_magazine;
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+struct kmalloc_magazine *kmalloc_magazine_create(void);
 void kheap_printstats(void);
+void kheap_bootstrap(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -160,8 +169,13 @@ const char *strerror(int errcode);
 
 /*
  * Low-level console access.
+ *
+ * putbuf prints LEN chars at once; putbuf_user does the same with
+ * user memory and fails only if copyin does.
  */
 void putch(int ch);
+void putbuf(const char *buf, size_t len);
+int putbuf_user(const_userptr_t ubuf, size_t len);
 int getch(void);
 void beep(void);
 
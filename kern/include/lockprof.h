@@ -0,0 +1,72 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler. Enable with "options lockprof" in the
+ * kernel config.
+ *
+ * Like hangman, it sits in every spinlock and sleep lock. Each lock
+ * counts its acquisitions, how many of them had to wait and how long
+ * (spin rounds), and how long it was held. Spinlock hold times are in
+ * cycles of the cpu's cycle counter; sleep locks can be held across
+ * context switches and cpus, so theirs are in nanoseconds.
+ *
+ * Only the locks with a name show up in the report: sleep locks get
+ * theirs from lock_create, spinlocks from spinlock_setname.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+struct lockprof {
+	const char *lp_name;		/* NULL if not registered */
+	bool lp_sleeplock;
+	unsigned lp_acquires;
+	unsigned lp_contended;		/* acquisitions that had to wait */
+	uint64_t lp_spins;		/* rounds spent waiting */
+	uint64_t lp_holdstart;		/* when the holder got it */
+	uint64_t lp_holdtotal;
+	uint64_t lp_holdmax;
+	unsigned lp_holds;		/* hold times measured */
+	struct lockprof *lp_prev;	/* registered locks */
+	struct lockprof *lp_next;
+};
+
+void lockprof_init(struct lockprof *lp, bool sleeplock);
+void lockprof_register(struct lockprof *lp, const char *name);
+void lockprof_unregister(struct lockprof *lp);
+void lockprof_acquired(struct lockprof *lp, unsigned spins);
+void lockprof_release(struct lockprof *lp);
+
+/* Print the TOP most contended locks; forget all the counts */
+void lockprof_print(unsigned top);
+void lockprof_reset(void);
+
+#define LOCKPROF(sym)			struct lockprof sym
+
+/* Goes after the previous member's initializer, hence the comma */
+#define LOCKPROF_INITIALIZER		, { NULL, false, 0, 0, 0, 0, 0, 0, \
+					    0, NULL, NULL }
+
+#define LOCKPROF_INIT(lp, sleep)	lockprof_init(lp, sleep)
+#define LOCKPROF_REGISTER(lp, name)	lockprof_register(lp, name)
+#define LOCKPROF_UNREGISTER(lp)		lockprof_unregister(lp)
+#define LOCKPROF_ACQUIRED(lp, spins)	lockprof_acquired(lp, spins)
+#define LOCKPROF_RELEASE(lp)		lockprof_release(lp)
+
+#else
+
+#define LOCKPROF(sym)
+
+#define LOCKPROF_INITIALIZER
+
+#define LOCKPROF_INIT(lp, sleep)
+#define LOCKPROF_REGISTER(lp, name)
+#define LOCKPROF_UNREGISTER(lp)
+#define LOCKPROF_ACQUIRED(lp, spins)
+#define LOCKPROF_RELEASE(lp)
+
+#endif
+
+#endif /* _LOCKPROF_H_ */
@@ -48,6 +48,9 @@ void mainbus_start_cpus(void);
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
+/* Make the on-chip timer of the current cpu interrupt in NSECS ns. */
+void mainbus_settimer(uint32_t nsecs);
+
 /* Find the size of main memory. */
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
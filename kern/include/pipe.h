@@ -0,0 +1,22 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Pipes: a ring buffer with a read end and a write end, each one a
+ * vnode of its own, so each end knows when the other one has been
+ * closed (last reference gone): readers then get EOF, writers EPIPE.
+ *
+ * pipe_create makes a pipe with a ring of SIZE bytes (0 means
+ * PIPE_SIZE_DEFAULT) and hands back one reference to each end.
+ */
+
+#include <vm.h>
+
+#define PIPE_SIZE_DEFAULT PAGE_SIZE
+#define PIPE_SIZE_MAX     (16*PAGE_SIZE)
+
+struct vnode;
+
+int pipe_create(size_t size, struct vnode **readend, struct vnode **writeend);
+
+#endif /* _PIPE_H_ */
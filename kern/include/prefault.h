@@ -0,0 +1,47 @@
+#ifndef _PREFAULT_H_
+#define _PREFAULT_H_
+
+#include <types.h>
+
+struct addrspace;
+
+/**
+ * Prefault policies, chosen for each exec (the address space takes the
+ * policy in effect when it is created):
+ *  demand:  nothing is loaded before the program runs (default)
+ *  text:    the whole code segment is loaded at exec time
+ *  all:     code and data segments are loaded at exec time
+ *  learned: the code and data pages touched by the previous run of the
+ *           same executable are loaded at exec time
+*/
+#define PREFAULT_DEMAND     0
+#define PREFAULT_EAGER_TEXT 1
+#define PREFAULT_EAGER_ALL  2
+#define PREFAULT_LEARNED    3
+#define PREFAULT_NPOLICIES  4
+
+#define PREFAULT_HISTORY    8       // executables remembered by the learned policy
+#define PREFAULT_MAX_PAGES  512     // pages remembered for each of them
+
+void prefault_bootstrap(void);
+void prefault_shutdown(void);
+
+/*
+    Get/set the policy for the next execs, policy names are the ones above
+*/
+int prefault_get_policy(void);
+int prefault_set_policy(int policy);
+const char *prefault_policy_name(int policy);
+int prefault_policy_by_name(const char *name);
+
+/*
+    Called by as_complete_load(): bring in the pages chosen by the policy of AS
+*/
+int prefault_load(struct addrspace *as);
+
+/*
+    Called by as_destroy(): remember which pages of the executable have been used
+*/
+void prefault_record(struct addrspace *as);
+
+#endif
@@ -44,6 +44,7 @@
 struct addrspace;
 struct thread;
 struct vnode;
+struct aio_ctx;
 
 /*
  * Process structure.
@@ -69,6 +70,10 @@ struct vnode;
 #define USE_SEMAPHORE_FOR_WAITPID 1
 #endif
 
+#if OPT_FILE
+#define FDMAP_BITS 32
+#endif
+
 struct proc {
 	char *p_name;			/* Name of this process */
 	struct spinlock p_lock;		/* Lock for this structure */
@@ -93,9 +98,14 @@ struct proc {
 #endif
 #endif
 #if OPT_FILE
-		// list of pointers to rows in global table for managing open files
-		// fileTable[fd (local to process) ] ====> systemFileTable[pos (globally defined)] ====> { vnode } 
+		// list of pointers to open files, shared with forked processes
+		// fileTable[fd (local to process) ] ====> openfile (allocated on open) ====> { vnode } 
         struct openfile *fileTable[OPEN_MAX];
+		// bit fd set when fd is in use, for the lowest free one; stdin/out/err always set
+		// fileTable and fdMap are protected by p_lock
+        uint32_t fdMap[OPEN_MAX/FDMAP_BITS];
+		// asynchronous I/O ring and its threads, see aio.h
+        struct aio_ctx *p_aio;
 #endif
 };
 
@@ -131,5 +141,6 @@ struct proc *proc_search_pid(pid_t pid);
 void proc_signal_end(struct proc *proc);
 #if OPT_FILE
 void proc_file_table_copy(struct proc *psrc, struct proc *pdest);
+void proc_file_table_close(struct proc *proc);
 #endif
 #endif /* _PROC_H_ */
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef _PT_H_
 #define _PT_H_
 
+#include "opt-ptswap.h"
+
 /*
     addr (32 bits): p1 | p2 | d
     p1: 10 bits, indexing inner page table
@@ -15,15 +17,28 @@
 #define D_MASK 0x00000FFF
 #define PFN_NOT_USED 0x00000000
 
+/* pages needed by an inner table, 16KB with the current entry layout */
+#define PT_INNER_NPAGES ((SIZE_PT_INNER * sizeof(struct pt_inner_entry) + PAGE_SIZE - 1) / PAGE_SIZE)
+
 struct pt_inner_entry {
     unsigned int valid;
     paddr_t pfn;
     off_t swap_offset; 
 };
+/*
+    count:    valid entries of the inner table, the table is freed as soon as it drops to 0
+    resident: entries whose page is in memory, with OPT_PTSWAP a table with no resident
+              entries can be written to swap (swapped keeps its PT_INNER_NPAGES offsets)
+*/
 struct pt_outer_entry {
     unsigned int valid;
     unsigned int size;
+    uint16_t count;
+    uint16_t resident;
     struct pt_inner_entry* pages;
+#if OPT_PTSWAP
+    int *swapped;
+#endif
 };
 struct pt_directory {
     unsigned int size;
@@ -44,9 +59,16 @@ struct pt_directory {
 struct pt_directory* pt_create(void);
 
 /*
-    Static function which is called whenever a new inner pt is needed (so it becames valid)
+    Static function which is called whenever a new inner pt is needed (so it becames valid),
+    ENOMEM if there is no memory for it
+*/
+int pt_define_inner(struct pt_directory* pt, vaddr_t va);
+
+/*
+    Make sure the inner table of a virtual address is in memory, defining it or reading it
+    back from swap, ENOMEM if there is no memory for it
 */
-void pt_define_inner(struct pt_directory* pt, vaddr_t va);
+int pt_load_inner(struct pt_directory* pt, vaddr_t va);
 
 /*
     Free the whole structure
@@ -56,7 +78,7 @@ void pt_destroy(struct pt_directory* pt);
 /*
     Free the given inner table
 */
-void pt_destroy_inner(struct pt_outer_entry pt_inner);
+void pt_destroy_inner(struct pt_outer_entry *pt_inner);
 
 /*
     Get the physical address having a virtual address, PFN_NOT_USED if it is not valid
@@ -71,15 +93,31 @@ off_t pt_get_offset(struct pt_directory* pt, vaddr_t va);
 
 
 /*
-    Set the offset having a virtual address 
+    Set the offset having a virtual address, the inner table must be loaded
 */
 
 void pt_set_offset(struct pt_directory* pt, vaddr_t va, off_t offset);
 
 
 /*
-    Set the physical address having a virtual address, new inner table allocation is managed
+    Set the physical address having a virtual address, the inner table must be loaded
 */
 void pt_set_pa(struct pt_directory* pt, vaddr_t va, paddr_t pa);
 
+/*
+    Invalidate the entry of a virtual address, the inner table is freed when it becomes empty.
+    The frame or the swap slot of the entry must have been released by the caller.
+    Used where a single page goes away before exit (failed load, shared text); pages are
+    otherwise released all together by pt_destroy()
+*/
+void pt_clear(struct pt_directory* pt, vaddr_t va);
+
+#if OPT_PTSWAP
+/*
+    Write to swap one inner table with no resident page, returns 1 if a table has been
+    swapped out (so its frames are free again), 0 if there was none
+*/
+int pt_swap_out_inner(struct pt_directory* pt);
+#endif
+
 #endif
\ No newline at end of file
@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include <lockprof.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -59,16 +60,19 @@ struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+	LOCKPROF(splk_prof);		    /* Contention profiler hook. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#ifdef OPT_HANGMAN
+#if OPT_HANGMAN
 #define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+				  HANGMAN_LOCKABLE_INITIALIZER \
+				  LOCKPROF_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL \
+				  LOCKPROF_INITIALIZER }
 #endif
 
 /*
@@ -81,6 +85,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Give the lock a name for the deadlock detector and the
+ *		contention profiler. NAME must stay around.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +98,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_setname(struct spinlock *lk, const char *name);
+
 
 #endif /* _SPINLOCK_H_ */
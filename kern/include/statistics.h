@@ -12,7 +12,9 @@
 #define STATISTICS_ELF_FILE_READ          7
 #define STATISTICS_SWAP_FILE_READ         8
 #define STATISTICS_SWAP_FILE_WRITE        9
-#define N_STATS                           10
+#define STATISTICS_PAGE_FAULT_SHARED      10
+#define STATISTICS_PREFAULT               11
+#define N_STATS                           12
 
 
 /* Initialize the statistics */
@@ -21,6 +23,9 @@ void init_statistics(void);
 /* Increment the specified statistic counter */
 void increment_statistics(unsigned int stat);
 
+/* Current value of the specified statistic counter */
+unsigned int get_statistics(unsigned int stat);
+
 /* Print the statistics */
 void print_all_statistics(void);
 
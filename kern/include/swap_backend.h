@@ -0,0 +1,62 @@
+#ifndef _SWAP_BACKEND_H_
+#define _SWAP_BACKEND_H_
+
+#include <types.h>
+#include <uio.h>
+
+struct vnode;
+struct device;
+
+/**
+ * A swap backend is the object that actually moves a page between a
+ * physical frame and the backing store. swapfile.c only deals with slot
+ * bookkeeping (which offsets are taken) and hands the I/O to the backend.
+ *
+ * Two backends are available:
+ *  - file: a regular file opened through the VFS (emu0:/SWAPFILE), every
+ *    page goes through VOP_READ/VOP_WRITE
+ *  - raw:  a whole lhdN: disk attached with vfs_swapon(), every page is a
+ *    single page-aligned, multi-sector DEVOP_IO on the device itself
+*/
+struct swap_backend {
+    const char *sb_name;                /* backend name, "file" or "raw" */
+    const struct swap_backend_ops *sb_ops;
+    struct vnode *sb_vnode;             /* file or raw device vnode */
+    struct device *sb_device;           /* raw backend only, NULL otherwise */
+    char *sb_path;                      /* what has been opened (kstrdup'ed) */
+    off_t sb_size;                      /* usable bytes, multiple of PAGE_SIZE */
+};
+
+/**
+ * sbo_open:  attach the backend to PATH and fill sb_size
+ * sbo_io:    move one page between frame PA and byte OFFSET of the backend
+ * sbo_close: detach, undo whatever sbo_open did
+*/
+struct swap_backend_ops {
+    int (*sbo_open)(struct swap_backend *sb, const char *path);
+    int (*sbo_io)(struct swap_backend *sb, paddr_t pa, off_t offset, enum uio_rw rw);
+    void (*sbo_close)(struct swap_backend *sb);
+};
+
+#define SWAPBE_OPEN(sb, p)          ((sb)->sb_ops->sbo_open(sb, p))
+#define SWAPBE_IO(sb, pa, off, rw)  ((sb)->sb_ops->sbo_io(sb, pa, off, rw))
+#define SWAPBE_CLOSE(sb)            ((sb)->sb_ops->sbo_close(sb))
+
+#define SWAP_DEFAULT_FILE "emu0:/SWAPFILE"
+
+/*
+    Create an unattached backend by name ("file" or "raw"), NULL if unknown or out of memory
+*/
+struct swap_backend *swap_backend_create(const char *kind);
+
+/*
+    Attach the backend to a file path (file) or to a device name such as lhd1: (raw)
+*/
+int swap_backend_open(struct swap_backend *sb, const char *path);
+
+/*
+    Close (if needed) and free the given backend
+*/
+void swap_backend_destroy(struct swap_backend *sb);
+
+#endif
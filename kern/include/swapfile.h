@@ -3,23 +3,20 @@
 
 #include <types.h>
 
-#define FILE_SIZE 9*1024*1024 //9MB
+#define FILE_SIZE 9*1024*1024 //9MB, size of a file swap area
 #define NUM_PAGES FILE_SIZE / PAGE_SIZE
 
-struct swap_page
-{
-   
-    paddr_t ppadd;
-    vaddr_t pvadd; //This is used for the swap in
-    off_t swap_offset;
-    int free; //1: free 0:taken
-
-};
+#define SWAP_MAX_AREAS 4            // areas in use at the same time
+#define SWAP_AREA_MAXPAGES 32768    // 128MB, bigger disks are used only up to here
 
 void swapfile_init(void);
+int swapfile_add(const char *kind, const char *path, int priority);
+int swapfile_remove(const char *path);
+void swapfile_print(void);
 int swap_out(paddr_t ppaddr, vaddr_t pvaddr);
 int swap_in(paddr_t ppadd, off_t offset);
+void swap_free(off_t offset);
 void swap_shutdown(void);
 int getIn(void);
 int getOut(void);
-#endif
\ No newline at end of file
+#endif
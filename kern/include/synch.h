@@ -38,6 +38,8 @@
 
 #include <spinlock.h>
 
+struct cpu;	/* from <cpu.h> */
+
 /* ------------------------------------------------------------- */
 /* G.Cabodi - 2019 - implementing locks and CVs */
 /* option "synch" needed in conf.kern (and enabled!) */
@@ -92,9 +94,15 @@ struct lock {
 	struct semaphore *lk_sem;
 #else
 	struct wchan *lk_wchan;
+	volatile struct cpu *lk_ownercpu; /* cpu lk_owner took it on */
+	volatile bool lk_handoff;	/* kept for the thread being woken */
+	unsigned lk_waiters;		/* threads in lk_wchan */
+	unsigned lk_nspins;		/* acquisitions that spun first */
+	unsigned lk_nsleeps;		/* times a thread slept on it */
 #endif
 	struct spinlock lk_lock; 
         volatile struct thread *lk_owner;
+	LOCKPROF(lk_prof);		/* contention profiler hook */
 #endif
 };
 
@@ -116,6 +124,20 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Locks are adaptive: a thread finding the lock taken by a thread that
+ * is running on another cpu spins for up to SPINS rounds before going
+ * to sleep, since the holder is likely to let it go soon. With HANDOFF
+ * set, lock_release keeps the lock for the thread it wakes up, so
+ * that spinning newcomers cannot starve the sleepers.
+ *
+ * lock_set_adaptive(0, false) gives back plain sleeping locks.
+ */
+#define LOCK_SPINS_DEFAULT 1000
+
+void lock_set_adaptive(unsigned spins, bool handoff);
+void lock_get_adaptive(unsigned *spins, bool *handoff);
+
 
 /*
  * Condition variable.
@@ -162,4 +184,55 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at the same time, or one
+ * writer. Writers are preferred: once a writer is waiting, new readers
+ * wait behind it, so a steady stream of readers cannot starve it.
+ * Both sides may sleep, so these are not for interrupt handlers.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+	struct wchan *rw_readchan;	/* readers waiting */
+	struct wchan *rw_writechan;	/* writers waiting */
+	struct wchan *rw_upgradechan;	/* the upgrading reader */
+	struct spinlock rw_lock;
+	volatile unsigned rw_readers;	/* readers holding the lock */
+	volatile unsigned rw_writers_waiting;
+	volatile struct thread *rw_writer; /* writer holding the lock */
+	volatile struct thread *rw_upgrader; /* reader becoming a writer */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared with other readers.
+ *    rwlock_release_read  - Give back a read hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Give back the exclusive hold.
+ *    rwlock_upgrade       - Turn our read hold into a write hold, waiting
+ *                           for the other readers to leave. Fails, still
+ *                           holding the lock for reading, if another
+ *                           reader is already upgrading (both would
+ *                           wait for each other): then release and
+ *                           acquire for writing, and look again.
+ *    rwlock_downgrade     - Turn our write hold into a read hold,
+ *                           letting the waiting readers in.
+ *    rwlock_do_i_write    - True if the current thread is the writer.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -66,8 +66,26 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 #if OPT_FILE
 struct openfile;
 void openfileIncrRefCount(struct openfile *of);
+void openfileDecrRefCount(struct openfile *of);
 int sys_open(userptr_t path, int openflags, mode_t mode, int *errp);
 int sys_close(int fd);
+int sys_pipe(userptr_t fds_ptr, int *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t offset,
+              int *retval);
+int sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t offset,
+               int *retval);
+int sys_readv(int fd, userptr_t iov_ptr, int iovcnt, int *retval);
+int sys_writev(int fd, userptr_t iov_ptr, int iovcnt, int *retval);
+int sys_copy_file_range(int infd, userptr_t inoff_ptr, int outfd,
+                        userptr_t outoff_ptr, size_t len, unsigned flags,
+                        int *retval);
+int file_rw(int fd, userptr_t buf_ptr, size_t size, off_t offset, bool write,
+            int *retval);
+int sys_fsync(int fd);
+int sys_aio_setup(userptr_t ring_ptr, unsigned entries, int *retval);
+int sys_aio_enter(unsigned to_submit, unsigned min_complete, int *retval);
 #endif
 int sys_write(int fd, userptr_t buf_ptr, size_t size);
 int sys_read(int fd, userptr_t buf_ptr, size_t size);
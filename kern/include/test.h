@@ -54,6 +54,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int lockbench(int, char **);
+int spinlockbench(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -79,6 +81,14 @@ int semu20(int, char **);
 int semu21(int, char **);
 int semu22(int, char **);
 
+/* rwlock unit tests */
+int rwu1(int, char **);
+int rwu2(int, char **);
+int rwu3(int, char **);
+int rwu4(int, char **);
+int rwu5(int, char **);
+int rwu6(int, char **);
+
 /* filesystem tests */
 int fstest(int, char **);
 int readstress(int, char **);
@@ -93,7 +103,15 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
+int kmemcachetest(int, char **);
 int nettest(int, char **);
+int swapbench(int, char **);
+int schedbench(int, char **);
+int sleeptest(int, char **);
+int workqueuetest(int, char **);
+int pipebench(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
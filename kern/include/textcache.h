@@ -0,0 +1,43 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <types.h>
+
+struct vnode;
+struct segment;
+struct pt_directory;
+
+/**
+ * Cache of the resident read-only pages of executables, indexed by
+ * (vnode, virtual address). Every process running the same executable
+ * maps the same frames, which are reference counted in the coremap.
+ * Writing an executable invalidates its cached pages.
+*/
+
+/*
+    Only read-only segments loaded from a file are shared
+*/
+int textcache_shareable(struct segment *seg);
+
+/*
+    Frame caching the page at VA of file VN with a new reference taken on it, 0 if not cached
+*/
+paddr_t textcache_lookup(struct vnode *vn, vaddr_t va);
+
+/*
+    Make the frame PA just loaded with the page at VA of file VN available to other processes.
+    If someone else cached the same page meanwhile, PA is freed and the cached frame is returned
+*/
+paddr_t textcache_insert(struct vnode *vn, vaddr_t va, paddr_t pa);
+
+/*
+    File VN has been written or truncated, its cached pages are not handed out anymore
+*/
+void textcache_invalidate(struct vnode *vn);
+
+/*
+    Drop the references of the page table PT on the shared pages of SEG, clearing their entries
+*/
+void textcache_unmap_segment(struct segment *seg, struct pt_directory *pt);
+
+#endif
@@ -46,14 +46,19 @@ struct cpu;
 #include <machine/thread.h>
 
 
-/* Size of kernel stacks; must be power of 2 */
+/*
+ * Default (and smallest) size of kernel stacks. The size actually used
+ * for new threads can be raised at boot, see thread_set_stacksize.
+ */
 #define STACK_SIZE 4096
 
-/* Mask for extracting the stack base address of a kernel stack pointer */
-#define STACK_MASK  (~(vaddr_t)(STACK_SIZE-1))
+/* Largest kernel stack thread_set_stacksize accepts */
+#define STACK_SIZE_MAX (64*1024)
 
-/* Macro to test if two addresses are on the same kernel stack */
-#define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
+/* Macro to test if an address is on the kernel stack of thread T */
+#define ON_STACK(t, p) \
+	((vaddr_t)(p) >= (vaddr_t)(t)->t_stack && \
+	 (vaddr_t)(p) < (vaddr_t)(t)->t_stack + (t)->t_stacksize)
 
 
 /* States a thread can be in. */
@@ -80,11 +85,20 @@ struct thread {
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
+	size_t t_stacksize;		/* Size of t_stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields (see "Scheduler" in thread.c).
+	 */
+	unsigned t_priority;		/* Run queue level, 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_enqueued;		/* c_hardclocks when queued, for aging */
+	unsigned t_lastrun;		/* c_hardclocks when last switched out */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -125,6 +139,18 @@ void thread_bootstrap(void);
 /* Call late in system startup to get secondary CPUs running. */
 void thread_start_cpus(void);
 
+/*
+ * Set the kernel stack size of threads created from now on: a multiple
+ * of PAGE_SIZE between STACK_SIZE and STACK_SIZE_MAX. Existing threads
+ * keep their stacks. Meant to be used at boot, from the kernel
+ * arguments (e.g. "stacksize 16384; ...").
+ */
+int thread_set_stacksize(size_t size);
+size_t thread_get_stacksize(void);
+
+/* Print the state of the per-cpu kernel stack pools */
+void thread_stackpool_printstats(void);
+
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
 
@@ -164,10 +190,30 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge a clock tick to the current thread; true if it should yield.
+ * Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Scheduling policies: multilevel feedback queue (the default), or
+ * plain round robin with a one tick quantum.
+ */
+#define SCHED_MLFQ	0
+#define SCHED_RR	1
+
+void thread_set_schedpolicy(int policy);
+int thread_get_schedpolicy(void);
+
+/*
+ * Print the per-cpu scheduler counters (steals, idle time).
+ */
+void thread_printcpustats(void);
+
+/*
+ * Number of cpus running threads.
  */
-void thread_consider_migration(void);
+unsigned thread_ncpus(void);
 
 
 #endif /* _THREAD_H_ */
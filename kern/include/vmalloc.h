@@ -0,0 +1,52 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include <types.h>
+#include <vm.h>
+
+/**
+ * Kernel allocations that do not need physically contiguous frames.
+ *
+ * Each page is a frame of its own, mapped into a window of kseg2 through
+ * a kernel page table; the TLB entries are loaded by vm_fault() like the
+ * user ones. kmalloc() falls back here when alloc_kpages() cannot find
+ * enough contiguous frames, so the memory must not be handed to devices.
+*/
+
+#define VMALLOC_BASE    MIPS_KSEG2
+#define VMALLOC_NPAGES  2048                            /* 8MB window */
+#define VMALLOC_END     (VMALLOC_BASE + VMALLOC_NPAGES * PAGE_SIZE)
+
+#define VMALLOC_OWNS(va) ((vaddr_t)(va) >= VMALLOC_BASE && (vaddr_t)(va) < VMALLOC_END)
+
+/*
+    Set up the kernel page table, called by vm_bootstrap() once kmalloc works
+*/
+void vmalloc_bootstrap(void);
+
+/*
+    Map SIZE bytes of scattered frames, NULL if either frames or window space are missing
+*/
+void *vmalloc(size_t size);
+
+/*
+    Unmap and free an allocation returned by vmalloc()
+*/
+void vfree(void *ptr);
+
+/*
+    Frame mapped at VA inside the window, 0 if none. Used by vm_fault()
+*/
+paddr_t vmalloc_lookup(vaddr_t va);
+
+/*
+    Physical address of any kernel address, direct mapped (kseg0) or inside the window
+*/
+paddr_t kvaddr_to_paddr(vaddr_t kva);
+
+/*
+    Print the window usage (kh)
+*/
+void vmalloc_printstats(void);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <vm.h>
 
+struct addrspace;
+
 #define VMC1_STACKPAGES 12
 
 void vm_bootstrap(void);
@@ -11,6 +13,7 @@ void vm_shutdown(void);
 
 // TODO: https://cgi.cse.unsw.edu.au/~cs3231/14s1/lectures/asst3x6.pdf, slide 19
 int vm_fault(int faulttype, vaddr_t faultaddress);
+int vm_prefault(struct addrspace *as, vaddr_t va);
 void vm_tlbshootdown(const struct tlbshootdown *ts);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Workqueues: deferred work run by kernel worker threads.
+ *
+ * A path that cannot afford to do something expensive right now (an
+ * interrupt handler, a process that is exiting, a page fault) fills
+ * in a struct work and queues it; one of the workers of the queue
+ * calls W_FUNC(W_ARG) later, in thread context, where it may sleep.
+ *
+ * Each workqueue keeps one list of pending work per CPU, with its own
+ * spinlock and its own worker thread, so CPUs queueing work do not
+ * contend with each other. Work goes on the list of the CPU that
+ * queues it. A worker takes its whole list at once and runs it as a
+ * batch, so a burst of work costs one wakeup.
+ *
+ * work_queue() can be called from interrupt handlers. A work item
+ * can be pending only once: queueing it again before it has started
+ * running does nothing. The struct work belongs to the caller and
+ * must stay around until the function has been called (the function
+ * itself may free it) or work_cancel() returned true.
+ *
+ * work_queue_delayed() puts the work on the list only after DELAY_NS
+ * nanoseconds, through a timeout (see clock.h); it fails with
+ * EBUSY if the work is already pending and ENOMEM if the timeout
+ * queue cannot grow.
+ *
+ * workqueue_flush() waits until all the work queued before the call
+ * has run; delayed work still waiting on its timeout is not waited
+ * for. workqueue_destroy() runs what is still queued before the
+ * workers exit, but delayed work must have been cancelled.
+ */
+
+#include <spinlock.h>
+#include <clock.h>
+
+struct workqueue;
+struct wq_cpu;
+
+struct work {
+	void (*w_func)(void *);
+	void *w_arg;
+	volatile spinlock_data_t w_pending;	/* queued or delayed */
+	struct work *w_next;		/* on the list of W_CPU */
+	struct wq_cpu *w_cpu;
+	struct workqueue *w_wq;		/* for delayed work */
+	struct timeout w_timeout;
+};
+
+void work_init(struct work *w, void (*func)(void *), void *arg);
+bool work_queue(struct workqueue *wq, struct work *w);
+int work_queue_delayed(struct workqueue *wq, struct work *w,
+		       uint64_t delay_ns);
+bool work_cancel(struct work *w);
+
+struct workqueue *workqueue_create(const char *name);
+void workqueue_destroy(struct workqueue *wq);
+int workqueue_flush(struct workqueue *wq);
+void workqueue_printstats(struct workqueue *wq);
+
+/*
+ * The queue for general use, created by workqueue_bootstrap() once
+ * all the CPUs are up. NULL before that.
+ */
+extern struct workqueue *system_wq;
+
+void workqueue_bootstrap(void);
+
+#endif /* _WORKQUEUE_H_ */
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <workqueue.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -111,6 +112,7 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	kheap_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -131,6 +133,7 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -38,13 +38,22 @@
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
+#include <vm.h>
 #include <proc.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <kmem_cache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-os161vm.h"
+#include "opt-lockprof.h"
+#if OPT_OS161VM
+#include <swapfile.h>
+#include <statistics.h>
+#include <prefault.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -338,6 +347,61 @@ cmd_deadlock(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for setting the kernel stack size of new threads, or printing
+ * it and the stack pools with no arguments. Meant for the boot command
+ * line, before the threads that need the bigger stacks are created.
+ */
+static
+int
+cmd_stacksize(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("kernel stack size: %u bytes\n",
+			thread_get_stacksize());
+		thread_stackpool_printstats();
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: stacksize [bytes]\n");
+		return EINVAL;
+	}
+
+	result = thread_set_stacksize(atoi(args[1]));
+	if (result) {
+		kprintf("stacksize: multiple of %u from %u to %u bytes\n",
+			PAGE_SIZE, STACK_SIZE, STACK_SIZE_MAX);
+	}
+	return result;
+}
+
+/*
+ * Command for choosing the scheduling policy, or printing the current
+ * one with no arguments.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("scheduler: %s\n",
+			thread_get_schedpolicy() == SCHED_MLFQ ? "mlfq" : "rr");
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "mlfq")) {
+		thread_set_schedpolicy(SCHED_MLFQ);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "rr")) {
+		thread_set_schedpolicy(SCHED_RR);
+		return 0;
+	}
+	kprintf("Usage: sched [mlfq|rr]\n");
+	return EINVAL;
+}
+
 /*
  * Command for shutting down.
  */
@@ -448,6 +512,133 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+#if OPT_OS161VM
+/*
+ * Command for adding a swap area, or listing them with no arguments.
+ *
+ * "swapon file path [prio]" swaps to a file, "swapon raw lhdN [prio]"
+ * swaps straight to the blocks of a disk that holds no filesystem.
+ * Areas with higher priority are filled first.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	int priority = 0;
+
+	if (nargs == 1) {
+		swapfile_print();
+		return 0;
+	}
+	if (nargs < 3 || nargs > 4) {
+		kprintf("Usage: swapon [file|raw path|device [priority]]\n");
+		return EINVAL;
+	}
+	if (nargs == 4) {
+		priority = atoi(args[3]);
+	}
+
+	return swapfile_add(args[1], args[2], priority);
+}
+
+/*
+ * Command for removing a swap area.
+ */
+static
+int
+cmd_swapoff(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapoff path|device\n");
+		return EINVAL;
+	}
+
+	return swapfile_remove(args[1]);
+}
+
+/*
+ * Command for choosing the prefault policy of the next execs, or
+ * printing the current one with no arguments.
+ */
+static
+int
+cmd_prefault(int nargs, char **args)
+{
+	int policy;
+
+	if (nargs == 1) {
+		kprintf("prefault policy: %s\n",
+			prefault_policy_name(prefault_get_policy()));
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: prefault [demand|text|all|learned]\n");
+		return EINVAL;
+	}
+
+	policy = prefault_policy_by_name(args[1]);
+	if (policy < 0) {
+		kprintf("Usage: prefault [demand|text|all|learned]\n");
+		return EINVAL;
+	}
+	return prefault_set_policy(policy);
+}
+
+/*
+ * Prefault benchmark: runs the same program once under each policy and
+ * prints the elapsed time together with the fault counters of the run.
+ * Demand goes first, so that learned replays the pages of the earlier runs.
+ */
+static
+int
+cmd_prefaultbench(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned faults, elf, zero, prefaulted;
+	int oldpolicy, policy, result = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: pfb program\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "pfb" */
+	args++;
+	nargs--;
+
+	oldpolicy = prefault_get_policy();
+	for (policy = 0; policy < PREFAULT_NPOLICIES; policy++) {
+		prefault_set_policy(policy);
+
+		faults = get_statistics(STATISTICS_TLB_FAULT);
+		elf = get_statistics(STATISTICS_ELF_FILE_READ);
+		zero = get_statistics(STATISTICS_PAGE_FAULT_ZERO);
+		prefaulted = get_statistics(STATISTICS_PREFAULT);
+
+		gettime(&before);
+		result = common_prog(nargs, args);
+		gettime(&after);
+		if (result) {
+			break;
+		}
+		timespec_sub(&after, &before, &duration);
+
+		kprintf("pfb: %-7s %llu.%09lu s  tlb faults %u  elf reads %u  "
+			"zero fills %u  prefaulted %u\n",
+			prefault_policy_name(policy),
+			(unsigned long long) duration.tv_sec,
+			(unsigned long) duration.tv_nsec,
+			get_statistics(STATISTICS_TLB_FAULT) - faults,
+			get_statistics(STATISTICS_ELF_FILE_READ) - elf,
+			get_statistics(STATISTICS_PAGE_FAULT_ZERO) - zero,
+			get_statistics(STATISTICS_PREFAULT) - prefaulted);
+	}
+	prefault_set_policy(oldpolicy);
+
+	return result;
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -456,10 +647,51 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printcpustats();
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+#define LOCKSTAT_TOP 10
+
+/*
+ * lockstat [n | reset]
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else if (nargs == 2) {
+		lockprof_print(atoi(args[1]));
+	}
+	else if (nargs == 1) {
+		lockprof_print(LOCKSTAT_TOP);
+	}
+	else {
+		kprintf("Usage: lockstat [n | reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -531,6 +763,13 @@ static const char *opsmenu[] = {
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
+	"[stacksize] Set/show kernel stacks  ",
+	"[sched]   Set/show scheduler        ",
+#if OPT_OS161VM
+	"[swapon]  Add/list swap areas       ",
+	"[swapoff] Remove a swap area        ",
+	"[prefault] Set/show prefault policy ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -555,17 +794,31 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc throughput test       ",
+	"[km6] vmalloc test                  ",
+	"[kmc] Object cache test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[sb]  Scheduling latency benchmark  ",
+	"[slt] Timed sleep test              ",
+	"[wqt] Workqueue test                ",
+	"[pipeb] Pipe throughput benchmark   ",
 #if OPT_NET
 	"[net] Network test                  ",
+#endif
+#if OPT_OS161VM
+	"[swb] Swap backend benchmark        ",
+	"[pfb] Prefault policy benchmark     ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[lkb] Contended lock benchmark      ",
+	"[splb] Spinlock benchmark           ",
 	"[semu1-22] Semaphore unit tests     ",
+	"[rwu1-6] Rwlock unit tests          ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -596,6 +849,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[cpus] Per-cpu scheduler stats      ",
+#if OPT_LOCKPROF
+	"[lockstat] Most contended locks     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -639,6 +896,13 @@ static struct {
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
+	{ "stacksize",	cmd_stacksize },
+	{ "sched",	cmd_sched },
+#if OPT_OS161VM
+	{ "swapon",	cmd_swapon },
+	{ "swapoff",	cmd_swapoff },
+	{ "prefault",	cmd_prefault },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -647,6 +911,10 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "cpus",       cmd_cpustats },
+#if OPT_LOCKPROF
+	{ "lockstat",   cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -657,18 +925,31 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
+	{ "kmc",	kmemcachetest },
 #if OPT_NET
 	{ "net",	nettest },
+#endif
+#if OPT_OS161VM
+	{ "swb",	swapbench },
+	{ "pfb",	cmd_prefaultbench },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "sb",		schedbench },
+	{ "slt",	sleeptest },
+	{ "wqt",	workqueuetest },
+	{ "pipeb",	pipebench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "lkb",	lockbench },
+	{ "splb",	spinlockbench },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -694,6 +975,14 @@ static struct {
 	{ "semu21",	semu21 },
 	{ "semu22",	semu22 },
 
+	/* rwlock unit tests */
+	{ "rwu1",	rwu1 },
+	{ "rwu2",	rwu2 },
+	{ "rwu3",	rwu3 },
+	{ "rwu4",	rwu4 },
+	{ "rwu5",	rwu5 },
+	{ "rwu6",	rwu6 },
+
 	/* file system assignment tests */
 	{ "fs1",	fstest },
 	{ "fs2",	readstress },
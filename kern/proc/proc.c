@@ -43,29 +43,153 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <syscall.h>
+#include <kmem_cache.h>
+#include <limits.h>
 #if OPT_WAITPID
 #include <synch.h>
 
-#define MAX_PROC 100
+/*
+ * The process table is indexed by pid and grows (doubling) as needed,
+ * up to PID_MAX. Free pids wait in a FIFO: allocation pops the head,
+ * release pushes at the tail, both O(1). The table grows before fewer
+ * than PID_REUSE_DELAY pids are left free, and the new pids go in
+ * front of the old ones, so a pid is not handed out again until at
+ * least PID_REUSE_DELAY others have been (unless the table is full
+ * size). The kernel process has pid 1 and is not in the table.
+ */
+#define PROCTABLE_INIT  64
+#define PROCTABLE_MAX   (PID_MAX+1)
+#define PID_REUSE_DELAY 16
+#define PID_KERNEL      1
+
 static struct _processTable {
   int active;           /* initial value 0 */
-  struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
-  int last_i;           /* index of last allocated pid */
-  struct spinlock lk;	/* Lock for this table */
+  struct proc **proc;   /* [pid], pids below PID_MIN not used */
+  unsigned size;
+  pid_t *freepids;      /* FIFO of free pids, SIZE places */
+  unsigned freehead;
+  unsigned nfree;
+  struct rwlock *lk;	/* Lock for this table: lookups read, the rest write */
 } processTable;
 
+/*
+ * Grow the table to NEWSIZE, with the new pids first in the free
+ * FIFO. Called with the table locked for writing.
+ */
+static int
+proctable_grow(unsigned newsize) {
+  struct proc **newproc;
+  pid_t *newfree;
+  unsigned i, n, oldsize = processTable.size;
+
+  KASSERT(newsize > oldsize && newsize <= PROCTABLE_MAX);
+  newproc = kmalloc(newsize*sizeof(struct proc *));
+  newfree = kmalloc(newsize*sizeof(pid_t));
+  if (newproc==NULL || newfree==NULL) {
+    kfree(newproc);
+    kfree(newfree);
+    return ENOMEM;
+  }
+
+  for (i=0; i<oldsize; i++) {
+    newproc[i] = processTable.proc[i];
+  }
+  n = 0;
+  for (i=oldsize; i<newsize; i++) {
+    newproc[i] = NULL;
+    if (i >= PID_MIN) newfree[n++] = i;
+  }
+  for (i=0; i<processTable.nfree; i++) {
+    newfree[n++] =
+      processTable.freepids[(processTable.freehead+i) % oldsize];
+  }
+
+  kfree(processTable.proc);
+  kfree(processTable.freepids);
+  processTable.proc = newproc;
+  processTable.freepids = newfree;
+  processTable.size = newsize;
+  processTable.freehead = 0;
+  processTable.nfree = n;
+  return 0;
+}
+
 #endif
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Proc structures come from an object cache: the spinlock and the
+ * waitpid synchronization objects are made by the constructor and
+ * survive from one process to the next.
+ */
+static int proc_ctor(void *obj);
+static void proc_dtor(void *obj);
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor);
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_init(&proc->p_lock);
+#if OPT_WAITPID
+#if USE_SEMAPHORE_FOR_WAITPID
+	proc->p_sem = sem_create("proc", 0);
+	if (proc->p_sem == NULL) {
+		spinlock_cleanup(&proc->p_lock);
+		return ENOMEM;
+	}
+#else
+	proc->p_cv = cv_create("proc");
+	proc->p_lock = lock_create("proc");
+	if (proc->p_cv == NULL || proc->p_lock == NULL) {
+		if (proc->p_cv != NULL) {
+			cv_destroy(proc->p_cv);
+		}
+		if (proc->p_lock != NULL) {
+			lock_destroy(proc->p_lock);
+		}
+		spinlock_cleanup(&proc->p_lock);
+		return ENOMEM;
+	}
+#endif
+#endif
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_WAITPID
+#if USE_SEMAPHORE_FOR_WAITPID
+	if (proc->p_sem != NULL) {
+		sem_destroy(proc->p_sem);
+	}
+#else
+	cv_destroy(proc->p_cv);
+	lock_destroy(proc->p_lock);
+#endif
+#endif
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * G.Cabodi - 2019
  * Initialize support for pid/waitpid.
@@ -73,10 +197,14 @@ struct proc *kproc;
 struct proc *
 proc_search_pid(pid_t pid) {
 #if OPT_WAITPID
-  struct proc *p;
-  KASSERT(pid>=0&&pid<MAX_PROC);
-  p = processTable.proc[pid];
-  KASSERT(p->p_pid==pid);
+  struct proc *p = NULL;
+  /* lookups run in parallel, they only exclude pid allocation/release */
+  rwlock_acquire_read(processTable.lk);
+  if (pid>=PID_MIN && (unsigned)pid<processTable.size) {
+    p = processTable.proc[pid];
+    KASSERT(p==NULL || p->p_pid==pid);
+  }
+  rwlock_release_read(processTable.lk);
   return p;
 #else
   (void)pid;
@@ -88,40 +216,49 @@ proc_search_pid(pid_t pid) {
  * G.Cabodi - 2019
  * Initialize support for pid/waitpid.
  */
-static void
+static int
 proc_init_waitpid(struct proc *proc, const char *name) {
 #if OPT_WAITPID
-  /* search a free index in table using a circular strategy */
-  int i;
-  spinlock_acquire(&processTable.lk);
-  i = processTable.last_i+1;
-  proc->p_pid = 0;
-  if (i>MAX_PROC) i=1;
-  while (i!=processTable.last_i) {
-    if (processTable.proc[i] == NULL) {
-      processTable.proc[i] = proc;
-      processTable.last_i = i;
-      proc->p_pid = i;
-      break;
-    }
-    i++;
-    if (i>MAX_PROC) i=1;
+  unsigned newsize;
+  pid_t pid;
+
+  proc->p_status = 0;
+  if (kproc == NULL) {
+    /* the kernel process, made before the table */
+    proc->p_pid = PID_KERNEL;
   }
-  spinlock_release(&processTable.lk);
-  if (proc->p_pid==0) {
-    panic("too many processes. proc table is full\n");
+  else {
+    rwlock_acquire_write(processTable.lk);
+    if (processTable.nfree < PID_REUSE_DELAY &&
+        processTable.size < PROCTABLE_MAX) {
+      newsize = processTable.size*2;
+      if (newsize > PROCTABLE_MAX) newsize = PROCTABLE_MAX;
+      /* out of memory is only fatal with no pid left at all */
+      (void)proctable_grow(newsize);
+    }
+    if (processTable.nfree == 0) {
+      rwlock_release_write(processTable.lk);
+      return EAGAIN;
+    }
+    pid = processTable.freepids[processTable.freehead];
+    processTable.freehead = (processTable.freehead+1) % processTable.size;
+    processTable.nfree--;
+    KASSERT(processTable.proc[pid] == NULL);
+    processTable.proc[pid] = proc;
+    proc->p_pid = pid;
+    rwlock_release_write(processTable.lk);
   }
-  proc->p_status = 0;
+  /* the synchronization objects come from proc_ctor */
 #if USE_SEMAPHORE_FOR_WAITPID
-  proc->p_sem = sem_create(name, 0);
-#else
-  proc->p_cv = cv_create(name);
-  proc->p_lock = lock_create(name);
+  if (proc->p_sem == NULL) {
+    proc->p_sem = sem_create(name, 0);
+  }
 #endif
 #else
   (void)proc;
   (void)name;
 #endif
+  return 0;
 }
 
 /*
@@ -131,19 +268,23 @@ proc_init_waitpid(struct proc *proc, const char *name) {
 static void
 proc_end_waitpid(struct proc *proc) {
 #if OPT_WAITPID
-  /* remove the process from the table */
-  int i;
-  spinlock_acquire(&processTable.lk);
-  i = proc->p_pid;
-  KASSERT(i>0 && i<=MAX_PROC);
-  processTable.proc[i] = NULL;
-  spinlock_release(&processTable.lk);
+  /* remove the process from the table, its pid goes at the end of the FIFO */
+  pid_t pid = proc->p_pid;
+  rwlock_acquire_write(processTable.lk);
+  KASSERT(pid>=PID_MIN && (unsigned)pid<processTable.size);
+  KASSERT(processTable.proc[pid] == proc);
+  processTable.proc[pid] = NULL;
+  processTable.freepids[(processTable.freehead+processTable.nfree) %
+                        processTable.size] = pid;
+  processTable.nfree++;
+  rwlock_release_write(processTable.lk);
 
 #if USE_SEMAPHORE_FOR_WAITPID
-  sem_destroy(proc->p_sem);
-#else
-  cv_destroy(proc->p_cv);
-  lock_destroy(proc->p_lock);
+  /* a semaphore left signalled (nobody waited) cannot be reused */
+  if (proc->p_sem->sem_count != 0) {
+    sem_destroy(proc->p_sem);
+    proc->p_sem = NULL;
+  }
 #endif
 #else
   (void)proc;
@@ -159,18 +300,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -178,9 +318,19 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-	proc_init_waitpid(proc,name);
+	if (proc_init_waitpid(proc,name)) {
+		/* no pid left */
+		kfree(proc->p_name);
+		kmem_cache_free(&proc_cache, proc);
+		return NULL;
+	}
 #if OPT_FILE
         bzero(proc->fileTable,OPEN_MAX*sizeof(struct openfile *));
+        bzero(proc->fdMap,sizeof(proc->fdMap));
+        /* stdin/out/err go to the console, they are never in fileTable */
+        proc->fdMap[0] = (1U << STDIN_FILENO) | (1U << STDOUT_FILENO) |
+                         (1U << STDERR_FILENO);
+        proc->p_aio = NULL;
 #endif
 	return proc;
 }
@@ -267,12 +417,15 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
+#if OPT_FILE
+	KASSERT(proc->p_aio == NULL);
+	proc_file_table_close(proc);
+#endif
 	proc_end_waitpid(proc);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 
 /*
@@ -286,7 +439,13 @@ proc_bootstrap(void)
 		panic("proc_create for kproc failed\n");
 	}
 #if OPT_WAITPID
-	spinlock_init(&processTable.lk);
+	processTable.lk = rwlock_create("processTable");
+	if (processTable.lk == NULL) {
+		panic("proc_bootstrap: cannot create the process table lock\n");
+	}
+	if (proctable_grow(PROCTABLE_INIT)) {
+		panic("proc_bootstrap: cannot create the process table\n");
+	}
 	/* kernel process is not registered in the table */
 	processTable.active = 1;
 #endif
@@ -476,6 +635,8 @@ proc_signal_end(struct proc *proc)
 void 
 proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
   int fd;
+  /* other threads of psrc (aio) may be opening and closing meanwhile */
+  spinlock_acquire(&psrc->p_lock);
   for (fd=0; fd<OPEN_MAX; fd++) {
     struct openfile *of = psrc->fileTable[fd];
     pdest->fileTable[fd] = of;
@@ -484,5 +645,24 @@ proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
       openfileIncrRefCount(of);
     }
   }
+  memcpy(pdest->fdMap, psrc->fdMap, sizeof(pdest->fdMap));
+  spinlock_release(&psrc->p_lock);
+}
+
+/* drop the files still open when the process goes away */
+void
+proc_file_table_close(struct proc *proc) {
+  int fd;
+  for (fd=0; fd<OPEN_MAX; fd++) {
+    struct openfile *of;
+    /* the last reference closes the vnode: not under the spinlock */
+    spinlock_acquire(&proc->p_lock);
+    of = proc->fileTable[fd];
+    proc->fileTable[fd] = NULL;
+    spinlock_release(&proc->p_lock);
+    if (of != NULL) {
+      openfileDecrRefCount(of);
+    }
+  }
 }
 #endif
\ No newline at end of file
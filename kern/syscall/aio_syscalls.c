@@ -0,0 +1,302 @@
+/*
+ * Asynchronous I/O rings, see <kern/aio.h> and aio.h.
+ *
+ * aio_enter() copies the new submissions into ac_pending and wakes the
+ * workers. Each worker takes one request, runs it with the usual
+ * file system calls (it belongs to the process, so descriptors and
+ * user buffers are those of the process) and writes its completion.
+ * There are never more requests in flight than free completion
+ * entries, so the completion ring cannot overflow.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <aio.h>
+
+#if OPT_FILE
+
+struct aio_ctx {
+  userptr_t ac_ring;             /* the process's struct aio_ring */
+  unsigned ac_entries;
+
+  struct lock *ac_lock;          /* protects everything below */
+  struct cv *ac_workcv;          /* workers wait here for requests */
+  struct cv *ac_donecv;          /* aio_enter waits here for completions */
+  struct aio_sqe *ac_pending;    /* taken from the ring, not started */
+  unsigned ac_phead;
+  unsigned ac_pcount;
+  unsigned ac_sqhead;            /* our copy of ar_sqhead */
+  unsigned ac_cqtail;            /* our copy of ar_cqtail */
+  unsigned ac_inflight;          /* taken from the ring, not completed */
+  bool ac_dying;
+  unsigned ac_nworkers;
+  struct semaphore *ac_exited;   /* V()ed by each worker on the way out */
+};
+
+#define AIO_FIELD(ac, f) ((userptr_t)&((struct aio_ring *)(ac)->ac_ring)->f)
+
+/*
+ * Run one request, the result goes in cqe_res. The file calls hold a
+ * reference to the open file while they use it, so the process can
+ * close the descriptor meanwhile.
+ */
+static int
+aio_run(struct aio_sqe *sqe)
+{
+  int n = 0, result;
+
+  switch (sqe->sqe_op) {
+  case AIO_OP_NOP:
+    return 0;
+  case AIO_OP_READ:
+  case AIO_OP_WRITE:
+    result = file_rw(sqe->sqe_fd, sqe->sqe_buf, sqe->sqe_len,
+                     sqe->sqe_offset, sqe->sqe_op == AIO_OP_WRITE, &n);
+    return result ? -result : n;
+  case AIO_OP_FSYNC:
+    return -sys_fsync(sqe->sqe_fd);
+  default:
+    return -EINVAL;
+  }
+}
+
+/* write a completion, with ac_lock held */
+static void
+aio_complete(struct aio_ctx *ac, unsigned data, int res)
+{
+  struct aio_cqe cqe;
+  struct aio_cqe *cqes;
+
+  cqe.cqe_data = data;
+  cqe.cqe_res = res;
+  cqes = AIO_RING_CQES(ac->ac_ring, ac->ac_entries);
+  /* nothing to be done if the process unmapped its ring */
+  (void)copyout(&cqe, (userptr_t)&cqes[ac->ac_cqtail % ac->ac_entries],
+                sizeof(cqe));
+  ac->ac_cqtail++;
+  (void)copyout(&ac->ac_cqtail, AIO_FIELD(ac, ar_cqtail), sizeof(unsigned));
+
+  KASSERT(ac->ac_inflight > 0);
+  ac->ac_inflight--;
+  cv_broadcast(ac->ac_donecv, ac->ac_lock);
+}
+
+static void
+aio_worker(void *p, unsigned long num)
+{
+  struct aio_ctx *ac = p;
+  struct aio_sqe sqe;
+  int res;
+
+  (void)num;
+
+  lock_acquire(ac->ac_lock);
+  while (1) {
+    while (ac->ac_pcount == 0 && !ac->ac_dying) {
+      cv_wait(ac->ac_workcv, ac->ac_lock);
+    }
+    if (ac->ac_dying) break;
+
+    sqe = ac->ac_pending[ac->ac_phead];
+    ac->ac_phead = (ac->ac_phead + 1) % ac->ac_entries;
+    ac->ac_pcount--;
+    lock_release(ac->ac_lock);
+
+    res = aio_run(&sqe);
+
+    lock_acquire(ac->ac_lock);
+    aio_complete(ac, sqe.sqe_data, res);
+  }
+  lock_release(ac->ac_lock);
+
+  /* leave the process now, it may be destroyed once we are all out */
+#if OPT_WAITPID
+  proc_remthread(curthread);
+#endif
+  V(ac->ac_exited);
+  thread_exit();
+}
+
+/* stop the workers and free AC; requests not yet started are dropped */
+static void
+aio_ctx_destroy(struct aio_ctx *ac)
+{
+  unsigned i;
+
+  lock_acquire(ac->ac_lock);
+  ac->ac_dying = true;
+  cv_broadcast(ac->ac_workcv, ac->ac_lock);
+  lock_release(ac->ac_lock);
+  for (i=0; i<ac->ac_nworkers; i++) {
+    P(ac->ac_exited);
+  }
+
+  sem_destroy(ac->ac_exited);
+  cv_destroy(ac->ac_donecv);
+  cv_destroy(ac->ac_workcv);
+  lock_destroy(ac->ac_lock);
+  kfree(ac->ac_pending);
+  kfree(ac);
+}
+
+/*
+ * Requests cannot be interrupted: one waiting for the process itself
+ * (a read from its own pipe, say) would never end. So the descriptors
+ * are closed first: such a request gets EOF or EPIPE, and no new one
+ * is started once ac_dying is set.
+ */
+void
+aio_destroy(struct proc *p)
+{
+  struct aio_ctx *ac = p->p_aio;
+
+  if (ac == NULL) return;
+  p->p_aio = NULL;
+
+  lock_acquire(ac->ac_lock);
+  ac->ac_dying = true;
+  cv_broadcast(ac->ac_workcv, ac->ac_lock);
+  lock_release(ac->ac_lock);
+  proc_file_table_close(p);
+
+  aio_ctx_destroy(ac);
+}
+
+int
+sys_aio_setup(userptr_t ring_ptr, unsigned entries, int *retval)
+{
+  struct aio_ctx *ac;
+  struct aio_ring ring;
+  size_t size, stoplen;
+  unsigned i;
+  int result;
+
+  if (curproc->p_aio != NULL) return EBUSY;
+  if (entries == 0 || entries > AIO_MAX_ENTRIES ||
+      (entries & (entries - 1)) != 0) return EINVAL;
+  // entries hold off_t
+  if ((vaddr_t)ring_ptr % sizeof(off_t) != 0) return EINVAL;
+  size = AIO_RING_SIZE(entries);
+  result = copycheck(ring_ptr, size, &stoplen);
+  if (result==0 && stoplen != size) result = EFAULT;
+  if (result) return result;
+
+  ring.ar_sqhead = ring.ar_sqtail = 0;
+  ring.ar_cqhead = ring.ar_cqtail = 0;
+  ring.ar_entries = entries;
+  ring.ar_pad = 0;
+  result = copyout(&ring, ring_ptr, sizeof(ring));
+  if (result) return result;
+
+  ac = kmalloc(sizeof(*ac));
+  if (ac==NULL) return ENOMEM;
+  ac->ac_ring = ring_ptr;
+  ac->ac_entries = entries;
+  ac->ac_pending = kmalloc(entries * sizeof(struct aio_sqe));
+  ac->ac_lock = lock_create("aio");
+  ac->ac_workcv = cv_create("aio work");
+  ac->ac_donecv = cv_create("aio done");
+  ac->ac_exited = sem_create("aio", 0);
+  ac->ac_phead = ac->ac_pcount = 0;
+  ac->ac_sqhead = ac->ac_cqtail = 0;
+  ac->ac_inflight = 0;
+  ac->ac_dying = false;
+  ac->ac_nworkers = 0;
+  if (ac->ac_pending==NULL || ac->ac_lock==NULL || ac->ac_workcv==NULL ||
+      ac->ac_donecv==NULL || ac->ac_exited==NULL) {
+    if (ac->ac_exited != NULL) sem_destroy(ac->ac_exited);
+    if (ac->ac_donecv != NULL) cv_destroy(ac->ac_donecv);
+    if (ac->ac_workcv != NULL) cv_destroy(ac->ac_workcv);
+    if (ac->ac_lock != NULL) lock_destroy(ac->ac_lock);
+    kfree(ac->ac_pending);
+    kfree(ac);
+    return ENOMEM;
+  }
+
+  for (i=0; i<AIO_NWORKERS; i++) {
+    result = thread_fork("aio", curproc, aio_worker, ac, i);
+    if (result) {
+      aio_ctx_destroy(ac);
+      return result;
+    }
+    ac->ac_nworkers++;
+  }
+
+  curproc->p_aio = ac;
+  *retval = 0;
+  return 0;
+}
+
+int
+sys_aio_enter(unsigned to_submit, unsigned min_complete, int *retval)
+{
+  struct aio_ctx *ac = curproc->p_aio;
+  struct aio_sqe *sqes;
+  unsigned sqtail, cqhead, avail, ready, n;
+  int result;
+
+  if (ac==NULL) return EINVAL;
+  if (min_complete > ac->ac_entries) min_complete = ac->ac_entries;
+  sqes = AIO_RING_SQES(ac->ac_ring);
+
+  lock_acquire(ac->ac_lock);
+
+  result = copyin(AIO_FIELD(ac, ar_sqtail), &sqtail, sizeof(unsigned));
+  if (result==0) {
+    result = copyin(AIO_FIELD(ac, ar_cqhead), &cqhead, sizeof(unsigned));
+  }
+  if (result) goto out;
+  avail = sqtail - ac->ac_sqhead;
+  ready = ac->ac_cqtail - cqhead;
+  if (avail > ac->ac_entries || ready > ac->ac_entries) {
+    // the process has trashed its ring indexes
+    result = EINVAL;
+    goto out;
+  }
+
+  // as many as there are completion entries free for
+  if (to_submit > avail) to_submit = avail;
+  if (to_submit > ac->ac_entries - ready - ac->ac_inflight) {
+    to_submit = ac->ac_entries - ready - ac->ac_inflight;
+  }
+  for (n=0; n<to_submit; n++) {
+    result = copyin((userptr_t)&sqes[ac->ac_sqhead % ac->ac_entries],
+                    &ac->ac_pending[(ac->ac_phead + ac->ac_pcount) %
+                                    ac->ac_entries],
+                    sizeof(struct aio_sqe));
+    if (result) break;
+    ac->ac_pcount++;
+    ac->ac_inflight++;
+    ac->ac_sqhead++;
+  }
+  if (n > 0) {
+    result = 0;
+    (void)copyout(&ac->ac_sqhead, AIO_FIELD(ac, ar_sqhead),
+                  sizeof(unsigned));
+    cv_broadcast(ac->ac_workcv, ac->ac_lock);
+  }
+  if (result) goto out;
+
+  // wait for MIN_COMPLETE, or for as many as can still come
+  while (1) {
+    result = copyin(AIO_FIELD(ac, ar_cqhead), &cqhead, sizeof(unsigned));
+    if (result) goto out;
+    ready = ac->ac_cqtail - cqhead;
+    if (ready >= min_complete || ac->ac_inflight == 0) break;
+    cv_wait(ac->ac_donecv, ac->ac_lock);
+  }
+  *retval = n;
+
+out:
+  lock_release(ac->ac_lock);
+  return result;
+}
+
+#endif
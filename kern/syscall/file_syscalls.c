@@ -20,50 +20,188 @@
 #include <limits.h>
 #include <uio.h>
 #include <proc.h>
-
-/* max num of system wide open files */
-#define SYSTEM_OPEN_MAX (10*OPEN_MAX)
+#include <synch.h>
+#include <kmem_cache.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <pipe.h>
+#include <textcache.h>
+#include "opt-os161vm.h"
 
 #define USE_KERNEL_BUFFER 0
 
-/* system open file table */
+/*
+ * system open file table: open files are allocated on demand from an
+ * object cache, there is no fixed limit. of_lock is created once per
+ * object, by the cache constructor, and protects offset (files are
+ * shared by forked processes). countRef is protected by
+ * openfile_reflock, a spinlock, so that a reference can be taken
+ * while looking up a descriptor under p_lock.
+ */
 struct openfile {
   struct vnode *vn;
   off_t offset;	
   unsigned int countRef;
+  struct lock *of_lock;
 };
 
-struct openfile systemFileTable[SYSTEM_OPEN_MAX];
+static int openfile_ctor(void *obj);
+static void openfile_dtor(void *obj);
+static struct kmem_cache openfile_cache =
+  KMEM_CACHE_INITIALIZER("openfile", sizeof(struct openfile),
+                         openfile_ctor, openfile_dtor);
+static struct spinlock openfile_reflock = SPINLOCK_INITIALIZER;
+
+static int
+openfile_ctor(void *obj) {
+  struct openfile *of = obj;
+
+  of->of_lock = lock_create("openfile");
+  if (of->of_lock == NULL) {
+    return ENOMEM;
+  }
+  return 0;
+}
+
+static void
+openfile_dtor(void *obj) {
+  struct openfile *of = obj;
+
+  lock_destroy(of->of_lock);
+}
 
 void openfileIncrRefCount(struct openfile *of) {
-  if (of!=NULL)
+  if (of!=NULL) {
+    spinlock_acquire(&openfile_reflock);
     of->countRef++;
+    spinlock_release(&openfile_reflock);
+  }
+}
+
+/* the last reference closes the vnode and gives the object back */
+void openfileDecrRefCount(struct openfile *of) {
+  struct vnode *vn;
+  unsigned int count;
+
+  KASSERT(of != NULL);
+
+  spinlock_acquire(&openfile_reflock);
+  KASSERT(of->countRef > 0);
+  count = --of->countRef;
+  vn = of->vn;
+  spinlock_release(&openfile_reflock);
+
+  if (count > 0) return;
+  of->vn = NULL;
+  vfs_close(vn);
+  kmem_cache_free(&openfile_cache, of);
+}
+
+/*
+ * per process descriptors, see fdMap in proc.h
+ */
+
+/* install OF at the lowest free descriptor, -1 if there is none */
+static int
+fd_alloc(struct proc *p, struct openfile *of) {
+  unsigned w, b;
+  uint32_t word;
+  int fd = -1;
+
+  spinlock_acquire(&p->p_lock);
+  for (w=0; w<OPEN_MAX/FDMAP_BITS; w++) {
+    word = p->fdMap[w];
+    if (word == 0xffffffff) continue;
+    for (b=0; word & (1U << b); b++)
+      ;
+    p->fdMap[w] |= 1U << b;
+    fd = w*FDMAP_BITS + b;
+    p->fileTable[fd] = of;
+    break;
+  }
+  spinlock_release(&p->p_lock);
+  return fd;
+}
+
+/* take the open file away from fd, NULL if fd is not open */
+static struct openfile *
+fd_release(struct proc *p, int fd) {
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return NULL;
+  spinlock_acquire(&p->p_lock);
+  of = p->fileTable[fd];
+  if (of != NULL) {
+    p->fileTable[fd] = NULL;
+    // stdin/out/err go back to the console
+    if (fd > STDERR_FILENO)
+      p->fdMap[fd/FDMAP_BITS] &= ~(1U << (fd%FDMAP_BITS));
+  }
+  spinlock_release(&p->p_lock);
+  return of;
+}
+
+/*
+ * the open file of fd, NULL if fd is not open. It comes with a
+ * reference, so a concurrent close (another thread of the process,
+ * e.g. an aio worker) cannot free it: give it back with fd_put.
+ */
+static struct openfile *
+fd_get(struct proc *p, int fd) {
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return NULL;
+  spinlock_acquire(&p->p_lock);
+  of = p->fileTable[fd];
+  openfileIncrRefCount(of);
+  spinlock_release(&p->p_lock);
+  return of;
+}
+
+static void
+fd_put(struct openfile *of) {
+  openfileDecrRefCount(of);
+}
+
+/*
+ * Every write to a file goes through here, so that a running
+ * executable is not served stale shared text pages.
+ */
+static int
+file_vop_write(struct vnode *vn, struct uio *u) {
+  int result;
+
+  result = VOP_WRITE(vn, u);
+#if OPT_OS161VM
+  textcache_invalidate(vn);
+#endif
+  return result;
 }
 
 #if USE_KERNEL_BUFFER
 
 static int
-file_read(int fd, userptr_t buf_ptr, size_t size) {
+file_read(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio ku;
   int result, nread;
   struct vnode *vn;
-  struct openfile *of;
   void *kbuf;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
   vn = of->vn;
   if (vn==NULL) return -1;
 
   kbuf = kmalloc(size);
+  lock_acquire(of->of_lock);
   uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_READ);
   result = VOP_READ(vn, &ku);
   if (result) {
-    return result;
+    lock_release(of->of_lock);
+    return -1;
   }
   of->offset = ku.uio_offset;
+  lock_release(of->of_lock);
   nread = size - ku.uio_resid;
   copyout(kbuf,buf_ptr,nread);
   kfree(kbuf);
@@ -71,29 +209,28 @@ file_read(int fd, userptr_t buf_ptr, size_t size) {
 }
 
 static int
-file_write(int fd, userptr_t buf_ptr, size_t size) {
+file_write(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio ku;
   int result, nwrite;
   struct vnode *vn;
-  struct openfile *of;
   void *kbuf;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
   vn = of->vn;
   if (vn==NULL) return -1;
 
   kbuf = kmalloc(size);
   copyin(buf_ptr,kbuf,size);
+  lock_acquire(of->of_lock);
   uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_WRITE);
-  result = VOP_WRITE(vn, &ku);
+  result = file_vop_write(vn, &ku);
   if (result) {
-    return result;
+    lock_release(of->of_lock);
+    return -1;
   }
   kfree(kbuf);
   of->offset = ku.uio_offset;
+  lock_release(of->of_lock);
   nwrite = size - ku.uio_resid;
   return (nwrite);
 }
@@ -101,22 +238,20 @@ file_write(int fd, userptr_t buf_ptr, size_t size) {
 #else
 
 static int
-file_read(int fd, userptr_t buf_ptr, size_t size) {
+file_read(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio u;
   int result;
   struct vnode *vn;
-  struct openfile *of;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
   vn = of->vn;
   if (vn==NULL) return -1;
 
   iov.iov_ubase = buf_ptr;
   iov.iov_len = size;
 
+  /* the offset is shared: reads and writes on this file go one at a time */
+  lock_acquire(of->of_lock);
   u.uio_iov = &iov;
   u.uio_iovcnt = 1;
   u.uio_resid = size;          // amount to read from the file
@@ -127,30 +262,29 @@ file_read(int fd, userptr_t buf_ptr, size_t size) {
 
   result = VOP_READ(vn, &u);
   if (result) {
-    return result;
+    lock_release(of->of_lock);
+    return -1;
   }
 
   of->offset = u.uio_offset;
+  lock_release(of->of_lock);
   return (size - u.uio_resid);
 }
 
 static int
-file_write(int fd, userptr_t buf_ptr, size_t size) {
+file_write(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio u;
   int result, nwrite;
   struct vnode *vn;
-  struct openfile *of;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
   vn = of->vn;
   if (vn==NULL) return -1;
 
   iov.iov_ubase = buf_ptr;
   iov.iov_len = size;
 
+  lock_acquire(of->of_lock);
   u.uio_iov = &iov;
   u.uio_iovcnt = 1;
   u.uio_resid = size;          // amount to read from the file
@@ -159,26 +293,69 @@ file_write(int fd, userptr_t buf_ptr, size_t size) {
   u.uio_rw = UIO_WRITE;
   u.uio_space = curproc->p_addrspace;
 
-  result = VOP_WRITE(vn, &u);
+  result = file_vop_write(vn, &u);
   if (result) {
-    return result;
+    lock_release(of->of_lock);
+    return -1;
   }
   of->offset = u.uio_offset;
+  lock_release(of->of_lock);
   nwrite = size - u.uio_resid;
   return (nwrite);
 }
 
 #endif
 
+/*
+ * Give V (and the reference to it) a new open file, with one
+ * reference. On failure V is closed.
+ */
+static int
+openfile_create(struct vnode *v, struct openfile **ofp) {
+  struct openfile *of;
+
+  of = kmem_cache_alloc(&openfile_cache);
+  if (of==NULL) {
+    // cannot allocate a new open file
+    vfs_close(v);
+    return ENFILE;
+  }
+  of->vn = v;
+  of->offset = 0; // TODO: handle offset with append
+  of->countRef = 1;
+  *ofp = of;
+  return 0;
+}
+
+/*
+ * Same, and install it at the lowest free descriptor.
+ */
+static int
+openfile_install(struct vnode *v, int *fdp) {
+  struct openfile *of;
+  int fd, result;
+
+  result = openfile_create(v, &of);
+  if (result) return result;
+
+  fd = fd_alloc(curproc, of);
+  if (fd < 0) {
+    // no free slot in process open file table
+    openfileDecrRefCount(of);
+    return EMFILE;
+  }
+  *fdp = fd;
+  return 0;
+}
+
 /*
  * file system calls for open/close
  */
 int
 sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
 {
-  int fd, i;
+  int fd;
   struct vnode *v;
-  struct openfile *of=NULL;; 	
   int result;
 
   result = vfs_open((char *)path, openflags, mode, &v);
@@ -186,56 +363,517 @@ sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
     *errp = ENOENT;
     return -1;
   }
-  /* search system open file table */
-  for (i=0; i<SYSTEM_OPEN_MAX; i++) {
-    if (systemFileTable[i].vn==NULL) {
-      of = &systemFileTable[i];
-      of->vn = v;
-      of->offset = 0; // TODO: handle offset with append
-      of->countRef = 1;
-      break;
+
+  result = openfile_install(v, &fd);
+  if (result) {
+    *errp = result;
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * file system calls for open/close
+ */
+int
+sys_close(int fd)
+{
+  struct openfile *of;
+
+  of = fd_release(curproc, fd);
+  if (of==NULL) return -1;
+
+  openfileDecrRefCount(of);
+  return 0;
+}
+
+/*
+ * pipe: fds[0] is the read end, fds[1] the write end
+ */
+int
+sys_pipe(userptr_t fds_ptr, int *retval)
+{
+  struct vnode *rv, *wv;
+  int fds[2];
+  int result;
+
+  result = pipe_create(0, &rv, &wv);
+  if (result) return result;
+
+  result = openfile_install(rv, &fds[0]);
+  if (result) {
+    vfs_close(wv);
+    return result;
+  }
+  result = openfile_install(wv, &fds[1]);
+  if (result) {
+    sys_close(fds[0]);
+    return result;
+  }
+
+  result = copyout(fds, fds_ptr, sizeof(fds));
+  if (result) {
+    sys_close(fds[0]);
+    sys_close(fds[1]);
+    return result;
+  }
+  *retval = 0;
+  return 0;
+}
+
+/*
+ * lseek: only the shared offset changes, under the file lock
+ */
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int result;
+
+  of = fd_get(curproc, fd);
+  if (of==NULL) {
+    /* implicit console descriptors, as in sys_dup2 */
+    return (fd>=0 && fd<=STDERR_FILENO) ? ESPIPE : EBADF;
+  }
+  if (!VOP_ISSEEKABLE(of->vn)) {
+    fd_put(of);
+    return ESPIPE;
+  }
+
+  lock_acquire(of->of_lock);
+  result = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->offset + pos;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->vn, &st);
+    newpos = st.st_size + pos;
+    break;
+  default:
+    result = EINVAL;
+    break;
+  }
+  if (result==0 && newpos < 0) result = EINVAL;
+  if (result==0) {
+    of->offset = newpos;
+    *retval = newpos;
+  }
+  lock_release(of->of_lock);
+
+  fd_put(of);
+  return result;
+}
+
+/*
+ * stdin/out/err are the console without an open file until they are
+ * redirected: give them one of their own, on "con:", to be duplicated.
+ */
+static int
+console_openfile(int fd, struct openfile **ofp) {
+  char path[] = "con:";
+  struct vnode *v;
+  int result;
+
+  result = vfs_open(path, fd==STDIN_FILENO ? O_RDONLY : O_WRONLY, 0, &v);
+  if (result) return result;
+  return openfile_create(v, ofp);
+}
+
+/*
+ * dup2: newfd shares the open file (and the offset) of oldfd;
+ * whatever newfd had open is closed
+ */
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct proc *p = curproc;
+  struct openfile *of, *old;
+  int result;
+
+  if (newfd<0||newfd>=OPEN_MAX) return EBADF;
+  of = fd_get(p, oldfd);
+  if (of==NULL && oldfd>=0 && oldfd<=STDERR_FILENO && oldfd!=newfd) {
+    // e.g. 2>&1: newfd gets a console open file
+    result = console_openfile(oldfd, &of);
+    if (result) return result;
+  }
+  if (of==NULL) {
+    // 0-2 are always valid, even if still the implicit console
+    if (oldfd>=0 && oldfd<=STDERR_FILENO) {
+      *retval = newfd;
+      return 0;
     }
+    return EBADF;
+  }
+  if (oldfd == newfd) {
+    fd_put(of);
+    *retval = newfd;
+    return 0;
+  }
+
+  /* the reference from fd_get goes to newfd */
+  spinlock_acquire(&p->p_lock);
+  old = p->fileTable[newfd];
+  p->fileTable[newfd] = of;
+  p->fdMap[newfd/FDMAP_BITS] |= 1U << (newfd%FDMAP_BITS);
+  spinlock_release(&p->p_lock);
+
+  if (old != NULL) {
+    openfileDecrRefCount(old);
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/*
+ * pread/pwrite: I/O at OFFSET. The shared offset is neither used nor
+ * changed, so the file lock is not taken and several readers of one
+ * file can go in parallel.
+ */
+static int
+file_pio(int fd, userptr_t buf_ptr, size_t size, off_t offset,
+         enum uio_rw rw, int *retval)
+{
+  struct iovec iov;
+  struct uio u;
+  struct openfile *of;
+  int result;
+
+  if (offset < 0) return EINVAL;
+  of = fd_get(curproc, fd);
+  if (of==NULL) return EBADF;
+  if (!VOP_ISSEEKABLE(of->vn)) {
+    fd_put(of);
+    return ESPIPE;
+  }
+
+  iov.iov_ubase = buf_ptr;
+  iov.iov_len = size;
+
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_resid = size;
+  u.uio_offset = offset;
+  u.uio_segflg = UIO_USERISPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  result = (rw == UIO_READ) ? VOP_READ(of->vn, &u) : file_vop_write(of->vn, &u);
+  fd_put(of);
+  if (result) {
+    return result;
+  }
+  *retval = size - u.uio_resid;
+  return 0;
+}
+
+int
+sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t offset, int *retval)
+{
+  return file_pio(fd, buf_ptr, size, offset, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t offset, int *retval)
+{
+  return file_pio(fd, buf_ptr, size, offset, UIO_WRITE, retval);
+}
+
+/*
+ * I/O for aio requests: pread/pwrite at OFFSET, or read/write at the
+ * shared offset if OFFSET is -1. Unlike sys_read/sys_write, errors
+ * come back as error codes.
+ */
+int
+file_rw(int fd, userptr_t buf_ptr, size_t size, off_t offset, bool write,
+        int *retval)
+{
+  struct iovec iov;
+  struct uio u;
+  struct openfile *of;
+  int n, result;
+
+  if (size > 0x7fffffff) return EINVAL;
+  if (offset >= 0) {
+    return file_pio(fd, buf_ptr, size, offset,
+                    write ? UIO_WRITE : UIO_READ, retval);
+  }
+  if (offset != -1) return EINVAL;
+
+  of = fd_get(curproc, fd);
+  if (of==NULL) {
+    // the console, if not redirected
+    if (write && (fd==STDOUT_FILENO||fd==STDERR_FILENO)) {
+      result = putbuf_user(buf_ptr, size);
+      if (result) return result;
+      *retval = size;
+      return 0;
+    }
+    if (!write && fd==STDIN_FILENO) {
+      n = sys_read(fd, buf_ptr, size);
+      if (n < 0) return EIO;
+      *retval = n;
+      return 0;
+    }
+    return EBADF;
+  }
+
+  iov.iov_ubase = buf_ptr;
+  iov.iov_len = size;
+
+  lock_acquire(of->of_lock);
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_resid = size;
+  u.uio_offset = of->offset;
+  u.uio_segflg = UIO_USERISPACE;
+  u.uio_rw = write ? UIO_WRITE : UIO_READ;
+  u.uio_space = curproc->p_addrspace;
+
+  result = write ? file_vop_write(of->vn, &u) : VOP_READ(of->vn, &u);
+  if (result==0) {
+    of->offset = u.uio_offset;
+    *retval = size - u.uio_resid;
+  }
+  lock_release(of->of_lock);
+  fd_put(of);
+  return result;
+}
+
+/*
+ * fsync: the console has nothing to flush
+ */
+int
+sys_fsync(int fd)
+{
+  struct openfile *of;
+  int result;
+
+  of = fd_get(curproc, fd);
+  if (of==NULL) {
+    return (fd>=0 && fd<=STDERR_FILENO) ? EINVAL : EBADF;
   }
-  if (of==NULL) { 
-    // no free slot in system open file table
-    *errp = ENFILE;
+  result = VOP_FSYNC(of->vn);
+  fd_put(of);
+  return result;
+}
+
+/*
+ * readv/writev: the user iovec array is copied in and checked once,
+ * then the whole of it goes to the file system as one uio, with the
+ * file lock taken once.
+ */
+static int
+file_rwv(int fd, userptr_t iov_ptr, int iovcnt, enum uio_rw rw, int *retval)
+{
+  struct iovec *iov;
+  struct uio u;
+  struct openfile *of;
+  size_t total, stoplen;
+  int i, n, result;
+
+  if (iovcnt<=0||iovcnt>IOV_MAX) return EINVAL;
+
+  iov = kmalloc(iovcnt*sizeof(struct iovec));
+  if (iov==NULL) return ENOMEM;
+  result = copyin(iov_ptr, iov, iovcnt*sizeof(struct iovec));
+  if (result) goto out;
+
+  total = 0;
+  for (i=0; i<iovcnt; i++) {
+    if (iov[i].iov_len == 0) continue;
+    // the result must fit in the (signed) return value
+    if (iov[i].iov_len > 0x7fffffff - total) {
+      result = EINVAL;
+      goto out;
+    }
+    result = copycheck((const_userptr_t)iov[i].iov_ubase, iov[i].iov_len,
+                       &stoplen);
+    if (result==0 && stoplen!=iov[i].iov_len) result = EFAULT;
+    if (result) goto out;
+    total += iov[i].iov_len;
   }
-  else {
-    for (fd=STDERR_FILENO+1; fd<OPEN_MAX; fd++) {
-      if (curproc->fileTable[fd] == NULL) {
-	curproc->fileTable[fd] = of;
-	return fd;
+
+  of = fd_get(curproc, fd);
+  if (of==NULL) {
+    // console, one segment at a time
+    for (i=0, n=0; i<iovcnt; i++) {
+      result = (rw == UIO_READ) ?
+        sys_read(fd, iov[i].iov_ubase, iov[i].iov_len) :
+        sys_write(fd, iov[i].iov_ubase, iov[i].iov_len);
+      if (result < 0) {
+        result = n > 0 ? 0 : EBADF;
+        break;
       }
+      n += result;
+      if ((size_t)result < iov[i].iov_len) break;
     }
-    // no free slot in process open file table
-    *errp = EMFILE;
+    *retval = n;
+    result = 0;
+    goto out;
   }
-  
-  vfs_close(v);
-  return -1;
+
+  lock_acquire(of->of_lock);
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_resid = total;
+  u.uio_offset = of->offset;
+  u.uio_segflg = UIO_USERISPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  result = (rw == UIO_READ) ? VOP_READ(of->vn, &u) : file_vop_write(of->vn, &u);
+  if (result==0) {
+    of->offset = u.uio_offset;
+    *retval = total - u.uio_resid;
+  }
+  lock_release(of->of_lock);
+  fd_put(of);
+
+out:
+  kfree(iov);
+  return result;
+}
+
+int
+sys_readv(int fd, userptr_t iov_ptr, int iovcnt, int *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, userptr_t iov_ptr, int iovcnt, int *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_WRITE, retval);
 }
 
 /*
- * file system calls for open/close
+ * copy_file_range: data goes from one file to the other through a
+ * kernel buffer of up to COPY_CHUNK bytes, never through user memory.
+ * With a NULL offset pointer the shared offset of that file is used
+ * and moved on, else *offset is used and updated, and the shared one
+ * is left alone. The two file locks are never held together (no
+ * deadlock between copies in opposite directions): each chunk is read
+ * under the lock of the input, then written under that of the output.
  */
+#define COPY_CHUNK (64*1024)
+
+/* one chunk of I/O on OF at *POS, or at the shared offset if POS is NULL */
+static int
+file_kio(struct openfile *of, off_t *pos, void *kbuf, size_t size,
+         enum uio_rw rw, size_t *done)
+{
+  struct iovec iov;
+  struct uio ku;
+  int result;
+
+  if (pos == NULL) lock_acquire(of->of_lock);
+  uio_kinit(&iov, &ku, kbuf, size, pos ? *pos : of->offset, rw);
+  result = (rw == UIO_READ) ? VOP_READ(of->vn, &ku) : file_vop_write(of->vn, &ku);
+  if (result==0) {
+    if (pos != NULL) *pos = ku.uio_offset;
+    else of->offset = ku.uio_offset;
+  }
+  if (pos == NULL) lock_release(of->of_lock);
+  *done = size - ku.uio_resid;
+  return result;
+}
+
 int
-sys_close(int fd)
+sys_copy_file_range(int infd, userptr_t inoff_ptr, int outfd,
+                    userptr_t outoff_ptr, size_t len, unsigned flags,
+                    int *retval)
 {
-  struct openfile *of=NULL; 
-  struct vnode *vn;
+  struct openfile *in, *out;
+  off_t inoff, outoff;
+  off_t *inpos = NULL, *outpos = NULL;
+  size_t chunk, nread, nwritten, total = 0;
+  void *kbuf;
+  int result;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  curproc->fileTable[fd] = NULL;
+  if (flags != 0) return EINVAL;
+  if (inoff_ptr != NULL) {
+    result = copyin(inoff_ptr, &inoff, sizeof(off_t));
+    if (result) return result;
+    if (inoff < 0) return EINVAL;
+    inpos = &inoff;
+  }
+  if (outoff_ptr != NULL) {
+    result = copyin(outoff_ptr, &outoff, sizeof(off_t));
+    if (result) return result;
+    if (outoff < 0) return EINVAL;
+    outpos = &outoff;
+  }
 
-  if (--of->countRef > 0) return 0; // just decrement ref cnt
-  vn = of->vn;
-  of->vn = NULL;
-  if (vn==NULL) return -1;
+  in = fd_get(curproc, infd);
+  out = fd_get(curproc, outfd);
+  if (in==NULL||out==NULL) {
+    result = EBADF;
+    goto out;
+  }
+  if ((inpos != NULL && !VOP_ISSEEKABLE(in->vn)) ||
+      (outpos != NULL && !VOP_ISSEEKABLE(out->vn))) {
+    result = ESPIPE;
+    goto out;
+  }
+  // the result must fit in the (signed) return value
+  if (len > 0x7fffffff) len = 0x7fffffff;
+
+  chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+  if (chunk == 0) {
+    *retval = 0;
+    result = 0;
+    goto out;
+  }
+  kbuf = kmalloc(chunk);
+  if (kbuf==NULL) {
+    result = ENOMEM;
+    goto out;
+  }
 
-  vfs_close(vn);	
-  return 0;
+  while (total < len) {
+    if (chunk > len - total) chunk = len - total;
+    result = file_kio(in, inpos, kbuf, chunk, UIO_READ, &nread);
+    if (result || nread == 0) break;
+    result = file_kio(out, outpos, kbuf, nread, UIO_WRITE, &nwritten);
+    total += nwritten;
+    if (result || nwritten < nread) {
+      // give back to the input what did not make it to the output
+      if (inpos != NULL) {
+        inoff -= nread - nwritten;
+      }
+      else if (VOP_ISSEEKABLE(in->vn)) {
+        lock_acquire(in->of_lock);
+        in->offset -= nread - nwritten;
+        lock_release(in->of_lock);
+      }
+      break;
+    }
+  }
+  kfree(kbuf);
+
+  // errors only count if nothing was copied
+  if (result && total == 0) goto out;
+
+  result = 0;
+  if (inpos != NULL) {
+    result = copyout(&inoff, inoff_ptr, sizeof(off_t));
+  }
+  if (result==0 && outpos != NULL) {
+    result = copyout(&outoff, outoff_ptr, sizeof(off_t));
+  }
+  if (result==0) *retval = total;
+
+out:
+  if (in != NULL) fd_put(in);
+  if (out != NULL) fd_put(out);
+  return result;
 }
 
 #endif
@@ -246,20 +884,31 @@ sys_close(int fd)
 int
 sys_write(int fd, userptr_t buf_ptr, size_t size)
 {
-  int i;
-  char *p = (char *)buf_ptr;
 
+#if OPT_FILE
+  struct openfile *of;
+  int n;
+
+  /* stdout/stderr may have been redirected with dup2 */
+  of = fd_get(curproc, fd);
+  if (of != NULL) {
+    n = file_write(of, buf_ptr, size);
+    fd_put(of);
+    return n;
+  }
+#endif
   if (fd!=STDOUT_FILENO && fd!=STDERR_FILENO) {
 #if OPT_FILE
-    return file_write(fd, buf_ptr, size);
+    return -1; /* not open */
 #else
     kprintf("sys_write supported only to stdout\n");
     return -1;
 #endif
   }
 
-  for (i=0; i<(int)size; i++) {
-    putch(p[i]);
+  /* copied in by chunks and queued to the console, see console.c */
+  if (putbuf_user(buf_ptr, size)) {
+    return -1;
   }
 
   return (int)size;
@@ -271,9 +920,20 @@ sys_read(int fd, userptr_t buf_ptr, size_t size)
   int i;
   char *p = (char *)buf_ptr;
 
+#if OPT_FILE
+  struct openfile *of;
+  int n;
+
+  of = fd_get(curproc, fd);
+  if (of != NULL) {
+    n = file_read(of, buf_ptr, size);
+    fd_put(of);
+    return n;
+  }
+#endif
   if (fd!=STDIN_FILENO) {
 #if OPT_FILE
-    return file_read(fd, buf_ptr, size);
+    return -1; /* not open */
 #else
     kprintf("sys_read supported only to stdin\n");
     return -1;
@@ -18,6 +18,8 @@
 #include <mips/trapframe.h>
 #include <current.h>
 #include <synch.h>
+#include <aio.h>
+#include "opt-os161vm.h"
 
 /*
  * system calls for process management
@@ -25,9 +27,28 @@
 void
 sys__exit(int status)
 {
+#if OPT_FILE
+  /* the aio threads work in our address space: stop them first */
+  aio_destroy(curproc);
+  /*
+   * close our files now, not when the parent reaps us: a reader of
+   * our pipe must see EOF before it gets to waitpid
+   */
+  proc_file_table_close(curproc);
+#endif
 #if OPT_WAITPID
   struct proc *p = curproc;
   p->p_status = status & 0xff; /* just lower 8 bits returned */
+#if OPT_OS161VM
+  /* the parent only needs the status: free the memory in the background */
+  struct addrspace *as;
+  /* flush the TLB while proc_getas() still finds the address space */
+  as_deactivate();
+  as = proc_setas(NULL);
+  if (as != NULL) {
+    as_destroy_deferred(as);
+  }
+#endif
   proc_remthread(curthread);
   proc_signal_end(p);
 #else
@@ -89,9 +110,10 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
   KASSERT(curproc != NULL);
 
+  /* out of pids or of memory: try again later, do not panic */
   newp = proc_create_runprogram(curproc->p_name);
   if (newp == NULL) {
-    return ENOMEM;
+    return EAGAIN;
   }
 
   /* done here as we need to duplicate the address space 
@@ -102,7 +124,7 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
     return ENOMEM; 
   }
 
-  proc_file_table_copy(newp,curproc);
+  proc_file_table_copy(curproc,newp);
 
   /* we need a copy of the parent's trapframe */
   tf_child = kmalloc(sizeof(struct trapframe));
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -378,3 +379,210 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Multi-cpu kmalloc throughput benchmark. Each thread does KM5_NOPS
+ * subpage allocations and as many frees, keeping a window of KM5_LIVE
+ * blocks alive and rotating through the sizes below, so that all cpus
+ * hit the subpage allocator at the same time. The number of threads
+ * is an argument (default NTHREADS); the aggregate rate is printed.
+ *
+ * The threads are held on a semaphore until all of them exist, so
+ * that the time measured is the time spent running concurrently.
+ */
+
+#define KM5_NOPS  20000
+#define KM5_LIVE  32
+
+struct km5args {
+	struct semaphore *start;
+	struct semaphore *done;
+};
+
+static
+void
+kmalloctest5thread(void *ap, unsigned long num)
+{
+#define NUM_KM5_SIZES 7
+	static const unsigned sizes[NUM_KM5_SIZES] =
+		{ 16, 40, 100, 24, 220, 60, 500 };
+
+	struct km5args *args = ap;
+	void *ptrs[KM5_LIVE];
+	unsigned i, slot;
+
+	for (i=0; i<KM5_LIVE; i++) {
+		ptrs[i] = NULL;
+	}
+
+	P(args->start);
+
+	for (i=0; i<KM5_NOPS; i++) {
+		slot = i % KM5_LIVE;
+		if (ptrs[slot] != NULL) {
+			kfree(ptrs[slot]);
+		}
+		ptrs[slot] = kmalloc(sizes[(i + num) % NUM_KM5_SIZES]);
+		if (ptrs[slot] == NULL) {
+			panic("kmalloctest5: thread %lu: kmalloc failed\n",
+			      num);
+		}
+		/* touch it, as a real user would */
+		*(unsigned *)ptrs[slot] = i;
+	}
+
+	for (i=0; i<KM5_LIVE; i++) {
+		kfree(ptrs[i]);
+	}
+
+	V(args->done);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct km5args km5;
+	struct timespec before, after, duration;
+	unsigned nthreads = NTHREADS;
+	unsigned i;
+	uint64_t ns, ops;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: km5 [nthreads]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+		if (nthreads == 0) {
+			kprintf("Usage: km5 [nthreads]\n");
+			return EINVAL;
+		}
+	}
+
+	km5.start = sem_create("km5start", 0);
+	km5.done = sem_create("km5done", 0);
+	if (km5.start == NULL || km5.done == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc throughput test with %u threads...\n",
+		nthreads);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, &km5, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(km5.start);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(km5.done);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	sem_destroy(km5.start);
+	sem_destroy(km5.done);
+
+	/* one kmalloc and one kfree per iteration */
+	ops = (uint64_t)nthreads * KM5_NOPS * 2;
+	ns = (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("km5: %llu operations in %llu.%09lu s: %llu ops/s\n",
+		(unsigned long long) ops,
+		(unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec,
+		(unsigned long long) (ops * 1000000000ULL / ns));
+	kprintf("kmalloc throughput test done\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+#if !OPT_DUMBVM
+#include <vmalloc.h>
+#endif
+
+/*
+ * vmalloc test. Maps KM6_NALLOCS regions of growing size, fills every
+ * word with a pattern that depends on the region, and checks them all
+ * once they all exist: the pages of a region are separate frames, so
+ * a wrong kernel page table entry shows up as a wrong pattern. Half of
+ * the regions go back through kfree, the rest through vfree.
+ */
+
+#define KM6_NALLOCS 8
+#define KM6_PAGES   5
+
+int
+kmalloctest6(int nargs, char **args)
+{
+#if OPT_DUMBVM
+	(void)nargs; (void)args;
+	kprintf("(This test will not work with dumbvm)\n");
+	return 0;
+#else
+	uint32_t *ptrs[KM6_NALLOCS];
+	size_t size, j;
+	unsigned i;
+
+	(void)nargs; (void)args;
+
+	kprintf("Starting vmalloc test...\n");
+
+	for (i=0; i<KM6_NALLOCS; i++) {
+		size = (KM6_PAGES + i) * PAGE_SIZE;
+		ptrs[i] = vmalloc(size);
+		if (ptrs[i] == NULL) {
+			panic("kmalloctest6: vmalloc of %zu bytes failed\n",
+			      size);
+		}
+		KASSERT(VMALLOC_OWNS(ptrs[i]));
+		for (j=0; j<size/sizeof(uint32_t); j++) {
+			ptrs[i][j] = (i << 24) ^ j;
+		}
+	}
+
+	for (i=0; i<KM6_NALLOCS; i++) {
+		size = (KM6_PAGES + i) * PAGE_SIZE;
+		for (j=0; j<size/sizeof(uint32_t); j++) {
+			if (ptrs[i][j] != ((i << 24) ^ j)) {
+				panic("kmalloctest6: region %u word %zu: "
+				      "found 0x%x\n", i, j, ptrs[i][j]);
+			}
+		}
+		for (j=PAGE_SIZE; j<size; j+=PAGE_SIZE) {
+			KASSERT(kvaddr_to_paddr((vaddr_t)ptrs[i] + j) !=
+				kvaddr_to_paddr((vaddr_t)ptrs[i] + j - PAGE_SIZE));
+		}
+	}
+
+	vmalloc_printstats();
+	for (i=0; i<KM6_NALLOCS; i++) {
+		if (i % 2) {
+			kfree(ptrs[i]);
+		}
+		else {
+			vfree(ptrs[i]);
+		}
+	}
+	vmalloc_printstats();
+
+	kprintf("vmalloc test done\n");
+	return 0;
+#endif
+}
@@ -0,0 +1,98 @@
+/*
+ * Test code for the kernel object caches.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <kmem_cache.h>
+#include <test.h>
+
+#define KMC_MAGIC    0x6b6d6330
+#define KMC_NOBJS    (2 * KMEM_CACHE_MAXFREE)
+
+struct kmcobj {
+	uint32_t magic;		/* set by the constructor only */
+	char payload[100];
+};
+
+static unsigned kmc_ctors, kmc_dtors;
+
+static
+int
+kmc_ctor(void *obj)
+{
+	struct kmcobj *o = obj;
+
+	o->magic = KMC_MAGIC;
+	kmc_ctors++;
+	return 0;
+}
+
+static
+void
+kmc_dtor(void *obj)
+{
+	struct kmcobj *o = obj;
+
+	KASSERT(o->magic == KMC_MAGIC);
+	o->magic = 0;
+	kmc_dtors++;
+}
+
+/*
+ * Check that objects come back constructed, that the constructor runs
+ * once per object and not per allocation, and that destroying the
+ * cache destructs everything that was constructed.
+ */
+int
+kmemcachetest(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	struct kmcobj *objs[KMC_NOBJS];
+	unsigned i, round, ctors;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	kmc_ctors = kmc_dtors = 0;
+	kc = kmem_cache_create("kmctest", sizeof(struct kmcobj),
+			       kmc_ctor, kmc_dtor);
+	if (kc == NULL) {
+		kprintf("kmemcachetest: kmem_cache_create failed\n");
+		return ENOMEM;
+	}
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < KMC_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				panic("kmemcachetest: alloc %u failed\n", i);
+			}
+			KASSERT(objs[i]->magic == KMC_MAGIC);
+			memset(objs[i]->payload, round + i,
+			       sizeof(objs[i]->payload));
+		}
+		ctors = kmc_ctors;
+		for (i = 0; i < KMC_NOBJS; i++) {
+			kmem_cache_free(kc, objs[i]);
+		}
+		KASSERT(kmc_ctors == ctors);
+		kprintf("kmemcachetest: round %u: %u constructed, "
+			"%u destructed\n", round, kmc_ctors, kmc_dtors);
+	}
+
+	/*
+	 * KMEM_CACHE_MAXFREE objects (the objects are small) are kept
+	 * ready at the end of each round and reused by the next one.
+	 */
+	KASSERT(kmc_ctors == KMC_NOBJS + 2 * (KMC_NOBJS - KMEM_CACHE_MAXFREE));
+	KASSERT(kmc_ctors - kmc_dtors == KMEM_CACHE_MAXFREE);
+
+	kmem_cache_destroy(kc);
+	KASSERT(kmc_ctors == kmc_dtors);
+
+	kprintf("Object cache test done\n");
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Pipe throughput benchmark.
+ *
+ * A reader thread drains a pipe with PB_READSIZE reads while this
+ * thread writes into it, once for each of the write sizes below, and
+ * the MB/s of each run are reported. Both ends use kernel buffers, so
+ * a writer finding the reader waiting copies straight into its buffer.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <pipe.h>
+#include <test.h>
+
+#define PB_READSIZE   4096
+#define PB_TOTAL      (256*1024)	/* bytes per run, at most */
+#define PB_MAXWRITES  8192		/* writes per run, at most */
+#define PB_NSIZES     6
+
+static const size_t pipebench_sizes[PB_NSIZES] = {
+	1, 16, 128, 1024, 4096, 16384,
+};
+
+struct pipebench {
+	struct vnode *rv;
+	size_t total;			/* bytes the reader has to get */
+	struct semaphore *done;
+	int error;
+};
+
+static
+void
+pipebench_reader(void *p, unsigned long num)
+{
+	struct pipebench *pb = p;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t got = 0;
+	int result = 0;
+
+	(void)num;
+
+	buf = kmalloc(PB_READSIZE);
+	if (buf == NULL) {
+		pb->error = ENOMEM;
+		V(pb->done);
+		return;
+	}
+	while (got < pb->total) {
+		uio_kinit(&iov, &ku, buf, PB_READSIZE, 0, UIO_READ);
+		result = VOP_READ(pb->rv, &ku);
+		if (result) {
+			break;
+		}
+		if (ku.uio_resid == PB_READSIZE) {
+			/* EOF */
+			result = EPIPE;
+			break;
+		}
+		got += PB_READSIZE - ku.uio_resid;
+	}
+	kfree(buf);
+	pb->error = result;
+	V(pb->done);
+}
+
+/*
+ * pipeb [pipesize]
+ */
+int
+pipebench(int nargs, char **args)
+{
+	struct pipebench pb;
+	struct vnode *wv;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t pipesize = 0, wsize, written;
+	uint64_t start, ns, kbps;
+	unsigned i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: pipeb [pipesize]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		pipesize = atoi(args[1]);
+	}
+
+	buf = kmalloc(pipebench_sizes[PB_NSIZES-1]);
+	pb.done = sem_create("pipeb", 0);
+	if (buf == NULL || pb.done == NULL) {
+		panic("pipebench: Out of memory\n");
+	}
+	memset(buf, 'p', pipebench_sizes[PB_NSIZES-1]);
+
+	kprintf("Starting pipe throughput benchmark (pipe of %u bytes)...\n",
+		(unsigned)(pipesize ? pipesize : PIPE_SIZE_DEFAULT));
+
+	for (i=0; i<PB_NSIZES; i++) {
+		wsize = pipebench_sizes[i];
+		result = pipe_create(pipesize, &pb.rv, &wv);
+		if (result) {
+			kprintf("pipeb: pipe_create: %s\n", strerror(result));
+			break;
+		}
+		pb.total = wsize * PB_MAXWRITES;
+		if (pb.total > PB_TOTAL) {
+			pb.total = PB_TOTAL;
+		}
+		pb.error = 0;
+
+		result = thread_fork("pipeb_reader", NULL, pipebench_reader,
+				     &pb, 0);
+		if (result) {
+			panic("pipebench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+
+		start = clock_ns();
+		for (written = 0; written < pb.total; written += wsize) {
+			uio_kinit(&iov, &ku, buf, wsize, 0, UIO_WRITE);
+			result = VOP_WRITE(wv, &ku);
+			if (result) {
+				break;
+			}
+		}
+		P(pb.done);
+		ns = clock_ns() - start;
+
+		vfs_close(wv);
+		vfs_close(pb.rv);
+
+		if (result || pb.error) {
+			kprintf("pipeb: %5u byte writes failed: %s\n",
+				(unsigned)wsize,
+				strerror(result ? result : pb.error));
+			continue;
+		}
+		if (ns == 0) {
+			ns = 1;
+		}
+		kbps = (uint64_t)pb.total * 1000000000ULL / ns / 1024;
+		kprintf("pipeb: %5u byte writes: %u KB in %llu us, "
+			"%llu.%02llu MB/s\n", (unsigned)wsize,
+			(unsigned)(pb.total / 1024),
+			(unsigned long long)(ns / 1000),
+			(unsigned long long)(kbps / 1024),
+			(unsigned long long)(kbps % 1024 * 100 / 1024));
+	}
+
+	sem_destroy(pb.done);
+	kfree(buf);
+	kprintf("Pipe throughput benchmark done.\n");
+	return 0;
+}
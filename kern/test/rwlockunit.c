@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <test.h>
+
+/*
+ * Unit tests for reader-writer locks.
+ *
+ * Same approach as semunit.c: each test states the criterion it
+ * checks, goes inside the rwlock to validate its state, and cleans up
+ * after calling ok(). Instead of a whole second, tests wait
+ * SETTLE_NS for the threads they started to get where they block.
+ */
+
+#define NAMESTRING "some-silly-name"
+#define SETTLE_NS  100000000	/* 100ms */
+#define NREADERS   8
+
+////////////////////////////////////////////////////////////
+// support code
+
+static struct spinlock rwu_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwu_count;
+static volatile unsigned rwu_order[2];
+
+static
+void
+ok(void)
+{
+	kprintf("Test passed; now cleaning up.\n");
+}
+
+static
+void
+settle(void)
+{
+	thread_sleep_ns(SETTLE_NS);
+}
+
+static
+struct rwlock *
+makerwlock(void)
+{
+	struct rwlock *rw;
+
+	rw = rwlock_create(NAMESTRING);
+	if (rw == NULL) {
+		panic("rwlockunit: whoops: rwlock_create failed\n");
+	}
+	return rw;
+}
+
+static
+struct semaphore *
+makesem(unsigned count)
+{
+	struct semaphore *sem;
+
+	sem = sem_create(NAMESTRING, count);
+	if (sem == NULL) {
+		panic("rwlockunit: whoops: sem_create failed\n");
+	}
+	return sem;
+}
+
+static
+void
+fork_or_die(void (*func)(void *, unsigned long), void *arg, unsigned long n)
+{
+	int result;
+
+	result = thread_fork("rwlockunit", NULL, func, arg, n);
+	if (result) {
+		panic("rwlockunit: thread_fork failed\n");
+	}
+}
+
+static
+void
+bump(void)
+{
+	spinlock_acquire(&rwu_lock);
+	rwu_count++;
+	spinlock_release(&rwu_lock);
+}
+
+/*
+ * Record that thread N got through, in arrival order.
+ */
+static
+void
+arrived(unsigned long n)
+{
+	spinlock_acquire(&rwu_lock);
+	KASSERT(rwu_count < 2);
+	rwu_order[rwu_count++] = n;
+	spinlock_release(&rwu_lock);
+}
+
+struct rwu_args {
+	struct rwlock *rw;
+	struct semaphore *gate;
+	struct semaphore *done;
+};
+
+////////////////////////////////////////////////////////////
+// tests
+
+/*
+ * 1. After a successful rwlock_create:
+ *     - rwlock_name compares equal to the passed-in name
+ *     - rwlock_name is not the same pointer as the passed-in name
+ *     - the wait channels are not null
+ *     - rw_lock is not held
+ *     - nobody holds or waits for the lock
+ */
+int
+rwu1(int nargs, char **args)
+{
+	struct rwlock *rw;
+	const char *name = NAMESTRING;
+
+	(void)nargs; (void)args;
+
+	rw = rwlock_create(name);
+	if (rw == NULL) {
+		panic("rwu1: whoops: rwlock_create failed\n");
+	}
+	KASSERT(!strcmp(rw->rwlock_name, name));
+	KASSERT(rw->rwlock_name != name);
+	KASSERT(rw->rw_readchan != NULL);
+	KASSERT(rw->rw_writechan != NULL);
+	KASSERT(rw->rw_upgradechan != NULL);
+	KASSERT(rw->rw_lock.splk_holder == NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writers_waiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_upgrader == NULL);
+
+	ok();
+	rwlock_destroy(rw);
+	return 0;
+}
+
+/*
+ * 2. Many readers hold the lock at the same time.
+ */
+static
+void
+rwu2_reader(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+
+	(void)n;
+	rwlock_acquire_read(a->rw);
+	bump();
+	P(a->gate);
+	rwlock_release_read(a->rw);
+	V(a->done);
+}
+
+int
+rwu2(int nargs, char **args)
+{
+	struct rwu_args a;
+	unsigned i;
+
+	(void)nargs; (void)args;
+
+	a.rw = makerwlock();
+	a.gate = makesem(0);
+	a.done = makesem(0);
+	rwu_count = 0;
+
+	for (i=0; i<NREADERS; i++) {
+		fork_or_die(rwu2_reader, &a, i);
+	}
+	settle();
+	KASSERT(rwu_count == NREADERS);
+	KASSERT(a.rw->rw_readers == NREADERS);
+	KASSERT(a.rw->rw_writer == NULL);
+
+	ok();
+	for (i=0; i<NREADERS; i++) {
+		V(a.gate);
+	}
+	for (i=0; i<NREADERS; i++) {
+		P(a.done);
+	}
+	KASSERT(a.rw->rw_readers == 0);
+	sem_destroy(a.gate);
+	sem_destroy(a.done);
+	rwlock_destroy(a.rw);
+	return 0;
+}
+
+/*
+ * 3. A writer excludes both readers and other writers: under load,
+ * readers never see a half-done update and writers never find anyone
+ * else inside.
+ */
+#define RWU3_THREADS 16
+#define RWU3_LOOPS   200
+
+static volatile unsigned long rwu3_a, rwu3_b;
+
+static
+void
+rwu3_thread(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+	unsigned i;
+
+	for (i=0; i<RWU3_LOOPS; i++) {
+		if (n % 4 == 0) {
+			rwlock_acquire_write(a->rw);
+			KASSERT(a->rw->rw_readers == 0);
+			KASSERT(rwlock_do_i_write(a->rw));
+			rwu3_a = n * 1000 + i;
+			thread_yield();
+			rwu3_b = n * 1000 + i;
+			rwlock_release_write(a->rw);
+		}
+		else {
+			rwlock_acquire_read(a->rw);
+			KASSERT(a->rw->rw_writer == NULL);
+			KASSERT(rwu3_a == rwu3_b);
+			rwlock_release_read(a->rw);
+		}
+	}
+	V(a->done);
+}
+
+int
+rwu3(int nargs, char **args)
+{
+	struct rwu_args a;
+	unsigned i;
+
+	(void)nargs; (void)args;
+
+	a.rw = makerwlock();
+	a.done = makesem(0);
+	rwu3_a = rwu3_b = 0;
+
+	for (i=0; i<RWU3_THREADS; i++) {
+		fork_or_die(rwu3_thread, &a, i);
+	}
+	for (i=0; i<RWU3_THREADS; i++) {
+		P(a.done);
+	}
+
+	ok();
+	sem_destroy(a.done);
+	rwlock_destroy(a.rw);
+	return 0;
+}
+
+/*
+ * 4. Writers are preferred: a reader arriving after a waiting writer
+ * does not get in before it, even though the lock is held for reading.
+ */
+static
+void
+rwu4_writer(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+
+	rwlock_acquire_write(a->rw);
+	arrived(n);
+	rwlock_release_write(a->rw);
+	V(a->done);
+}
+
+static
+void
+rwu4_reader(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+
+	rwlock_acquire_read(a->rw);
+	arrived(n);
+	rwlock_release_read(a->rw);
+	V(a->done);
+}
+
+int
+rwu4(int nargs, char **args)
+{
+	struct rwu_args a;
+
+	(void)nargs; (void)args;
+
+	a.rw = makerwlock();
+	a.done = makesem(0);
+	rwu_count = 0;
+
+	rwlock_acquire_read(a.rw);
+	fork_or_die(rwu4_writer, &a, 1);
+	settle();
+	KASSERT(a.rw->rw_writers_waiting == 1);
+	fork_or_die(rwu4_reader, &a, 2);
+	settle();
+	KASSERT(a.rw->rw_readers == 1);
+	KASSERT(rwu_count == 0);
+	rwlock_release_read(a.rw);
+
+	P(a.done);
+	P(a.done);
+	KASSERT(rwu_count == 2);
+	KASSERT(rwu_order[0] == 1);
+	KASSERT(rwu_order[1] == 2);
+
+	ok();
+	sem_destroy(a.done);
+	rwlock_destroy(a.rw);
+	return 0;
+}
+
+/*
+ * 5. A reader upgrading waits for the other readers to leave, then
+ * holds the lock for writing; a second reader trying to upgrade
+ * meanwhile fails at once and keeps its read hold.
+ */
+static volatile bool rwu5_upgraded;
+
+static
+void
+rwu5_upgrader(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+
+	(void)n;
+	rwlock_acquire_read(a->rw);
+	V(a->gate);
+	rwu5_upgraded = rwlock_upgrade(a->rw);
+	KASSERT(rwlock_do_i_write(a->rw));
+	KASSERT(a->rw->rw_readers == 0);
+	rwlock_release_write(a->rw);
+	V(a->done);
+}
+
+int
+rwu5(int nargs, char **args)
+{
+	struct rwu_args a;
+
+	(void)nargs; (void)args;
+
+	a.rw = makerwlock();
+	a.gate = makesem(0);
+	a.done = makesem(0);
+	rwu5_upgraded = false;
+
+	rwlock_acquire_read(a.rw);
+	fork_or_die(rwu5_upgrader, &a, 0);
+	P(a.gate);
+	settle();
+	KASSERT(a.rw->rw_upgrader != NULL);
+	KASSERT(a.rw->rw_readers == 2);
+	KASSERT(!rwlock_upgrade(a.rw));
+	KASSERT(a.rw->rw_readers == 2);
+	KASSERT(!rwu5_upgraded);
+	rwlock_release_read(a.rw);
+
+	P(a.done);
+	KASSERT(rwu5_upgraded);
+
+	ok();
+	KASSERT(a.rw->rw_writer == NULL);
+	sem_destroy(a.gate);
+	sem_destroy(a.done);
+	rwlock_destroy(a.rw);
+	return 0;
+}
+
+/*
+ * 6. Downgrading a write hold lets the waiting readers in while the
+ * former writer still reads.
+ */
+static
+void
+rwu6_reader(void *p, unsigned long n)
+{
+	struct rwu_args *a = p;
+
+	(void)n;
+	rwlock_acquire_read(a->rw);
+	bump();
+	rwlock_release_read(a->rw);
+	V(a->done);
+}
+
+int
+rwu6(int nargs, char **args)
+{
+	struct rwu_args a;
+	unsigned i;
+
+	(void)nargs; (void)args;
+
+	a.rw = makerwlock();
+	a.done = makesem(0);
+	rwu_count = 0;
+
+	rwlock_acquire_write(a.rw);
+	for (i=0; i<NREADERS; i++) {
+		fork_or_die(rwu6_reader, &a, i);
+	}
+	settle();
+	KASSERT(rwu_count == 0);
+
+	rwlock_downgrade(a.rw);
+	KASSERT(!rwlock_do_i_write(a.rw));
+	for (i=0; i<NREADERS; i++) {
+		P(a.done);
+	}
+	KASSERT(rwu_count == NREADERS);
+	KASSERT(a.rw->rw_readers == 1);
+
+	ok();
+	rwlock_release_read(a.rw);
+	sem_destroy(a.done);
+	rwlock_destroy(a.rw);
+	return 0;
+}
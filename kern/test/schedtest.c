@@ -0,0 +1,192 @@
+/*
+ * Scheduling latency benchmark.
+ *
+ * NHOGS cpu bound threads spin while two interactive threads play
+ * ping-pong on a pair of semaphores ROUNDS times. Every wakeup is
+ * timed from the V() to the moment the woken thread runs, which is
+ * how long a thread that mostly waits stays queued behind the cpu
+ * bound ones. The loops done by the hogs show what they gave up.
+ *
+ * Run it under both policies ("sched rr", "sched mlfq") to compare.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SB_NHOGS   4
+#define SB_MAXHOGS 16
+#define SB_ROUNDS  200
+
+struct schedbench {
+	struct semaphore *ping;
+	struct semaphore *pong;
+	struct semaphore *done;
+	volatile bool stop;		/* tells the hogs to finish */
+	unsigned rounds;
+
+	struct timespec stamp;		/* time of the last V() */
+	uint64_t totalns;		/* wakeup latencies */
+	uint64_t maxns;
+	unsigned wakeups;
+
+	unsigned long loops[SB_MAXHOGS];
+};
+
+/*
+ * Account the latency of the wakeup that just happened.
+ */
+static
+void
+schedbench_measure(struct schedbench *sb)
+{
+	struct timespec now, delta;
+	uint64_t ns;
+
+	gettime(&now);
+	timespec_sub(&now, &sb->stamp, &delta);
+	ns = (uint64_t)delta.tv_sec * 1000000000ULL + delta.tv_nsec;
+
+	sb->totalns += ns;
+	if (ns > sb->maxns) {
+		sb->maxns = ns;
+	}
+	sb->wakeups++;
+}
+
+static
+void
+schedbench_hog(void *p, unsigned long num)
+{
+	struct schedbench *sb = p;
+	unsigned long loops = 0;
+
+	while (!sb->stop) {
+		loops++;
+	}
+	sb->loops[num] = loops;
+	V(sb->done);
+}
+
+/*
+ * Only one wakeup is in flight at any time, so the two threads can
+ * share the stamp and the counters.
+ */
+static
+void
+schedbench_ping(void *p, unsigned long num)
+{
+	struct schedbench *sb = p;
+	unsigned i;
+
+	(void)num;
+
+	for (i=0; i<sb->rounds; i++) {
+		gettime(&sb->stamp);
+		V(sb->pong);
+		P(sb->ping);
+		schedbench_measure(sb);
+	}
+	V(sb->done);
+}
+
+static
+void
+schedbench_pong(void *p, unsigned long num)
+{
+	struct schedbench *sb = p;
+	unsigned i;
+
+	(void)num;
+
+	for (i=0; i<sb->rounds; i++) {
+		P(sb->pong);
+		schedbench_measure(sb);
+		gettime(&sb->stamp);
+		V(sb->ping);
+	}
+	V(sb->done);
+}
+
+/*
+ * sb [nhogs [rounds]]
+ */
+int
+schedbench(int nargs, char **args)
+{
+	struct schedbench sb;
+	unsigned nhogs = SB_NHOGS, i;
+	unsigned long long loops;
+	int result;
+
+	sb.rounds = SB_ROUNDS;
+	if (nargs > 3) {
+		kprintf("Usage: sb [nhogs [rounds]]\n");
+		return EINVAL;
+	}
+	if (nargs >= 2) {
+		nhogs = atoi(args[1]);
+	}
+	if (nargs == 3) {
+		sb.rounds = atoi(args[2]);
+	}
+	if (nhogs > SB_MAXHOGS || sb.rounds == 0) {
+		kprintf("Usage: sb [nhogs (max %u) [rounds]]\n", SB_MAXHOGS);
+		return EINVAL;
+	}
+
+	sb.ping = sem_create("sb_ping", 0);
+	sb.pong = sem_create("sb_pong", 0);
+	sb.done = sem_create("sb_done", 0);
+	if (sb.ping == NULL || sb.pong == NULL || sb.done == NULL) {
+		panic("schedbench: sem_create failed\n");
+	}
+	sb.stop = false;
+	sb.totalns = sb.maxns = 0;
+	sb.wakeups = 0;
+
+	kprintf("Starting scheduling latency benchmark (%s, %u hogs)...\n",
+		thread_get_schedpolicy() == SCHED_MLFQ ? "mlfq" : "rr", nhogs);
+
+	for (i=0; i<nhogs; i++) {
+		result = thread_fork("schedbench_hog", NULL, schedbench_hog,
+				     &sb, i);
+		if (result) {
+			panic("schedbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("schedbench_ping", NULL, schedbench_ping, &sb, 0);
+	if (result == 0) {
+		result = thread_fork("schedbench_pong", NULL,
+				     schedbench_pong, &sb, 0);
+	}
+	if (result) {
+		panic("schedbench: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+
+	P(sb.done);
+	P(sb.done);
+	sb.stop = true;
+	loops = 0;
+	for (i=0; i<nhogs; i++) {
+		P(sb.done);
+		loops += sb.loops[i];
+	}
+
+	sem_destroy(sb.ping);
+	sem_destroy(sb.pong);
+	sem_destroy(sb.done);
+
+	kprintf("sb: %u wakeups, latency avg %llu us, max %llu us; "
+		"hogs %llu loops\n", sb.wakeups,
+		(unsigned long long) (sb.totalns / sb.wakeups / 1000),
+		(unsigned long long) (sb.maxns / 1000), loops);
+	kprintf("Scheduling latency benchmark done.\n");
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Timed sleep test.
+ *
+ * ST_NTHREADS threads each call thread_sleep_ns() ROUNDS times with
+ * delays from 1ms up to 100ms, all at once so the timeout queue has
+ * several deadlines pending. Every sleep is checked not to end early
+ * and how late it ends is reported.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define ST_NTHREADS 8
+#define ST_ROUNDS   10
+
+static const uint64_t sleeptest_delays[ST_NTHREADS] = {
+	1000000, 2000000, 3000000, 5000000,
+	10000000, 20000000, 50000000, 100000000,
+};
+
+struct sleeptest {
+	struct semaphore *done;
+	unsigned rounds;
+	uint64_t lateness[ST_NTHREADS];	/* total, ns */
+	uint64_t maxlate[ST_NTHREADS];
+	unsigned early[ST_NTHREADS];	/* sleeps that ended too soon */
+};
+
+static
+void
+sleeptest_thread(void *p, unsigned long num)
+{
+	struct sleeptest *st = p;
+	uint64_t delay = sleeptest_delays[num];
+	uint64_t start, late;
+	unsigned i;
+
+	for (i=0; i<st->rounds; i++) {
+		start = clock_ns();
+		thread_sleep_ns(delay);
+		late = clock_ns() - start;
+		if (late < delay) {
+			st->early[num]++;
+			continue;
+		}
+		late -= delay;
+		st->lateness[num] += late;
+		if (late > st->maxlate[num]) {
+			st->maxlate[num] = late;
+		}
+	}
+	V(st->done);
+}
+
+/*
+ * slt [rounds]
+ */
+int
+sleeptest(int nargs, char **args)
+{
+	struct sleeptest st;
+	unsigned i, early;
+	int result;
+
+	st.rounds = ST_ROUNDS;
+	if (nargs > 2) {
+		kprintf("Usage: slt [rounds]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		st.rounds = atoi(args[1]);
+	}
+	if (st.rounds == 0) {
+		kprintf("Usage: slt [rounds]\n");
+		return EINVAL;
+	}
+
+	st.done = sem_create("slt_done", 0);
+	if (st.done == NULL) {
+		panic("sleeptest: sem_create failed\n");
+	}
+	for (i=0; i<ST_NTHREADS; i++) {
+		st.lateness[i] = st.maxlate[i] = 0;
+		st.early[i] = 0;
+	}
+
+	kprintf("Starting timed sleep test...\n");
+
+	for (i=0; i<ST_NTHREADS; i++) {
+		result = thread_fork("sleeptest", NULL, sleeptest_thread,
+				     &st, i);
+		if (result) {
+			panic("sleeptest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ST_NTHREADS; i++) {
+		P(st.done);
+	}
+	sem_destroy(st.done);
+
+	early = 0;
+	for (i=0; i<ST_NTHREADS; i++) {
+		early += st.early[i];
+		kprintf("slt: %3llu ms sleeps: late avg %llu us, max %llu us\n",
+			(unsigned long long) (sleeptest_delays[i] / 1000000),
+			(unsigned long long) (st.lateness[i] / st.rounds / 1000),
+			(unsigned long long) (st.maxlate[i] / 1000));
+	}
+	if (early > 0) {
+		panic("sleeptest: %u sleeps ended early\n", early);
+	}
+	kprintf("Timed sleep test done.\n");
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Swap backend bandwidth benchmark.
+ *
+ * Writes and then reads back NPAGES pages through a swap backend,
+ * timing each phase, for the file backend (a scratch file on emufs)
+ * and optionally for the raw backend on a spare disk.
+ *
+ * The active swap area is not touched: the file backend uses its own
+ * scratch file and the raw disk must not be the one in use for swap.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <uio.h>
+#include <coremap.h>
+#include <swap_backend.h>
+#include <test.h>
+
+#define SWAPBENCH_FILE    "emu0:/SWAPBENCH"
+#define SWAPBENCH_NPAGES  256
+
+/*
+ * Print the bandwidth of one phase in KB/s.
+ */
+static
+void
+swapbench_report(const char *kind, const char *what, unsigned npages,
+		 const struct timespec *duration)
+{
+	uint64_t ns, kbps;
+
+	ns = (uint64_t)duration->tv_sec * 1000000000ULL + duration->tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kbps = ((uint64_t)npages * PAGE_SIZE * 1000000000ULL) / ns / 1024;
+
+	kprintf("swb: %-4s %-5s %u pages in %llu.%09lu s: %llu KB/s\n",
+		kind, what, npages,
+		(unsigned long long) duration->tv_sec,
+		(unsigned long) duration->tv_nsec,
+		(unsigned long long) kbps);
+}
+
+/*
+ * Run the write and the read phase on one backend.
+ */
+static
+int
+swapbench_run(const char *kind, const char *path, unsigned npages)
+{
+	struct swap_backend *sb;
+	struct timespec before, after, duration;
+	vaddr_t buf;
+	paddr_t pa;
+	unsigned i, j, slots;
+	uint32_t *words;
+	off_t offset;
+	int result;
+
+	sb = swap_backend_create(kind);
+	if (sb == NULL) {
+		return ENOMEM;
+	}
+	result = swap_backend_open(sb, path);
+	if (result) {
+		kprintf("swb: cannot open %s backend on %s: %s\n",
+			kind, path, strerror(result));
+		swap_backend_destroy(sb);
+		return result;
+	}
+
+	slots = sb->sb_size / PAGE_SIZE;
+	if (slots == 0) {
+		swap_backend_destroy(sb);
+		return ENOSPC;
+	}
+
+	buf = alloc_kpages(1);
+	if (buf == 0) {
+		swap_backend_destroy(sb);
+		return ENOMEM;
+	}
+	pa = buf - MIPS_KSEG0;
+	words = (uint32_t *)buf;
+
+	gettime(&before);
+	for (i=0; i<npages; i++) {
+		for (j=0; j<PAGE_SIZE/sizeof(uint32_t); j+=128) {
+			words[j] = i;
+		}
+		offset = (off_t)(i % slots) * PAGE_SIZE;
+		result = SWAPBE_IO(sb, pa, offset, UIO_WRITE);
+		if (result) {
+			kprintf("swb: %s write failed: %s\n", kind,
+				strerror(result));
+			goto done;
+		}
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	swapbench_report(kind, "write", npages, &duration);
+
+	gettime(&before);
+	for (i=0; i<npages; i++) {
+		offset = (off_t)(i % slots) * PAGE_SIZE;
+		result = SWAPBE_IO(sb, pa, offset, UIO_READ);
+		if (result) {
+			kprintf("swb: %s read failed: %s\n", kind,
+				strerror(result));
+			goto done;
+		}
+		/* only the last pass over a slot is still on the backend */
+		if (i + slots >= npages && words[0] != i) {
+			kprintf("swb: %s page %u read back wrong data\n",
+				kind, i);
+			result = EIO;
+			goto done;
+		}
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	swapbench_report(kind, "read", npages, &duration);
+
+ done:
+	free_kpages(buf);
+	swap_backend_destroy(sb);
+	return result;
+}
+
+/*
+ * swb [rawdisk [npages]]
+ */
+int
+swapbench(int nargs, char **args)
+{
+	unsigned npages = SWAPBENCH_NPAGES;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: swb [rawdisk [npages]]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		npages = atoi(args[2]);
+		if (npages == 0) {
+			kprintf("Usage: swb [rawdisk [npages]]\n");
+			return EINVAL;
+		}
+	}
+
+	kprintf("Starting swap backend benchmark...\n");
+
+	result = swapbench_run("file", SWAPBENCH_FILE, npages);
+	if (result) {
+		return result;
+	}
+
+	if (nargs >= 2) {
+		result = swapbench_run("raw", args[1], npages);
+		if (result) {
+			return result;
+		}
+	}
+
+	kprintf("Swap backend benchmark done.\n");
+	return 0;
+}
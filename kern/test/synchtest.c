@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -399,3 +400,268 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+/*
+ * Contended lock benchmark.
+ *
+ * NTHREADS threads take one lock ITERATIONS times each, doing a short
+ * critical section and a little work outside of it, under each lock
+ * policy in turn: sleeping only, adaptive spinning, adaptive spinning
+ * with handoff.
+ */
+#define LB_NTHREADS   8
+#define LB_ITERATIONS 2000
+#define LB_INSIDE     50	/* loop rounds holding the lock */
+#define LB_OUTSIDE    200	/* loop rounds between acquisitions */
+
+/* the spin/sleep counters only exist in wait channel locks */
+#define LB_LOCKSTATS  (OPT_SYNCH && !USE_SEMAPHORE_FOR_LOCK)
+
+static const struct {
+	const char *name;
+	unsigned spins;
+	bool handoff;
+} lb_policies[] = {
+	{ "sleep",        0,                  false },
+	{ "spin",         LOCK_SPINS_DEFAULT, false },
+	{ "spin+handoff", LOCK_SPINS_DEFAULT, true },
+};
+
+static struct lock *lb_lock;
+static struct semaphore *lb_done;
+static unsigned lb_iterations;
+static volatile unsigned long lb_counter;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<lb_iterations; i++) {
+		lock_acquire(lb_lock);
+		lb_counter++;
+		for (j=0; j<LB_INSIDE; j++);
+		lock_release(lb_lock);
+		for (j=0; j<LB_OUTSIDE; j++);
+	}
+	V(lb_done);
+}
+
+/*
+ * lkb [nthreads [iterations]]
+ */
+int
+lockbench(int nargs, char **args)
+{
+	unsigned nthreads = LB_NTHREADS, spins, i, p;
+	struct timespec before, after, duration;
+	uint64_t ns;
+	bool handoff;
+	int result;
+
+	lb_iterations = LB_ITERATIONS;
+	if (nargs > 3) {
+		kprintf("Usage: lkb [nthreads [iterations]]\n");
+		return EINVAL;
+	}
+	if (nargs >= 2) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs == 3) {
+		lb_iterations = atoi(args[2]);
+	}
+	if (nthreads == 0 || lb_iterations == 0) {
+		kprintf("Usage: lkb [nthreads [iterations]]\n");
+		return EINVAL;
+	}
+
+	lb_lock = lock_create("lockbench");
+	lb_done = sem_create("lockbench done", 0);
+	if (lb_lock == NULL || lb_done == NULL) {
+		panic("lockbench: create failed\n");
+	}
+	lock_get_adaptive(&spins, &handoff);
+
+	kprintf("Starting contended lock benchmark (%u threads)...\n",
+		nthreads);
+
+	for (p=0; p<sizeof(lb_policies)/sizeof(lb_policies[0]); p++) {
+		lock_set_adaptive(lb_policies[p].spins, lb_policies[p].handoff);
+#if LB_LOCKSTATS
+		lb_lock->lk_nspins = lb_lock->lk_nsleeps = 0;
+#endif
+		lb_counter = 0;
+
+		gettime(&before);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("lockbench", NULL,
+					     lockbenchthread, NULL, i);
+			if (result) {
+				panic("lockbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(lb_done);
+		}
+		gettime(&after);
+
+		if (lb_counter != (unsigned long)nthreads * lb_iterations) {
+			panic("lockbench: lost updates, %lu of %lu\n",
+			      lb_counter,
+			      (unsigned long)nthreads * lb_iterations);
+		}
+
+		timespec_sub(&after, &before, &duration);
+		ns = (uint64_t)duration.tv_sec * 1000000000ULL
+			+ duration.tv_nsec;
+		kprintf("lkb: %-12s %llu ms, %llu acquisitions/s\n",
+			lb_policies[p].name,
+			(unsigned long long) (ns / 1000000),
+			(unsigned long long) (ns == 0 ? 0 :
+				lb_counter * 1000000000ULL / ns));
+#if LB_LOCKSTATS
+		kprintf("lkb: %-12s %u acquisitions spun, %u sleeps\n", "",
+			lb_lock->lk_nspins, lb_lock->lk_nsleeps);
+#endif
+	}
+
+	lock_set_adaptive(spins, handoff);
+	lock_destroy(lb_lock);
+	sem_destroy(lb_done);
+	lb_lock = NULL;
+	lb_done = NULL;
+
+	kprintf("Contended lock benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Spinlock contention benchmark.
+ *
+ * 1, 2, 4... threads, up to one per cpu, take a spinlock ITERATIONS
+ * times each. Reports the acquisitions per second and, to show how
+ * fair the lock is, the longest anybody waited for it.
+ */
+#define SPLB_ITERATIONS 5000
+#define SPLB_INSIDE     20	/* loop rounds holding the lock */
+#define SPLB_OUTSIDE    100	/* loop rounds between acquisitions */
+#define SPLB_MAXTHREADS 32
+
+static struct spinlock splb_lock = SPINLOCK_INITIALIZER;
+static struct semaphore *splb_done;
+static unsigned splb_iterations;
+static volatile unsigned long splb_counter;
+static uint64_t splb_maxwait[SPLB_MAXTHREADS];
+
+static
+void
+spinlockbenchthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	uint64_t start, wait, maxwait = 0;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<splb_iterations; i++) {
+		start = clock_ns();
+		spinlock_acquire(&splb_lock);
+		wait = clock_ns() - start;
+		splb_counter++;
+		for (j=0; j<SPLB_INSIDE; j++);
+		spinlock_release(&splb_lock);
+		if (wait > maxwait) {
+			maxwait = wait;
+		}
+		for (j=0; j<SPLB_OUTSIDE; j++);
+	}
+	splb_maxwait[num] = maxwait;
+	V(splb_done);
+}
+
+/*
+ * splb [iterations]
+ */
+int
+spinlockbench(int nargs, char **args)
+{
+	unsigned ncpus, nthreads, i;
+	uint64_t start, ns, maxwait;
+	int result;
+
+	splb_iterations = SPLB_ITERATIONS;
+	if (nargs > 2) {
+		kprintf("Usage: splb [iterations]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		splb_iterations = atoi(args[1]);
+	}
+	if (splb_iterations == 0) {
+		kprintf("Usage: splb [iterations]\n");
+		return EINVAL;
+	}
+
+	splb_done = sem_create("splb done", 0);
+	if (splb_done == NULL) {
+		panic("spinlockbench: sem_create failed\n");
+	}
+	ncpus = thread_ncpus();
+	if (ncpus > SPLB_MAXTHREADS) {
+		ncpus = SPLB_MAXTHREADS;
+	}
+
+	kprintf("Starting spinlock benchmark (%u cpus)...\n", ncpus);
+
+	for (nthreads=1; ; nthreads*=2) {
+		if (nthreads > ncpus) {
+			nthreads = ncpus;
+		}
+		splb_counter = 0;
+
+		start = clock_ns();
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("spinlockbench", NULL,
+					     spinlockbenchthread, NULL, i);
+			if (result) {
+				panic("spinlockbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		maxwait = 0;
+		for (i=0; i<nthreads; i++) {
+			P(splb_done);
+		}
+		ns = clock_ns() - start;
+		for (i=0; i<nthreads; i++) {
+			if (splb_maxwait[i] > maxwait) {
+				maxwait = splb_maxwait[i];
+			}
+		}
+
+		if (splb_counter != (unsigned long)nthreads * splb_iterations) {
+			panic("spinlockbench: lost updates\n");
+		}
+		kprintf("splb: %2u threads: %llu acquisitions/s, "
+			"longest wait %llu us\n", nthreads,
+			(unsigned long long) (ns == 0 ? 0 :
+				splb_counter * 1000000000ULL / ns),
+			(unsigned long long) (maxwait / 1000));
+
+		if (nthreads == ncpus) {
+			break;
+		}
+	}
+
+	sem_destroy(splb_done);
+	splb_done = NULL;
+
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
@@ -31,9 +31,11 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 #define NTHREADS  8
@@ -93,22 +95,32 @@ quietthread(void *junk, unsigned long num)
 	V(tsem);
 }
 
+/*
+ * Fork NTHREADS threads and wait for them. The time spent in
+ * thread_fork is added to *FORKNS.
+ */
 static
 void
-runthreads(int doloud)
+runthreads(int doloud, uint64_t *forkns)
 {
+	struct timespec before, after, duration;
 	char name[16];
 	int i, result;
 
 	for (i=0; i<NTHREADS; i++) {
 		snprintf(name, sizeof(name), "threadtest%d", i);
+		gettime(&before);
 		result = thread_fork(name, NULL,
 				     doloud ? loudthread : quietthread,
 				     NULL, i);
+		gettime(&after);
 		if (result) {
 			panic("threadtest: thread_fork failed %s)\n",
 			      strerror(result));
 		}
+		timespec_sub(&after, &before, &duration);
+		*forkns += (uint64_t)duration.tv_sec * 1000000000ULL
+			+ duration.tv_nsec;
 	}
 
 	for (i=0; i<NTHREADS; i++) {
@@ -116,16 +128,57 @@ runthreads(int doloud)
 	}
 }
 
+/*
+ * Run ROUNDS batches of threads and print the average thread_fork
+ * latency. The first batch finds the stack pools as boot left them;
+ * later ones reuse the stacks of the threads that exited before.
+ */
+static
+void
+runrounds(int doloud, int rounds)
+{
+	uint64_t forkns = 0;
+	int i;
+
+	for (i=0; i<rounds; i++) {
+		runthreads(doloud, &forkns);
+	}
+	kprintf("\n%d threads forked, %llu ns per thread_fork\n",
+		rounds * NTHREADS,
+		(unsigned long long) (forkns / (rounds * NTHREADS)));
+}
+
+static
+int
+getrounds(int nargs, char **args, const char *cmd, int *rounds)
+{
+	*rounds = 1;
+	if (nargs > 2) {
+		kprintf("Usage: %s [rounds]\n", cmd);
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		*rounds = atoi(args[1]);
+		if (*rounds <= 0) {
+			kprintf("Usage: %s [rounds]\n", cmd);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
 
 int
 threadtest(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
+	int rounds;
+
+	if (getrounds(nargs, args, "tt1", &rounds)) {
+		return EINVAL;
+	}
 
 	init_sem();
 	kprintf("Starting thread test...\n");
-	runthreads(1);
+	runrounds(1, rounds);
 	kprintf("\nThread test done.\n");
 
 	return 0;
@@ -134,12 +187,15 @@ threadtest(int nargs, char **args)
 int
 threadtest2(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
+	int rounds;
+
+	if (getrounds(nargs, args, "tt2", &rounds)) {
+		return EINVAL;
+	}
 
 	init_sem();
 	kprintf("Starting thread test 2...\n");
-	runthreads(0);
+	runrounds(0, rounds);
 	kprintf("\nThread test 2 done.\n");
 
 	return 0;
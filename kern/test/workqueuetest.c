@@ -0,0 +1,179 @@
+/*
+ * Workqueue test.
+ *
+ * WT_NTHREADS threads queue NITEMS work items between them on a
+ * workqueue of their own, then the queue is flushed and every item
+ * is checked to have run exactly once. Then a delayed item is checked
+ * not to run early, and a cancelled one not to run at all.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define WT_NTHREADS 4
+#define WT_NITEMS   1000
+#define WT_DELAY    20000000ULL	/* 20ms */
+
+struct wt_item {
+	struct work work;
+	volatile unsigned runs;
+	uint64_t when;			/* clock_ns() when it ran */
+	struct semaphore *sem;		/* V()ed when it runs, if any */
+};
+
+struct workqueuetest {
+	struct workqueue *wq;
+	struct wt_item *items;
+	unsigned nitems;
+	struct semaphore *done;
+};
+
+static
+void
+workqueuetest_work(void *p)
+{
+	struct wt_item *item = p;
+
+	item->runs++;
+	item->when = clock_ns();
+	if (item->sem != NULL) {
+		V(item->sem);
+	}
+}
+
+static
+void
+workqueuetest_item_init(struct wt_item *item, struct semaphore *sem)
+{
+	work_init(&item->work, workqueuetest_work, item);
+	item->runs = 0;
+	item->when = 0;
+	item->sem = sem;
+}
+
+static
+void
+workqueuetest_thread(void *p, unsigned long num)
+{
+	struct workqueuetest *wt = p;
+	unsigned i;
+
+	for (i=num; i<wt->nitems; i+=WT_NTHREADS) {
+		if (!work_queue(wt->wq, &wt->items[i].work)) {
+			panic("workqueuetest: item %u already pending\n", i);
+		}
+	}
+	V(wt->done);
+}
+
+/*
+ * wqt [nitems]
+ */
+int
+workqueuetest(int nargs, char **args)
+{
+	struct workqueuetest wt;
+	struct wt_item delayed, cancelled;
+	struct semaphore *sem;
+	uint64_t start;
+	unsigned i;
+	int result;
+
+	wt.nitems = WT_NITEMS;
+	if (nargs > 2) {
+		kprintf("Usage: wqt [nitems]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		wt.nitems = atoi(args[1]);
+	}
+	if (wt.nitems == 0) {
+		kprintf("Usage: wqt [nitems]\n");
+		return EINVAL;
+	}
+
+	wt.wq = workqueue_create("wqt");
+	wt.items = kmalloc(wt.nitems * sizeof(struct wt_item));
+	wt.done = sem_create("wqt_done", 0);
+	sem = sem_create("wqt_delayed", 0);
+	if (wt.wq == NULL || wt.items == NULL || wt.done == NULL ||
+	    sem == NULL) {
+		panic("workqueuetest: Out of memory\n");
+	}
+	for (i=0; i<wt.nitems; i++) {
+		workqueuetest_item_init(&wt.items[i], NULL);
+	}
+
+	kprintf("Starting workqueue test...\n");
+
+	for (i=0; i<WT_NTHREADS; i++) {
+		result = thread_fork("workqueuetest", NULL,
+				     workqueuetest_thread, &wt, i);
+		if (result) {
+			panic("workqueuetest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<WT_NTHREADS; i++) {
+		P(wt.done);
+	}
+	result = workqueue_flush(wt.wq);
+	if (result) {
+		panic("workqueuetest: flush failed: %s\n", strerror(result));
+	}
+	for (i=0; i<wt.nitems; i++) {
+		if (wt.items[i].runs != 1) {
+			panic("workqueuetest: item %u ran %u times\n",
+			      i, wt.items[i].runs);
+		}
+	}
+	kprintf("wqt: %u items done\n", wt.nitems);
+
+	workqueuetest_item_init(&delayed, sem);
+	start = clock_ns();
+	result = work_queue_delayed(wt.wq, &delayed.work, WT_DELAY);
+	if (result) {
+		panic("workqueuetest: work_queue_delayed: %s\n",
+		      strerror(result));
+	}
+	if (work_queue_delayed(wt.wq, &delayed.work, WT_DELAY) != EBUSY) {
+		panic("workqueuetest: delayed item queued twice\n");
+	}
+	P(sem);
+	if (delayed.when - start < WT_DELAY) {
+		panic("workqueuetest: delayed item ran %llu us early\n",
+		      (unsigned long long)
+		      ((WT_DELAY - (delayed.when - start)) / 1000));
+	}
+	kprintf("wqt: %llu ms delayed item ran %llu us late\n",
+		WT_DELAY / 1000000,
+		(unsigned long long) ((delayed.when - start - WT_DELAY) / 1000));
+
+	workqueuetest_item_init(&cancelled, NULL);
+	result = work_queue_delayed(wt.wq, &cancelled.work, WT_DELAY);
+	if (result) {
+		panic("workqueuetest: work_queue_delayed: %s\n",
+		      strerror(result));
+	}
+	if (!work_cancel(&cancelled.work)) {
+		panic("workqueuetest: cannot cancel a delayed item\n");
+	}
+	thread_sleep_ns(2 * WT_DELAY);
+	if (cancelled.runs != 0) {
+		panic("workqueuetest: cancelled item ran\n");
+	}
+
+	workqueue_printstats(wt.wq);
+	workqueue_destroy(wt.wq);
+	sem_destroy(sem);
+	sem_destroy(wt.done);
+	kfree(wt.items);
+
+	kprintf("Workqueue test done.\n");
+	return 0;
+}
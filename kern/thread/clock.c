@@ -28,19 +28,29 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * The timer interrupt is one-shot: every time it goes off,
+ * clock_interrupt() runs the expired timeouts and arms it again for
+ * whichever comes first, the next hardclock of this cpu or the
+ * earliest pending timeout. An idle cpu has no hardclock to run, so
+ * it only wakes up for timeouts (or every CLOCK_IDLE_NS at most).
+ *
+ * Timeouts live in a min-heap ordered by expiry time, shared by all
+ * cpus; whichever cpu takes the first timer interrupt past a
+ * deadline runs the callback.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,13 +61,33 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define CLOCK_MIN_NS		10000	/* Don't arm the timer closer than this */
+#define CLOCK_IDLE_NS		1000000000 /* Longest an idle cpu sleeps */
+
+#define TIMEOUT_INITIAL		32	/* Initial size of the heap */
+#define TIMEOUT_UNQUEUED	((unsigned)-1)	/* to_index when not queued */
+
+/*
+ * The timeout heap: timeout_heap[0] expires first, the children of
+ * entry i are 2i+1 and 2i+2. Each entry remembers its own index so
+ * it can be cancelled.
+ */
+static struct timeout **timeout_heap;
+static unsigned timeout_count, timeout_max;
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+
+/* Set once the time of day can be read, see hardclock_start(). */
+static bool clock_started;
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * thread_sleep_ns() sleeps on one of these channels, picked by
+ * thread address; a wakeup for another thread on the same channel
+ * is spurious and just goes back to sleep.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+#define SLEEP_NCHANS	16
+#define SLEEP_CHAN(t)	(sleep_chans[((uintptr_t)(t) / 64) % SLEEP_NCHANS])
+static struct wchan *sleep_chans[SLEEP_NCHANS];
+static struct spinlock sleep_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Setup.
@@ -65,29 +95,387 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i;
+
+	timeout_heap = kmalloc(TIMEOUT_INITIAL * sizeof(*timeout_heap));
+	if (timeout_heap == NULL) {
+		panic("Couldn't allocate the timeout heap\n");
+	}
+	timeout_count = 0;
+	timeout_max = TIMEOUT_INITIAL;
+	spinlock_setname(&timeout_lock, "timeout_lock");
+	spinlock_setname(&sleep_lock, "sleep_lock");
+
+	for (i=0; i<SLEEP_NCHANS; i++) {
+		sleep_chans[i] = wchan_create("clocksleep");
+		if (sleep_chans[i] == NULL) {
+			panic("Couldn't create the sleep channels\n");
+		}
+	}
+}
+
+/*
+ * Current time in nanoseconds, 0 until the clock device is attached.
+ */
+uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	if (!clock_started) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////
+// Timeout heap
+
+static
+void
+timeout_place(struct timeout *to, unsigned index)
+{
+	timeout_heap[index] = to;
+	to->to_index = index;
+}
+
+static
+void
+timeout_siftup(unsigned index)
+{
+	struct timeout *to = timeout_heap[index];
+	unsigned parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (timeout_heap[parent]->to_when <= to->to_when) {
+			break;
+		}
+		timeout_place(timeout_heap[parent], index);
+		index = parent;
+	}
+	timeout_place(to, index);
+}
+
+static
+void
+timeout_siftdown(unsigned index)
+{
+	struct timeout *to = timeout_heap[index];
+	unsigned child;
+
+	while ((child = 2 * index + 1) < timeout_count) {
+		if (child + 1 < timeout_count &&
+		    timeout_heap[child + 1]->to_when <
+		    timeout_heap[child]->to_when) {
+			child++;
+		}
+		if (to->to_when <= timeout_heap[child]->to_when) {
+			break;
+		}
+		timeout_place(timeout_heap[child], index);
+		index = child;
+	}
+	timeout_place(to, index);
+}
+
+/*
+ * Take entry INDEX off the heap. Must hold timeout_lock.
+ */
+static
+void
+timeout_remove(unsigned index)
+{
+	struct timeout *to = timeout_heap[index];
+	struct timeout *last;
+
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+	KASSERT(index < timeout_count);
+
+	to->to_index = TIMEOUT_UNQUEUED;
+	last = timeout_heap[--timeout_count];
+	if (last == to) {
+		return;
+	}
+	timeout_place(last, index);
+	if (index > 0 && timeout_heap[(index - 1) / 2]->to_when > last->to_when) {
+		timeout_siftup(index);
+	}
+	else {
+		timeout_siftdown(index);
+	}
+}
+
+/*
+ * Make room for one more entry. Called and returns with timeout_lock
+ * held, but drops it to call kmalloc, which cannot be done from an
+ * interrupt handler.
+ */
+static
+int
+timeout_grow(void)
+{
+	struct timeout **newheap, **oldheap;
+	unsigned newmax;
+
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+
+	while (timeout_count == timeout_max) {
+		if (curthread->t_in_interrupt) {
+			return ENOMEM;
+		}
+		newmax = timeout_max * 2;
+		spinlock_release(&timeout_lock);
+
+		newheap = kmalloc(newmax * sizeof(*newheap));
+
+		spinlock_acquire(&timeout_lock);
+		if (newheap == NULL) {
+			return ENOMEM;
+		}
+		if (newmax <= timeout_max) {
+			/* someone else grew it meanwhile */
+			spinlock_release(&timeout_lock);
+			kfree(newheap);
+			spinlock_acquire(&timeout_lock);
+			continue;
+		}
+		memcpy(newheap, timeout_heap,
+		       timeout_count * sizeof(*newheap));
+		oldheap = timeout_heap;
+		timeout_heap = newheap;
+		timeout_max = newmax;
+		spinlock_release(&timeout_lock);
+		kfree(oldheap);
+		spinlock_acquire(&timeout_lock);
+	}
+	return 0;
+}
+
+/*
+ * Arm this cpu's timer for its next event. Interrupts must be off.
+ */
+static
+void
+clock_arm(uint64_t now)
+{
+	uint64_t when;
+
+	if (curcpu->c_isidle) {
+		when = now + CLOCK_IDLE_NS;
+	}
+	else {
+		when = curcpu->c_nexttick;
+	}
+
+	spinlock_acquire(&timeout_lock);
+	if (timeout_count > 0 && timeout_heap[0]->to_when < when) {
+		when = timeout_heap[0]->to_when;
+	}
+	spinlock_release(&timeout_lock);
+
+	if (when < now + CLOCK_MIN_NS) {
+		when = now + CLOCK_MIN_NS;
+	}
+	if (when > now + CLOCK_IDLE_NS) {
+		when = now + CLOCK_IDLE_NS;
+	}
+	mainbus_settimer(when - now);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_when = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+	to->to_index = TIMEOUT_UNQUEUED;
+}
+
+/*
+ * Call TO's function in DELAY_NS nanoseconds, from the timer
+ * interrupt. TO must not be queued already.
+ */
+int
+timeout_add(struct timeout *to, uint64_t delay_ns)
+{
+	uint64_t now;
+	bool first;
+	int result, spl;
+
+	KASSERT(clock_started);
+	KASSERT(to->to_index == TIMEOUT_UNQUEUED);
+
+	now = clock_ns();
+	to->to_when = now + delay_ns;
+
+	spinlock_acquire(&timeout_lock);
+	result = timeout_grow();
+	if (result) {
+		spinlock_release(&timeout_lock);
+		return result;
+	}
+	timeout_heap[timeout_count++] = to;
+	timeout_siftup(timeout_count - 1);
+	first = to->to_index == 0;
+	spinlock_release(&timeout_lock);
+
+	/*
+	 * If it is the new earliest one, move our own timer ahead;
+	 * this cpu is running, so it gets there.
+	 */
+	if (first) {
+		spl = splhigh();
+		clock_arm(now);
+		splx(spl);
+	}
+	return 0;
+}
+
+/*
+ * Dequeue TO. Returns false if it was not queued, which means its
+ * function already ran or is about to; the caller has to cope with
+ * that.
+ */
+bool
+timeout_cancel(struct timeout *to)
+{
+	bool queued;
+
+	spinlock_acquire(&timeout_lock);
+	queued = to->to_index != TIMEOUT_UNQUEUED;
+	if (queued) {
+		timeout_remove(to->to_index);
+	}
+	spinlock_release(&timeout_lock);
+	return queued;
+}
+
+/*
+ * Run the timeouts that expired by NOW. The callbacks are called
+ * without the lock held, and the entry is not touched afterwards
+ * (it is often on the stack of the thread being woken up).
+ */
+static
+void
+timeout_run(uint64_t now)
+{
+	struct timeout *to;
+	void (*func)(void *);
+	void *arg;
+
+	spinlock_acquire(&timeout_lock);
+	while (timeout_count > 0 && timeout_heap[0]->to_when <= now) {
+		to = timeout_heap[0];
+		timeout_remove(0);
+		func = to->to_func;
+		arg = to->to_arg;
+		spinlock_release(&timeout_lock);
+
+		func(arg);
+
+		spinlock_acquire(&timeout_lock);
+	}
+	spinlock_release(&timeout_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Timer interrupt
+
+/*
+ * Called by the MD code when the time of day can be read (the clock
+ * device is attached): from now on the timer is armed on demand.
+ */
+void
+hardclock_start(void)
+{
+	uint64_t now;
+
+	clock_started = true;
+	now = clock_ns();
+	curcpu->c_nexttick = now + NSEC_PER_HARDCLOCK;
+	clock_arm(now);
+}
+
+/*
+ * The timer went off on this cpu.
+ */
+void
+clock_interrupt(void)
+{
+	uint64_t now;
+
+	if (!clock_started) {
+		/* still probing devices: plain periodic tick */
+		mainbus_settimer(NSEC_PER_HARDCLOCK);
+		hardclock();
+		return;
+	}
+
+	now = clock_ns();
+	timeout_run(now);
+
+	if (curcpu->c_isidle) {
+		/* tickless: nothing to schedule until we get work */
+		curcpu->c_idleirqs++;
+		clock_arm(now);
+		return;
+	}
+
+	if (now < curcpu->c_nexttick) {
+		/* woken up for a timeout only */
+		clock_arm(now);
+		return;
+	}
+
+	curcpu->c_nexttick = now + NSEC_PER_HARDCLOCK;
+	clock_arm(now);
+	hardclock();
+}
+
+/*
+ * Called by the idle loop before idling: stop the periodic tick.
+ */
+void
+clock_idle(void)
+{
+	KASSERT(curcpu->c_isidle);
+	if (clock_started) {
+		clock_arm(clock_ns());
+	}
+}
+
+/*
+ * Called when this cpu picks up work after idling: restart the
+ * periodic tick.
+ */
+void
+clock_unidle(void)
+{
+	uint64_t now;
+
+	KASSERT(!curcpu->c_isidle);
+	if (clock_started) {
+		now = clock_ns();
+		curcpu->c_nexttick = now + NSEC_PER_HARDCLOCK;
+		clock_arm(now);
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Timed waits go through the timeout heap now, so there is
+ * nothing left to do here.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * This is called HZ times a second on each processor that is not
+ * idle.
  */
 void
 hardclock(void)
@@ -97,13 +485,64 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Timed sleeps
+
+struct sleeper {
+	struct timeout sl_timeout;
+	struct wchan *sl_chan;
+	volatile bool sl_done;
+};
+
+static
+void
+thread_sleep_expire(void *p)
+{
+	struct sleeper *sl = p;
+
+	spinlock_acquire(&sleep_lock);
+	sl->sl_done = true;
+	wchan_wakeall(sl->sl_chan, &sleep_lock);
+	spinlock_release(&sleep_lock);
+}
+
+/*
+ * Suspend execution for NS nanoseconds.
+ */
+void
+thread_sleep_ns(uint64_t ns)
+{
+	struct sleeper sl;
+	uint64_t deadline;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	timeout_init(&sl.sl_timeout, thread_sleep_expire, &sl);
+	sl.sl_chan = SLEEP_CHAN(curthread);
+	sl.sl_done = false;
+
+	if (timeout_add(&sl.sl_timeout, ns)) {
+		/* no memory for the heap: poll instead */
+		deadline = clock_ns() + ns;
+		while (clock_ns() < deadline) {
+			thread_yield();
+		}
+		return;
+	}
+
+	spinlock_acquire(&sleep_lock);
+	while (!sl.sl_done) {
+		wchan_sleep(sl.sl_chan, &sleep_lock);
+	}
+	spinlock_release(&sleep_lock);
 }
 
 /*
@@ -112,10 +551,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		thread_sleep_ns((uint64_t)num_secs * 1000000000ULL);
 	}
-	spinlock_release(&lbolt_lock);
 }
@@ -0,0 +1,204 @@
+/*
+ * Lock contention profiler, see lockprof.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockprof.h>
+
+/*
+ * Registered locks. The registry lock is itself a spinlock, but an
+ * unnamed one, so taking it never comes back here.
+ */
+static struct lockprof *lockprof_list;
+static struct spinlock lockprof_lock = SPINLOCK_INITIALIZER;
+
+static
+uint64_t
+lockprof_now(struct lockprof *lp)
+{
+	return lp->lp_sleeplock ? clock_ns() : cpu_cyclecount();
+}
+
+static
+void
+lockprof_clear(struct lockprof *lp)
+{
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_spins = 0;
+	lp->lp_holdtotal = 0;
+	lp->lp_holdmax = 0;
+	lp->lp_holds = 0;
+}
+
+void
+lockprof_init(struct lockprof *lp, bool sleeplock)
+{
+	lp->lp_name = NULL;
+	lp->lp_sleeplock = sleeplock;
+	lp->lp_holdstart = 0;
+	lp->lp_prev = lp->lp_next = NULL;
+	lockprof_clear(lp);
+}
+
+void
+lockprof_register(struct lockprof *lp, const char *name)
+{
+	KASSERT(name != NULL);
+
+	spinlock_acquire(&lockprof_lock);
+	if (lp->lp_name == NULL) {
+		lp->lp_prev = NULL;
+		lp->lp_next = lockprof_list;
+		if (lockprof_list != NULL) {
+			lockprof_list->lp_prev = lp;
+		}
+		lockprof_list = lp;
+	}
+	lp->lp_name = name;
+	spinlock_release(&lockprof_lock);
+}
+
+void
+lockprof_unregister(struct lockprof *lp)
+{
+	if (lp->lp_name == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&lockprof_lock);
+	if (lp->lp_prev != NULL) {
+		lp->lp_prev->lp_next = lp->lp_next;
+	}
+	else {
+		lockprof_list = lp->lp_next;
+	}
+	if (lp->lp_next != NULL) {
+		lp->lp_next->lp_prev = lp->lp_prev;
+	}
+	lp->lp_name = NULL;
+	lp->lp_prev = lp->lp_next = NULL;
+	spinlock_release(&lockprof_lock);
+}
+
+/*
+ * Called by the new holder, still holding the lock (or its
+ * spinlock, for sleep locks), so the counters need no locking.
+ */
+void
+lockprof_acquired(struct lockprof *lp, unsigned spins)
+{
+	lp->lp_acquires++;
+	if (spins > 0) {
+		lp->lp_contended++;
+		lp->lp_spins += spins;
+	}
+	lp->lp_holdstart = lockprof_now(lp);
+}
+
+/*
+ * Called by the holder just before letting the lock go.
+ *
+ * The cycle counter is per cpu (and on System/161 it restarts when
+ * the timer is armed), so a spinlock hold that seems to go backwards
+ * is not counted.
+ */
+void
+lockprof_release(struct lockprof *lp)
+{
+	uint64_t now, held;
+
+	now = lockprof_now(lp);
+	if (lp->lp_sleeplock) {
+		if (lp->lp_holdstart == 0 || now < lp->lp_holdstart) {
+			/* clock not running yet */
+			return;
+		}
+		held = now - lp->lp_holdstart;
+	}
+	else {
+		if ((uint32_t)now < (uint32_t)lp->lp_holdstart) {
+			return;
+		}
+		held = (uint32_t)now - (uint32_t)lp->lp_holdstart;
+	}
+	lp->lp_holdtotal += held;
+	lp->lp_holds++;
+	if (held > lp->lp_holdmax) {
+		lp->lp_holdmax = held;
+	}
+}
+
+/*
+ * Orders the locks for the report: most contended first, then by
+ * address so that ties still have a strict order.
+ */
+static
+bool
+lockprof_before(const struct lockprof *a, const struct lockprof *b)
+{
+	if (a->lp_contended != b->lp_contended) {
+		return a->lp_contended > b->lp_contended;
+	}
+	return a > b;
+}
+
+void
+lockprof_print(unsigned top)
+{
+	struct lockprof *lp, *best, *last = NULL;
+	unsigned i;
+
+	kprintf("%-20s %10s %10s %12s %12s %12s\n", "lock", "acquires",
+		"contended", "spins", "hold avg", "hold max");
+
+	/*
+	 * Pick the next one at each round: there is no memory to sort
+	 * into while holding the registry lock, and TOP is small.
+	 */
+	spinlock_acquire(&lockprof_lock);
+	for (i=0; i<top; i++) {
+		best = NULL;
+		for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+			if (last != NULL && !lockprof_before(last, lp)) {
+				continue;
+			}
+			if (best == NULL || lockprof_before(lp, best)) {
+				best = lp;
+			}
+		}
+		if (best == NULL || best->lp_acquires == 0) {
+			break;
+		}
+		kprintf("%-20s %10u %10u %12llu %9llu %s %9llu %s\n",
+			best->lp_name, best->lp_acquires, best->lp_contended,
+			(unsigned long long) best->lp_spins,
+			(unsigned long long) (best->lp_holds == 0 ? 0 :
+				best->lp_holdtotal / best->lp_holds),
+			best->lp_sleeplock ? "ns" : "cy",
+			(unsigned long long) best->lp_holdmax,
+			best->lp_sleeplock ? "ns" : "cy");
+		last = best;
+	}
+	spinlock_release(&lockprof_lock);
+}
+
+/*
+ * Counters are reset without taking the locks themselves, so a
+ * concurrent acquisition may survive the reset; that is fine for a
+ * report.
+ */
+void
+lockprof_reset(void)
+{
+	struct lockprof *lp;
+
+	spinlock_acquire(&lockprof_lock);
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		lockprof_clear(lp);
+	}
+	spinlock_release(&lockprof_lock);
+}
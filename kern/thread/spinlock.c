@@ -41,6 +41,12 @@
 
 /*
  * Spinlocks.
+ *
+ * These are ticket locks: each cpu takes a ticket and waits until the
+ * lock serves it, so the lock is handed out in arrival order and a
+ * release only costs one write to the lock word. (With
+ * test-and-test-and-set every waiter raced for the word on each
+ * release, and a cpu could lose over and over.)
  */
 
 
@@ -53,6 +59,7 @@ spinlock_init(struct spinlock *splk)
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+	LOCKPROF_INIT(&splk->splk_prof, false);
 }
 
 /*
@@ -61,21 +68,26 @@ spinlock_init(struct spinlock *splk)
 void
 spinlock_cleanup(struct spinlock *splk)
 {
+	spinlock_data_t v;
+
+	v = spinlock_data_get(&splk->splk_lock);
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(SPINLOCK_DATA_NEXT(v) == SPINLOCK_DATA_OWNER(v));
+	LOCKPROF_UNREGISTER(&splk->splk_prof);
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket with
+ * a machine-level atomic operation and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	unsigned ticket, spins = 0;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,28 +105,20 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Waiting only reads the lock word, which stays in our cache
+	 * until the holder writes it on release.
+	 */
+	ticket = spinlock_data_taketicket(&splk->splk_lock);
+	while (SPINLOCK_DATA_OWNER(spinlock_data_get(&splk->splk_lock))
+	       != ticket) {
+		spins++;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	LOCKPROF_ACQUIRED(&splk->splk_prof, spins);
+	(void)spins;
 
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
@@ -135,9 +139,10 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+	LOCKPROF_RELEASE(&splk->splk_prof);
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_nextowner(&splk->splk_lock);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -154,3 +159,17 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Name the lock.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+#if OPT_HANGMAN
+	splk->splk_hangman.l_name = name;
+#endif
+	LOCKPROF_REGISTER(&splk->splk_prof, name);
+	(void)splk;
+	(void)name;
+}
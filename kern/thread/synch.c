@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -168,8 +169,17 @@ lock_create(const char *name)
 	  kfree(lock);
 	  return NULL;
 	}
+#if !USE_SEMAPHORE_FOR_LOCK
+	lock->lk_ownercpu = NULL;
+	lock->lk_handoff = false;
+	lock->lk_waiters = 0;
+	lock->lk_nspins = 0;
+	lock->lk_nsleeps = 0;
+#endif
 	lock->lk_owner = NULL;
 	spinlock_init(&lock->lk_lock);
+	LOCKPROF_INIT(&lock->lk_prof, true);
+	LOCKPROF_REGISTER(&lock->lk_prof, lock->lk_name);
 #endif	
         return lock;
 }
@@ -181,6 +191,7 @@ lock_destroy(struct lock *lock)
 
         // add stuff here as needed
 #if OPT_SYNCH
+	LOCKPROF_UNREGISTER(&lock->lk_prof);
 	spinlock_cleanup(&lock->lk_lock);
 #if USE_SEMAPHORE_FOR_LOCK
         sem_destroy(lock->lk_sem);
@@ -192,6 +203,71 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Adaptive locking policy, see synch.h.
+ */
+static volatile unsigned lock_spins = LOCK_SPINS_DEFAULT;
+static volatile bool lock_handoff = false;
+
+void
+lock_set_adaptive(unsigned spins, bool handoff)
+{
+	lock_spins = spins;
+	lock_handoff = handoff;
+}
+
+void
+lock_get_adaptive(unsigned *spins, bool *handoff)
+{
+	*spins = lock_spins;
+	*handoff = lock_handoff;
+}
+
+#if OPT_SYNCH && !USE_SEMAPHORE_FOR_LOCK
+/*
+ * True if the holder of LOCK is running on another cpu, that is, if
+ * it is worth spinning rather than sleeping. Must hold lk_lock.
+ *
+ * The owner's cpu is looked at rather than the owner itself, which
+ * could be exiting: cpus never go away. Reading c_curthread of
+ * another cpu is racy, but at worst we spin or sleep for nothing.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+	volatile struct cpu *c = lock->lk_ownercpu;
+
+	return (lock->lk_owner != NULL && c != NULL &&
+		c != curcpu->c_self && c->c_curthread == lock->lk_owner);
+}
+
+/*
+ * Spin, without lk_lock, until LOCK looks free, its holder stops
+ * running, or the spin budget is gone. Returns the rounds used so far.
+ */
+static
+unsigned
+lock_spin(struct lock *lock, unsigned spins)
+{
+	const volatile struct thread *owner;
+	volatile struct cpu *c;
+
+	while (spins < lock_spins) {
+		spins++;
+		owner = lock->lk_owner;
+		if (owner == NULL) {
+			break;
+		}
+		c = lock->lk_ownercpu;
+		if (c == NULL || c->c_curthread != owner) {
+			break;
+		}
+	}
+	return spins;
+}
+#endif
+
 void
 lock_acquire(struct lock *lock)
 {
@@ -216,10 +292,38 @@ lock_acquire(struct lock *lock)
         P(lock->lk_sem);
 	spinlock_acquire(&lock->lk_lock);        
 #else
+	unsigned spins = 0, waits = 0;
+	bool woken = false;
+
 	spinlock_acquire(&lock->lk_lock);        
-	while (lock->lk_owner != NULL) {
-	  wchan_sleep(lock->lk_wchan, &lock->lk_lock);
-        }
+	/*
+	 * A lock being handed off belongs to whoever was woken up for
+	 * it; everybody else keeps waiting.
+	 */
+	while (lock->lk_owner != NULL || (lock->lk_handoff && !woken)) {
+		woken = false;
+		if (!lock->lk_handoff && spins < lock_spins &&
+		    lock_owner_running(lock)) {
+			spinlock_release(&lock->lk_lock);
+			spins = lock_spin(lock, spins);
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+		lock->lk_waiters++;
+		lock->lk_nsleeps++;
+		waits++;
+		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		lock->lk_waiters--;
+		woken = true;
+	}
+	if (spins > 0) {
+		lock->lk_nspins++;
+	}
+	lock->lk_handoff = false;
+	lock->lk_ownercpu = curcpu->c_self;
+	/* for the profiler, each sleep counts as one spin round */
+	LOCKPROF_ACQUIRED(&lock->lk_prof, spins + waits);
+	(void)waits;
 #endif
         KASSERT(lock->lk_owner == NULL);
         lock->lk_owner=curthread;
@@ -236,13 +340,21 @@ lock_release(struct lock *lock)
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));
 	spinlock_acquire(&lock->lk_lock);
+	LOCKPROF_RELEASE(&lock->lk_prof);
         lock->lk_owner=NULL;
 	/*  G.Cabodi - 2019: no problem here owning a spinlock, as V/wchan_wakeone 
 	    do not lead to wait state */
 #if USE_SEMAPHORE_FOR_LOCK
         V(lock->lk_sem);
 #else
-        wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	lock->lk_ownercpu = NULL;
+	/* spinners see the lock free by themselves */
+	if (lock->lk_waiters > 0) {
+		if (lock_handoff) {
+			lock->lk_handoff = true;
+		}
+		wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	}
 #endif
 	spinlock_release(&lock->lk_lock);
 #endif
@@ -382,3 +494,199 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(*rw));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlock_name = kstrdup(name);
+        if (rw->rwlock_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+	rw->rw_readchan = wchan_create(rw->rwlock_name);
+	rw->rw_writechan = wchan_create(rw->rwlock_name);
+	rw->rw_upgradechan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readchan == NULL || rw->rw_writechan == NULL ||
+	    rw->rw_upgradechan == NULL) {
+		if (rw->rw_readchan != NULL) {
+			wchan_destroy(rw->rw_readchan);
+		}
+		if (rw->rw_writechan != NULL) {
+			wchan_destroy(rw->rw_writechan);
+		}
+		if (rw->rw_upgradechan != NULL) {
+			wchan_destroy(rw->rw_upgradechan);
+		}
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writers_waiting = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writers_waiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_readchan);
+	wchan_destroy(rw->rw_writechan);
+	wchan_destroy(rw->rw_upgradechan);
+
+        kfree(rw->rwlock_name);
+        kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	/* writers first, including one waiting to upgrade */
+	while (rw->rw_writer != NULL || rw->rw_writers_waiting > 0 ||
+	       rw->rw_upgrader != NULL) {
+		wchan_sleep(rw->rw_readchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_upgrader != NULL) {
+		/* the upgrader is the one reader left */
+		if (rw->rw_readers == 1) {
+			wchan_wakeone(rw->rw_upgradechan, &rw->rw_lock);
+		}
+	}
+	else if (rw->rw_readers == 0 && rw->rw_writers_waiting > 0) {
+		wchan_wakeone(rw->rw_writechan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writers_waiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_upgrader != NULL) {
+		wchan_sleep(rw->rw_writechan, &rw->rw_lock);
+	}
+	rw->rw_writers_waiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+/*
+ * Let in the next writer if there is one, else all the readers.
+ * Must hold rw_lock.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_writers_waiting > 0) {
+		wchan_wakeone(rw->rw_writechan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readchan, &rw->rw_lock);
+	}
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	if (rw->rw_upgrader != NULL) {
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		wchan_sleep(rw->rw_upgradechan, &rw->rw_lock);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	/* writers still come first */
+	if (rw->rw_writers_waiting == 0) {
+		wchan_wakeall(rw->rw_readchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_write(struct rwlock *rw)
+{
+	/* only the writer itself can see its own pointer here */
+	return rw->rw_writer == curthread;
+}
@@ -50,6 +50,8 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
+#include <kmem_cache.h>
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
 	#include <coremap.h>
@@ -58,35 +60,67 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Number of guard words at the bottom end of each kernel stack. */
+#define THREAD_STACK_GUARDWORDS 16
+
+/* Free stacks each cpu pool gets at boot and on a stack size change. */
+#define THREAD_STACKPOOL_PREFILL 4
+
+/* Stack size of threads created from now on (thread_set_stacksize). */
+static size_t thread_stacksize = STACK_SIZE;
+
+/* Scheduling policy, SCHED_MLFQ or SCHED_RR (thread_set_schedpolicy). */
+static int sched_policy = SCHED_MLFQ;
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
 	struct threadlist wc_threads;	/* list of waiting threads */
 };
 
+/*
+ * Thread structures come from an object cache. The list node and the
+ * machine-dependent part are set up once, by the constructor; every
+ * thread gives them back unused, so they are still valid on reuse.
+ */
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
 static struct cpuarray allcpus;
 
+/* Load balancing, see "Work stealing" below. */
+static struct thread *thread_steal(void);
+static void thread_kick_idle(struct cpu *targetcpu);
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Stick a magic number on the bottom end of the stack. This will
- * (sometimes) catch kernel stack overflows. Use thread_checkstack()
+ * Stick a band of magic numbers on the bottom end of the stack. This
+ * will (sometimes) catch kernel stack overflows. Use thread_checkstack()
  * to test this.
+ *
+ * Kernel stacks are direct-mapped memory, so there is no unmapped page
+ * to act as a hardware guard: the exception code pushes the trap frame
+ * on the kernel stack and could not take a TLB miss there.
  */
 static
 void
 thread_checkstack_init(struct thread *thread)
 {
-	((uint32_t *)thread->t_stack)[0] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[1] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[2] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[3] = THREAD_STACK_MAGIC;
+	unsigned i;
+
+	for (i=0; i<THREAD_STACK_GUARDWORDS; i++) {
+		((uint32_t *)thread->t_stack)[i] = THREAD_STACK_MAGIC;
+	}
 }
 
 /*
@@ -103,14 +137,252 @@ static
 void
 thread_checkstack(struct thread *thread)
 {
+	unsigned i;
+
 	if (thread->t_stack != NULL) {
-		KASSERT(((uint32_t*)thread->t_stack)[0] == THREAD_STACK_MAGIC);
-		KASSERT(((uint32_t*)thread->t_stack)[1] == THREAD_STACK_MAGIC);
-		KASSERT(((uint32_t*)thread->t_stack)[2] == THREAD_STACK_MAGIC);
-		KASSERT(((uint32_t*)thread->t_stack)[3] == THREAD_STACK_MAGIC);
+		for (i=0; i<THREAD_STACK_GUARDWORDS; i++) {
+			KASSERT(((uint32_t*)thread->t_stack)[i] ==
+				THREAD_STACK_MAGIC);
+		}
+	}
+}
+
+/*
+ * Kernel stacks.
+ *
+ * Stacks come from alloc_kpages rather than kmalloc, which may hand
+ * out mapped (vmalloc) memory for big requests: see above for why
+ * that cannot work for a stack.
+ *
+ * Each cpu keeps up to CPU_STACKPOOL_MAX free stacks of the current
+ * size, so that the threads exiting and being forked on a cpu just
+ * trade stacks instead of going through the page allocator. The pools
+ * are prefilled at boot, once the VM system is up.
+ */
+static
+void *
+thread_stack_alloc(size_t size)
+{
+	return (void *)alloc_kpages(size / PAGE_SIZE);
+}
+
+static
+void
+thread_stack_free(void *stack)
+{
+	free_kpages((vaddr_t)stack);
+}
+
+/*
+ * Take a free stack of SIZE bytes from the pool of C, NULL if none.
+ */
+static
+void *
+thread_stackpool_get(struct cpu *c, size_t size)
+{
+	void *stack = NULL;
+
+	spinlock_acquire(&c->c_stackpool_lock);
+	if (c->c_stackpool_size == size && c->c_stackpool_count > 0) {
+		stack = c->c_stackpool[--c->c_stackpool_count];
+		c->c_stackpool_hits++;
+	}
+	else {
+		c->c_stackpool_misses++;
+	}
+	spinlock_release(&c->c_stackpool_lock);
+
+	return stack;
+}
+
+/*
+ * Put STACK (SIZE bytes) into the pool of C, unless the pool already
+ * holds LIMIT stacks or is for stacks of another size. Returns true
+ * if the pool took it.
+ */
+static
+bool
+thread_stackpool_put(struct cpu *c, void *stack, size_t size, unsigned limit)
+{
+	bool taken = false;
+
+	KASSERT(limit <= CPU_STACKPOOL_MAX);
+
+	spinlock_acquire(&c->c_stackpool_lock);
+	if (c->c_stackpool_size == size && c->c_stackpool_count < limit) {
+		c->c_stackpool[c->c_stackpool_count++] = stack;
+		taken = true;
+	}
+	spinlock_release(&c->c_stackpool_lock);
+
+	return taken;
+}
+
+/*
+ * Free the stacks in the pool of C and make it a pool for stacks of
+ * SIZE bytes.
+ */
+static
+void
+thread_stackpool_drain(struct cpu *c, size_t size)
+{
+	void *stacks[CPU_STACKPOOL_MAX];
+	unsigned i, n;
+
+	spinlock_acquire(&c->c_stackpool_lock);
+	n = c->c_stackpool_count;
+	for (i=0; i<n; i++) {
+		stacks[i] = c->c_stackpool[i];
+	}
+	c->c_stackpool_count = 0;
+	c->c_stackpool_size = size;
+	spinlock_release(&c->c_stackpool_lock);
+
+	for (i=0; i<n; i++) {
+		thread_stack_free(stacks[i]);
+	}
+}
+
+/*
+ * Bring every pool up to THREAD_STACKPOOL_PREFILL stacks.
+ */
+static
+void
+thread_stackpool_fill(void)
+{
+	struct cpu *c;
+	void *stack;
+	size_t size;
+	unsigned i, j;
+
+	size = thread_stacksize;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		for (j=0; j<THREAD_STACKPOOL_PREFILL; j++) {
+			stack = thread_stack_alloc(size);
+			if (stack == NULL) {
+				return;
+			}
+			if (!thread_stackpool_put(c, stack, size,
+						  THREAD_STACKPOOL_PREFILL)) {
+				thread_stack_free(stack);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Give THREAD a kernel stack of the current size.
+ */
+static
+int
+thread_stack_get(struct thread *thread)
+{
+	size_t size;
+
+	KASSERT(thread->t_stack == NULL);
+
+	size = thread_stacksize;
+	thread->t_stack = thread_stackpool_get(curcpu->c_self, size);
+	if (thread->t_stack == NULL) {
+		thread->t_stack = thread_stack_alloc(size);
+		if (thread->t_stack == NULL) {
+			return ENOMEM;
+		}
+	}
+	thread->t_stacksize = size;
+	thread_checkstack_init(thread);
+	return 0;
+}
+
+/*
+ * Give back the kernel stack of THREAD, to the pool of this cpu if
+ * there is room.
+ */
+static
+void
+thread_stack_put(struct thread *thread)
+{
+	KASSERT(thread->t_stack != NULL);
+
+	/* don't pass on a stack that was overrun */
+	thread_checkstack(thread);
+
+	if (!thread_stackpool_put(curcpu->c_self, thread->t_stack,
+				  thread->t_stacksize, CPU_STACKPOOL_MAX)) {
+		thread_stack_free(thread->t_stack);
+	}
+	thread->t_stack = NULL;
+	thread->t_stacksize = 0;
+}
+
+int
+thread_set_stacksize(size_t size)
+{
+	unsigned i;
+
+	if (size < STACK_SIZE || size > STACK_SIZE_MAX ||
+	    size % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	thread_stacksize = size;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		thread_stackpool_drain(cpuarray_get(&allcpus, i), size);
+	}
+	thread_stackpool_fill();
+
+	return 0;
+}
+
+size_t
+thread_get_stacksize(void)
+{
+	return thread_stacksize;
+}
+
+void
+thread_stackpool_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_stackpool_lock);
+		kprintf("cpu%u: %u free stacks of %u bytes, "
+			"%u hits, %u misses\n", c->c_number,
+			c->c_stackpool_count, c->c_stackpool_size,
+			c->c_stackpool_hits, c->c_stackpool_misses);
+		spinlock_release(&c->c_stackpool_lock);
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,27 +395,32 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* Thread subsystem fields (t_machdep, t_listnode: see thread_ctor) */
 	thread->t_stack = NULL;
+	thread->t_stacksize = 0;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduler fields: new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_enqueued = 0;
+	thread->t_lastrun = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -168,6 +445,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,12 +458,29 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_nexttick = 0;
+	c->c_idleirqs = 0;
 	c->c_spinlocks = 0;
+	c->c_kmalloc_mag = NULL;
+	c->c_stackpool_count = 0;
+	c->c_stackpool_size = thread_stacksize;
+	c->c_stackpool_hits = 0;
+	c->c_stackpool_misses = 0;
+	spinlock_init(&c->c_stackpool_lock);
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_count = 0;
+	c->c_steals = 0;
+	c->c_stolen = 0;
+	c->c_steal_misses = 0;
+	c->c_idle_ns = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "c_runqueue_lock");
 
+	c->c_hatched = false;
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
@@ -195,6 +490,9 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	/* Not fatal if this fails: kmalloc just skips the magazine. */
+	c->c_kmalloc_mag = kmalloc_magazine_create();
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -212,11 +510,9 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
+		if (thread_stack_get(c->c_curthread)) {
 			panic("cpu_create: couldn't allocate stack");
 		}
-		thread_checkstack_init(c->c_curthread);
 	}
 
 	/*
@@ -275,8 +571,9 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		thread_stack_put(thread);
 	}
+	/* back to the cache in constructed state: same checks as thread_dtor */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -284,7 +581,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -314,6 +611,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -328,9 +628,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -384,6 +688,7 @@ thread_bootstrap(void)
 	KASSERT(CURCPU_EXISTS() == false);
 	(void)cpu_create(0);
 	KASSERT(CURCPU_EXISTS() == true);
+	curcpu->c_hatched = true;
 
 	/* cpu_create() should also have set t_proc. */
 	KASSERT(curcpu != NULL);
@@ -411,6 +716,10 @@ cpu_hatch(unsigned software_number)
 	KASSERT(curthread != NULL);
 	KASSERT(curcpu->c_number == software_number);
 
+	spinlock_acquire(&curcpu->c_ipi_lock);
+	curcpu->c_hatched = true;
+	spinlock_release(&curcpu->c_ipi_lock);
+
 	spl0();
 	cpu_identify(buf, sizeof(buf));
 
@@ -440,6 +749,68 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	/* The VM system is up: give every cpu its spare stacks. */
+	thread_stackpool_fill();
+}
+
+/*
+ * Run queue primitives. A cpu has one run queue per priority level
+ * (0 is the highest) and runs the threads of a level only when the
+ * levels above are empty. The caller holds the cpu's runqueue lock.
+ */
+
+/* Queue T at the tail of its level on cpu C */
+static
+void
+runqueue_addtail(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (sched_policy != SCHED_MLFQ) {
+		t->t_priority = 0;
+	}
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	t->t_enqueued = c->c_hardclocks;
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runqueue_count++;
+}
+
+/* Dequeue the thread to run next on cpu C, NULL if none */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Highest level with queued threads on cpu C, SCHED_NLEVELS if none */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
+	}
+	return i;
 }
 
 /*
@@ -466,7 +837,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_addtail(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -475,6 +846,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_runqueue_count > 1) {
+		/* More than it can run right away; find a taker. */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -505,13 +880,12 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
+	/* Get a stack */
+	result = thread_stack_get(newthread);
+	if (result) {
 		thread_destroy(newthread);
-		return ENOMEM;
+		return result;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -562,6 +936,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	struct timespec idlestart, idleend, idletime;
+	bool idled = false;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -588,7 +964,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -621,6 +997,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	}
 	cur->t_state = newstate;
 
+	/* Remember when it ran here, for the work stealing. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/*
 	 * Get the next thread. While there isn't one, call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
@@ -636,19 +1015,45 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to take a thread from another cpu (see
+	 * "Work stealing"). That is done with the runqueue unlocked too.
+	 *
+	 * While idle the cpu takes no hardclocks (clock_idle), they are
+	 * restarted once it has something to run (clock_unidle).
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				idled = true;
+				clock_idle();
+				gettime(&idlestart);
+				cpu_idle();
+				gettime(&idleend);
+				timespec_sub(&idleend, &idlestart, &idletime);
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL) {
+				curcpu->c_steals++;
+			}
+			else {
+				curcpu->c_steal_misses++;
+				curcpu->c_idle_ns += (uint64_t)idletime.tv_sec
+					* 1000000000ULL + idletime.tv_nsec;
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (idled) {
+		/* Back to work, restart the hardclocks. */
+		clock_unidle();
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -818,139 +1223,278 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Multilevel feedback queue. Every thread has a level, 0 being the
+ * highest, and a quantum that doubles at each level down:
+ *
+ *   - new threads start at level 0;
+ *   - a thread that uses up its quantum moves down one level
+ *     (thread_tick, from hardclock);
+ *   - a thread woken up from a wait channel moves up one level, so
+ *     threads that mostly wait (console, disk) get the cpu quickly;
+ *   - a thread left waiting on the run queue for SCHED_AGE_HARDCLOCKS
+ *     goes back to level 0, so cpu bound threads cannot starve
+ *     (schedule, from hardclock).
+ *
+ * A thread is preempted at the next tick if a thread of a higher level
+ * becomes runnable. With SCHED_RR everything stays at level 0 and the
+ * quantum is one tick, which is how OS/161 scheduled originally.
  */
 
+/* Hardclocks a thread may run at LEVEL before moving down */
+#define SCHED_QUANTUM(level)	(1U << (level))
+
+/* Hardclocks on the run queue after which a thread goes back to level 0 */
+#define SCHED_AGE_HARDCLOCKS	50
+
 void
-schedule(void)
+thread_set_schedpolicy(int policy)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	KASSERT(policy == SCHED_MLFQ || policy == SCHED_RR);
+	sched_policy = policy;
+}
+
+int
+thread_get_schedpolicy(void)
+{
+	return sched_policy;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Charge the current tick to curthread. Returns true if it should
+ * yield: its quantum is over (and it moved down a level), or a thread
+ * of a higher level is waiting.
  */
-void
-thread_consider_migration(void)
+bool
+thread_tick(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur;
+	unsigned top;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	cur = curthread;
+	if (sched_policy != SCHED_MLFQ) {
+		return true;
+	}
+	if (curcpu->c_isidle) {
+		/* thread_yield would not do anything anyway */
+		return false;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		cur->t_ticks = 0;
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		return true;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	top = runqueue_toplevel(curcpu->c_self);
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	return top < cur->t_priority;
+}
+
+/*
+ * Move up a thread being woken up. Called by the wchan_wake functions
+ * while the thread is still off any run queue.
+ */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	if (sched_policy == SCHED_MLFQ && t->t_priority > 0) {
+		t->t_priority--;
+		t->t_ticks = 0;
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It ages the threads
+ * on the current CPU's run queues: each level is in queueing order,
+ * so only the threads at the heads need to be looked at.
+ */
+void
+schedule(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	struct threadlist *rq;
+	unsigned i;
+
+	if (sched_policy != SCHED_MLFQ) {
+		return;
+	}
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		rq = &c->c_runqueue[i];
+		while (!threadlist_isempty(rq)) {
+			t = rq->tl_head.tln_next->tln_self;
+			if (c->c_hardclocks - t->t_enqueued <
+			    SCHED_AGE_HARDCLOCKS) {
+				break;
+			}
+			threadlist_remhead(rq);
+			c->c_runqueue_count--;
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			runqueue_addtail(c, t);
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Work stealing.
+ *
+ * There is no periodic push migration: a cpu that runs out of threads
+ * takes one from the cpu with the most queued threads before idling,
+ * and idle cpus try again on every interrupt that wakes them up. When
+ * a thread is queued behind another one, an idle cpu is kicked so it
+ * can come and take it.
+ *
+ * Threads that ran recently on their cpu probably still have their
+ * working set in its cache, so they are taken last: the victim's run
+ * queues are searched from the thread it would run last, and the first
+ * one that has not run there for SCHED_AFFINITY_HARDCLOCKS is taken.
+ *
+ * The two runqueue locks are never held together: the stolen thread
+ * is off every run queue until the thief runs it.
+ */
+
+/* Threads that ran on their cpu within this many hardclocks are "hot" */
+#define SCHED_AFFINITY_HARDCLOCKS	2
+
+/*
+ * Take the thread to move off cpu C, NULL if none. The caller holds
+ * C's runqueue lock.
+ */
+static
+struct thread *
+runqueue_steal(struct cpu *c)
+{
+	struct thread *t, *hot = NULL;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * c's curthread can be on its run queue while c
+			 * is still running on its stack (it slept, c went
+			 * idle, it was woken up). Taking it would be bad.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (t == c->c_curthread) {
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+			if (c->c_hardclocks - t->t_lastrun >=
+			    SCHED_AFFINITY_HARDCLOCKS) {
+				goto found;
+			}
+			if (hot == NULL) {
+				hot = t;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	t = hot;
+	if (t == NULL) {
+		return NULL;
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+ found:
+	threadlist_remove(&c->c_runqueue[t->t_priority], t);
+	c->c_runqueue_count--;
+	c->c_stolen++;
+	return t;
+}
+
+/*
+ * Called by a cpu about to go idle, holding no runqueue lock. Returns
+ * a thread taken from the busiest other cpu, already moved to this
+ * one, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *self, *c, *victim;
+	struct thread *t;
+	unsigned i, most;
+
+	self = curcpu->c_self;
+
+	/* Counts are read unlocked: this only picks where to look. */
+	victim = NULL;
+	most = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != self && c->c_runqueue_count > most) {
+			victim = c;
+			most = c->c_runqueue_count;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return NULL;
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_steal(victim);
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		t->t_cpu = self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, self->c_number);
+	}
+	return t;
+}
+
+/*
+ * Wake up an idle cpu, if there is one, to take work from TARGETCPU.
+ */
+static
+void
+thread_kick_idle(struct cpu *targetcpu)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != targetcpu && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+unsigned
+thread_ncpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+void
+thread_printcpustats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u: %u queued, %u steals, %u stolen, "
+			"%u idle without work, idle %llu ms, "
+			"%u timer irqs while idle\n",
+			c->c_number, c->c_runqueue_count, c->c_steals,
+			c->c_stolen, c->c_steal_misses,
+			(unsigned long long) (c->c_idle_ns / 1000000),
+			c->c_idleirqs);
+		spinlock_release(&c->c_runqueue_lock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1042,6 +1586,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_wakeup_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1072,6 +1617,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeup_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1164,6 +1710,50 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/* protects the ts_pending counters of ipi_tlbshootdown_all */
+static struct spinlock shootdown_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Send a TLB shootdown to every other running CPU and wait for all of
+ * them to have done it. Interrupts stay off so we do not move to
+ * another CPU; IPIs sent to us meanwhile (possibly by a CPU waiting
+ * on us the same way) are handled while spinning.
+ */
+void
+ipi_tlbshootdown_all(struct tlbshootdown *mapping)
+{
+	volatile unsigned pending;
+	unsigned i;
+	struct cpu *c;
+	bool hatched;
+	int spl;
+
+	spl = splhigh();
+	pending = 0;
+	mapping->ts_pending = &pending;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		hatched = c->c_hatched;
+		spinlock_release(&c->c_ipi_lock);
+		if (hatched) {
+			spinlock_acquire(&shootdown_lock);
+			pending++;
+			spinlock_release(&shootdown_lock);
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+	while (pending > 0) {
+		if (curcpu->c_ipi_pending != 0) {
+			interprocessor_interrupt();
+		}
+	}
+	splx(spl);
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1183,6 +1773,16 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_OFFLINE)) {
 		/* offline request */
+		curcpu->c_hatched = false;
+		/* our TLB is going away anyway: release the waiters */
+		spinlock_acquire(&shootdown_lock);
+		for (i=0; i<curcpu->c_numshootdown; i++) {
+			if (curcpu->c_shootdown[i].ts_pending != NULL) {
+				(*curcpu->c_shootdown[i].ts_pending)--;
+			}
+		}
+		curcpu->c_numshootdown = 0;
+		spinlock_release(&shootdown_lock);
 		spinlock_release(&curcpu->c_ipi_lock);
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		if (!curcpu->c_isidle) {
@@ -1207,6 +1807,11 @@ interprocessor_interrupt(void)
 		 */
 		for (i=0; i<curcpu->c_numshootdown; i++) {
 			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			if (curcpu->c_shootdown[i].ts_pending != NULL) {
+				spinlock_acquire(&shootdown_lock);
+				(*curcpu->c_shootdown[i].ts_pending)--;
+				spinlock_release(&shootdown_lock);
+			}
 		}
 		curcpu->c_numshootdown = 0;
 	}
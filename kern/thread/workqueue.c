@@ -0,0 +1,431 @@
+/*
+ * Workqueues, see workqueue.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <clock.h>
+#include <workqueue.h>
+
+/*
+ * The pending work of one CPU and the worker that runs it. The
+ * worker is not bound to the CPU (threads can migrate); the list is,
+ * in the sense that only that CPU adds to it, except for flushes.
+ */
+struct wq_cpu {
+	struct workqueue *qc_wq;
+	struct spinlock qc_lock;	/* protects the fields below */
+	struct wchan *qc_wchan;		/* the worker waits here */
+	struct work *qc_head;
+	struct work *qc_tail;
+	unsigned qc_run;		/* work items done */
+	unsigned qc_batches;		/* worker wakeups that found work */
+	unsigned qc_maxbatch;
+};
+
+struct workqueue {
+	char *wq_name;
+	unsigned wq_ncpus;
+	struct wq_cpu *wq_cpus;
+	volatile bool wq_dying;		/* workers exit once their list is empty */
+	struct semaphore *wq_exited;	/* V()ed by each worker on the way out */
+};
+
+struct workqueue *system_wq;
+
+/*
+ * Work queued by workqueue_flush() behind everything else.
+ */
+struct wq_barrier {
+	struct work wb_work;
+	struct semaphore *wb_sem;
+};
+
+////////////////////////////////////////////////////////////
+// work items
+
+static void work_timeout(void *arg);
+
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_func = func;
+	w->w_arg = arg;
+	spinlock_data_set(&w->w_pending, 0);
+	w->w_next = NULL;
+	w->w_cpu = NULL;
+	w->w_wq = NULL;
+	timeout_init(&w->w_timeout, work_timeout, w);
+}
+
+/*
+ * Append W to the list of QC and wake its worker. W is already
+ * marked pending.
+ */
+static
+void
+wq_cpu_add(struct wq_cpu *qc, struct work *w)
+{
+	spinlock_acquire(&qc->qc_lock);
+	w->w_next = NULL;
+	w->w_cpu = qc;
+	if (qc->qc_tail == NULL) {
+		qc->qc_head = w;
+	}
+	else {
+		qc->qc_tail->w_next = w;
+	}
+	qc->qc_tail = w;
+	wchan_wakeone(qc->qc_wchan, &qc->qc_lock);
+	spinlock_release(&qc->qc_lock);
+}
+
+/*
+ * The list of the current CPU. Being moved to another CPU right after
+ * reading curcpu only costs some locality.
+ */
+static
+struct wq_cpu *
+wq_cpu_current(struct workqueue *wq)
+{
+	return &wq->wq_cpus[curcpu->c_number % wq->wq_ncpus];
+}
+
+bool
+work_queue(struct workqueue *wq, struct work *w)
+{
+	KASSERT(wq != NULL);
+	KASSERT(!wq->wq_dying);
+
+	if (spinlock_data_testandset(&w->w_pending) != 0) {
+		return false;
+	}
+	wq_cpu_add(wq_cpu_current(wq), w);
+	return true;
+}
+
+/*
+ * Timeout of a delayed work item, in interrupt context.
+ */
+static
+void
+work_timeout(void *arg)
+{
+	struct work *w = arg;
+
+	wq_cpu_add(wq_cpu_current(w->w_wq), w);
+}
+
+int
+work_queue_delayed(struct workqueue *wq, struct work *w, uint64_t delay_ns)
+{
+	int result;
+
+	KASSERT(wq != NULL);
+	KASSERT(!wq->wq_dying);
+
+	if (spinlock_data_testandset(&w->w_pending) != 0) {
+		return EBUSY;
+	}
+	if (delay_ns == 0) {
+		wq_cpu_add(wq_cpu_current(wq), w);
+		return 0;
+	}
+
+	w->w_cpu = NULL;
+	w->w_wq = wq;
+	result = timeout_add(&w->w_timeout, delay_ns);
+	if (result) {
+		spinlock_data_set(&w->w_pending, 0);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Take W back if it has not started running yet. Returns false if
+ * it was not pending, or its worker has already picked it up.
+ */
+bool
+work_cancel(struct work *w)
+{
+	struct wq_cpu *qc;
+	struct work *prev, *cur;
+
+	if (timeout_cancel(&w->w_timeout)) {
+		spinlock_data_set(&w->w_pending, 0);
+		return true;
+	}
+
+	qc = w->w_cpu;
+	if (qc == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&qc->qc_lock);
+	prev = NULL;
+	for (cur = qc->qc_head; cur != NULL; cur = cur->w_next) {
+		if (cur == w) {
+			break;
+		}
+		prev = cur;
+	}
+	if (cur == NULL) {
+		spinlock_release(&qc->qc_lock);
+		return false;
+	}
+	if (prev == NULL) {
+		qc->qc_head = w->w_next;
+	}
+	else {
+		prev->w_next = w->w_next;
+	}
+	if (qc->qc_tail == w) {
+		qc->qc_tail = prev;
+	}
+	w->w_next = NULL;
+	w->w_cpu = NULL;
+	spinlock_data_set(&w->w_pending, 0);
+	spinlock_release(&qc->qc_lock);
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// workers
+
+/*
+ * Take the whole list at once and run it without the lock. Each item
+ * is no longer pending by the time its function is called, so it can
+ * be queued again from there, or freed: it is not touched afterwards.
+ */
+static
+void
+workqueue_worker(void *p, unsigned long num)
+{
+	struct wq_cpu *qc = p;
+	struct workqueue *wq = qc->qc_wq;
+	struct work *batch, *w;
+	void (*func)(void *);
+	void *arg;
+	unsigned n;
+
+	(void)num;
+
+	spinlock_acquire(&qc->qc_lock);
+	while (1) {
+		if (qc->qc_head == NULL) {
+			if (wq->wq_dying) {
+				break;
+			}
+			wchan_sleep(qc->qc_wchan, &qc->qc_lock);
+			continue;
+		}
+
+		batch = qc->qc_head;
+		qc->qc_head = qc->qc_tail = NULL;
+		spinlock_release(&qc->qc_lock);
+
+		n = 0;
+		while (batch != NULL) {
+			w = batch;
+			batch = w->w_next;
+			func = w->w_func;
+			arg = w->w_arg;
+			spinlock_data_set(&w->w_pending, 0);
+			func(arg);
+			n++;
+		}
+
+		spinlock_acquire(&qc->qc_lock);
+		qc->qc_run += n;
+		qc->qc_batches++;
+		if (n > qc->qc_maxbatch) {
+			qc->qc_maxbatch = n;
+		}
+	}
+	spinlock_release(&qc->qc_lock);
+
+	V(wq->wq_exited);
+}
+
+/*
+ * Tell the first NSTARTED workers to go and wait for them, then free
+ * everything.
+ */
+static
+void
+workqueue_teardown(struct workqueue *wq, unsigned nstarted)
+{
+	struct wq_cpu *qc;
+	unsigned i;
+
+	wq->wq_dying = true;
+	for (i=0; i<nstarted; i++) {
+		qc = &wq->wq_cpus[i];
+		spinlock_acquire(&qc->qc_lock);
+		wchan_wakeall(qc->qc_wchan, &qc->qc_lock);
+		spinlock_release(&qc->qc_lock);
+	}
+	for (i=0; i<nstarted; i++) {
+		P(wq->wq_exited);
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		qc = &wq->wq_cpus[i];
+		KASSERT(qc->qc_head == NULL);
+		if (qc->qc_wchan != NULL) {
+			wchan_destroy(qc->qc_wchan);
+		}
+		spinlock_cleanup(&qc->qc_lock);
+	}
+	sem_destroy(wq->wq_exited);
+	kfree(wq->wq_cpus);
+	kfree(wq->wq_name);
+	kfree(wq);
+}
+
+struct workqueue *
+workqueue_create(const char *name)
+{
+	struct workqueue *wq;
+	struct wq_cpu *qc;
+	unsigned i;
+	int result;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_name = kstrdup(name);
+	if (wq->wq_name == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_exited = sem_create(name, 0);
+	if (wq->wq_exited == NULL) {
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_ncpus = thread_ncpus();
+	wq->wq_dying = false;
+	wq->wq_cpus = kmalloc(wq->wq_ncpus * sizeof(struct wq_cpu));
+	if (wq->wq_cpus == NULL) {
+		sem_destroy(wq->wq_exited);
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		qc = &wq->wq_cpus[i];
+		qc->qc_wq = wq;
+		spinlock_init(&qc->qc_lock);
+		spinlock_setname(&qc->qc_lock, wq->wq_name);
+		qc->qc_wchan = wchan_create(wq->wq_name);
+		qc->qc_head = qc->qc_tail = NULL;
+		qc->qc_run = 0;
+		qc->qc_batches = 0;
+		qc->qc_maxbatch = 0;
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		qc = &wq->wq_cpus[i];
+		if (qc->qc_wchan == NULL) {
+			workqueue_teardown(wq, i);
+			return NULL;
+		}
+		result = thread_fork(wq->wq_name, NULL, workqueue_worker,
+				     qc, i);
+		if (result) {
+			workqueue_teardown(wq, i);
+			return NULL;
+		}
+	}
+
+	return wq;
+}
+
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	KASSERT(wq != system_wq);
+	workqueue_teardown(wq, wq->wq_ncpus);
+}
+
+static
+void
+workqueue_barrier(void *arg)
+{
+	struct wq_barrier *wb = arg;
+
+	V(wb->wb_sem);
+}
+
+int
+workqueue_flush(struct workqueue *wq)
+{
+	struct wq_barrier *wb;
+	struct semaphore *sem;
+	unsigned i;
+
+	sem = sem_create("wq_flush", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+	wb = kmalloc(wq->wq_ncpus * sizeof(struct wq_barrier));
+	if (wb == NULL) {
+		sem_destroy(sem);
+		return ENOMEM;
+	}
+
+	/* one barrier at the tail of every list, they run in order */
+	for (i=0; i<wq->wq_ncpus; i++) {
+		work_init(&wb[i].wb_work, workqueue_barrier, &wb[i]);
+		wb[i].wb_sem = sem;
+		spinlock_data_set(&wb[i].wb_work.w_pending, 1);
+		wq_cpu_add(&wq->wq_cpus[i], &wb[i].wb_work);
+	}
+	for (i=0; i<wq->wq_ncpus; i++) {
+		P(sem);
+	}
+
+	kfree(wb);
+	sem_destroy(sem);
+	return 0;
+}
+
+void
+workqueue_printstats(struct workqueue *wq)
+{
+	struct wq_cpu *qc;
+	unsigned i;
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		qc = &wq->wq_cpus[i];
+		spinlock_acquire(&qc->qc_lock);
+		kprintf("%s cpu%u: %u done in %u batches (largest %u)\n",
+			wq->wq_name, i, qc->qc_run, qc->qc_batches,
+			qc->qc_maxbatch);
+		spinlock_release(&qc->qc_lock);
+	}
+}
+
+/*
+ * Called by boot() once the secondary CPUs are running, so that
+ * system_wq gets a list and a worker for each of them.
+ */
+void
+workqueue_bootstrap(void)
+{
+	system_wq = workqueue_create("system_wq");
+	if (system_wq == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+}
@@ -0,0 +1,450 @@
+/*
+ * Pipes, see pipe.h.
+ *
+ * Data goes through a ring of p_size bytes protected by p_lock; a
+ * reader finding it empty waits on p_readcv, a writer finding it full
+ * on p_writecv. Reads return as soon as something has been read,
+ * writes only when everything has been written (or the read end is
+ * gone).
+ *
+ * A reader that has to wait leaves its uio in p_rdwait. If the
+ * writer can reach the reader's buffer too (a kernel buffer, or both
+ * in the same address space) it copies straight into it, skipping
+ * the ring, and wakes the reader up with its read done.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <stat.h>
+#include <uio.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <pipe.h>
+
+struct pipe {
+	struct vnode p_readvn;
+	struct vnode p_writevn;
+
+	struct lock *p_lock;		/* protects everything below */
+	struct cv *p_readcv;
+	struct cv *p_writecv;
+	char *p_buf;
+	size_t p_size;
+	size_t p_head;			/* next byte to read */
+	size_t p_count;			/* bytes in the ring */
+	bool p_readclosed;
+	bool p_writeclosed;
+	struct uio *p_rdwait;		/* waiting reader, for direct copies */
+};
+
+static const struct vnode_ops pipe_readops;
+static const struct vnode_ops pipe_writeops;
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	cv_destroy(p->p_readcv);
+	cv_destroy(p->p_writecv);
+	lock_destroy(p->p_lock);
+	kfree(p->p_buf);
+	kfree(p);
+}
+
+int
+pipe_create(size_t size, struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *p;
+
+	if (size == 0) {
+		size = PIPE_SIZE_DEFAULT;
+	}
+	if (size > PIPE_SIZE_MAX) {
+		return EINVAL;
+	}
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_buf = kmalloc(size);
+	p->p_lock = lock_create("pipe");
+	p->p_readcv = cv_create("pipe read");
+	p->p_writecv = cv_create("pipe write");
+	if (p->p_buf == NULL || p->p_lock == NULL || p->p_readcv == NULL ||
+	    p->p_writecv == NULL) {
+		if (p->p_readcv != NULL) {
+			cv_destroy(p->p_readcv);
+		}
+		if (p->p_writecv != NULL) {
+			cv_destroy(p->p_writecv);
+		}
+		if (p->p_lock != NULL) {
+			lock_destroy(p->p_lock);
+		}
+		kfree(p->p_buf);
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_size = size;
+	p->p_head = 0;
+	p->p_count = 0;
+	p->p_readclosed = false;
+	p->p_writeclosed = false;
+	p->p_rdwait = NULL;
+
+	vnode_init(&p->p_readvn, &pipe_readops, NULL, p);
+	vnode_init(&p->p_writevn, &pipe_writeops, NULL, p);
+
+	*readend = &p->p_readvn;
+	*writeend = &p->p_writevn;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// data transfer
+
+/*
+ * Whether the writer, running with uio W, can fill the reader's
+ * uio R directly.
+ */
+static
+bool
+pipe_direct_ok(struct uio *r, struct uio *w)
+{
+	if (r->uio_segflg == UIO_SYSSPACE) {
+		return true;
+	}
+	return w->uio_segflg != UIO_SYSSPACE && r->uio_space == w->uio_space;
+}
+
+/*
+ * Copy from the writer's uio W into the waiting reader's uio R, as
+ * much as both allow.
+ */
+static
+int
+pipe_direct(struct uio *r, struct uio *w)
+{
+	struct iovec *iov;
+	size_t n, stoplen;
+	void *dest;
+	int result;
+
+	while (r->uio_resid > 0 && w->uio_resid > 0) {
+		iov = r->uio_iov;
+		if (iov->iov_len == 0) {
+			r->uio_iov++;
+			r->uio_iovcnt--;
+			continue;
+		}
+		n = iov->iov_len;
+		if (n > w->uio_resid) {
+			n = w->uio_resid;
+		}
+
+		if (r->uio_segflg == UIO_SYSSPACE) {
+			dest = iov->iov_kbase;
+		}
+		else {
+			result = copycheck(iov->iov_ubase, n, &stoplen);
+			if (result == 0 && stoplen != n) {
+				result = EFAULT;
+			}
+			if (result) {
+				return result;
+			}
+			dest = (void *)iov->iov_ubase;
+		}
+
+		/* W's user memory (if any) is mapped, and so is R's */
+		result = uiomove(dest, n, w);
+		if (result) {
+			return result;
+		}
+
+		if (r->uio_segflg == UIO_SYSSPACE) {
+			iov->iov_kbase = (char *)iov->iov_kbase + n;
+		}
+		else {
+			iov->iov_ubase += n;
+		}
+		iov->iov_len -= n;
+		r->uio_resid -= n;
+		r->uio_offset += n;
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *p = vn->vn_data;
+	size_t n, resid;
+	int result = 0;
+
+	lock_acquire(p->p_lock);
+
+	resid = uio->uio_resid;
+	while (p->p_count == 0 && !p->p_writeclosed && resid > 0) {
+		if (p->p_rdwait == NULL) {
+			p->p_rdwait = uio;
+		}
+		cv_wait(p->p_readcv, p->p_lock);
+		if (p->p_rdwait == uio) {
+			p->p_rdwait = NULL;
+		}
+		if (uio->uio_resid != resid) {
+			/* a writer filled it in */
+			cv_broadcast(p->p_writecv, p->p_lock);
+			lock_release(p->p_lock);
+			return 0;
+		}
+	}
+
+	while (p->p_count > 0 && uio->uio_resid > 0) {
+		/* up to the end of the ring at a time */
+		n = p->p_size - p->p_head;
+		if (n > p->p_count) {
+			n = p->p_count;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(p->p_buf + p->p_head, n, uio);
+		if (result) {
+			break;
+		}
+		p->p_head = (p->p_head + n) % p->p_size;
+		p->p_count -= n;
+	}
+	if (p->p_count == 0) {
+		p->p_head = 0;
+	}
+
+	cv_broadcast(p->p_writecv, p->p_lock);
+	lock_release(p->p_lock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *p = vn->vn_data;
+	size_t n, tail;
+	int result = 0;
+
+	lock_acquire(p->p_lock);
+
+	while (uio->uio_resid > 0) {
+		if (p->p_readclosed) {
+			result = EPIPE;
+			break;
+		}
+
+		if (p->p_count == 0 && p->p_rdwait != NULL &&
+		    pipe_direct_ok(p->p_rdwait, uio)) {
+			result = pipe_direct(p->p_rdwait, uio);
+			p->p_rdwait = NULL;
+			cv_broadcast(p->p_readcv, p->p_lock);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+
+		if (p->p_count == p->p_size) {
+			cv_wait(p->p_writecv, p->p_lock);
+			continue;
+		}
+
+		/* up to the end of the ring or of the free space */
+		tail = (p->p_head + p->p_count) % p->p_size;
+		n = p->p_size - p->p_count;
+		if (n > p->p_size - tail) {
+			n = p->p_size - tail;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(p->p_buf + tail, n, uio);
+		if (result) {
+			break;
+		}
+		p->p_count += n;
+		cv_broadcast(p->p_readcv, p->p_lock);
+	}
+
+	lock_release(p->p_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// other ops
+
+/*
+ * The last reference to one end is gone: tell the other side. The
+ * pipe goes away with the second end. The two ends can be reclaimed
+ * at the same time, so this one is cleaned up before it is marked
+ * closed: after the lock is dropped only the side that saw both ends
+ * closed touches the pipe.
+ */
+static
+int
+pipe_reclaim(struct vnode *vn)
+{
+	struct pipe *p = vn->vn_data;
+	bool last;
+
+	lock_acquire(p->p_lock);
+	vnode_cleanup(vn);
+	if (vn == &p->p_readvn) {
+		p->p_readclosed = true;
+		cv_broadcast(p->p_writecv, p->p_lock);
+	}
+	else {
+		p->p_writeclosed = true;
+		cv_broadcast(p->p_readcv, p->p_lock);
+	}
+	last = p->p_readclosed && p->p_writeclosed;
+	lock_release(p->p_lock);
+
+	if (last) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+static
+int
+pipe_eachopen(struct vnode *vn, int openflags)
+{
+	(void)vn;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+pipe_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_stat(struct vnode *vn, struct stat *buf)
+{
+	struct pipe *p = vn->vn_data;
+
+	bzero(buf, sizeof(*buf));
+
+	lock_acquire(p->p_lock);
+	buf->st_size = p->p_count;
+	lock_release(p->p_lock);
+
+	buf->st_mode = S_IFIFO | 0600;
+	buf->st_nlink = 1;
+	buf->st_blksize = p->p_size;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *vn, mode_t *ret)
+{
+	(void)vn;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *vn, off_t len)
+{
+	(void)vn;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops pipe_readops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = vopfail_uio_inval,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = vopfail_uio_notdir,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+static const struct vnode_ops pipe_writeops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+
+	.vop_read = vopfail_uio_inval,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = vopfail_uio_notdir,
+
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
@@ -38,6 +38,8 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <textcache.h>
+#include "opt-os161vm.h"
 
 
 /* Does most of the work for open(). */
@@ -99,6 +101,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 		else {
 			result = VOP_TRUNCATE(vn, 0);
+#if OPT_OS161VM
+			textcache_invalidate(vn);
+#endif
 		}
 		if (result) {
 			VOP_DECREF(vn);
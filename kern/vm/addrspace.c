@@ -43,6 +43,10 @@
 #include <vm_tlb.h>
 #include <vmc1.h>
 #include <statistics.h>
+#include <textcache.h>
+#include <prefault.h>
+#include <kmem_cache.h>
+#include <workqueue.h>
 
 
 /*
@@ -66,12 +70,15 @@
  * It does NOT allocate space for the stack, the program binary, etc., just the structure that hold information 
  * about the address space. 
 */
+static struct kmem_cache as_cache =
+	KMEM_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace), NULL, NULL);
+
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
 	// coremap_turn_on();
-	as = kmalloc(sizeof(struct addrspace));
+	as = kmem_cache_alloc(&as_cache);
 	if (as == NULL) {
 		return NULL;
 	}
@@ -81,7 +88,8 @@ as_create(void)
 	as->data = seg_create();
 	as->stack = seg_create();
 	as->pt = pt_create();
-	swapfile_init();
+	// the policy is fixed at exec time, changing it does not affect running programs
+	as->prefault = prefault_get_policy();
 
 	return as;
 }
@@ -112,12 +120,28 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	return 0;
 }
 
-void
-as_destroy(struct addrspace *as)
+/**
+ * The part of the teardown other programs can see: the learned prefault
+ * history and the shared text pages. It must be over before the program
+ * can be run again.
+*/
+static void
+as_release_shared(struct addrspace *as)
 {
-	struct vnode *v;
+	// the working set is taken before the shared entries are cleared
+	prefault_record(as);
+	// shared text pages are released through the cache, before the page table goes away
+	textcache_unmap_segment(as->code, as->pt);
+	textcache_unmap_segment(as->data, as->pt);
+}
 
-	KASSERT(as != NULL);
+/**
+ * The rest: private frames, swap slots, page table.
+*/
+static void
+as_teardown(struct addrspace *as)
+{
+	struct vnode *v;
 
 	kprintf("Total SWAPOUT: %d -- Total SWAPIN: %d\n", getOut(), getIn());
 	v = as->code->vnode;
@@ -126,7 +150,42 @@ as_destroy(struct addrspace *as)
 	seg_destroy(as->stack);
 	pt_destroy(as->pt);
 	vfs_close(v);
-	kfree(as);
+	kmem_cache_free(&as_cache, as);
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	KASSERT(as != NULL);
+
+	as_release_shared(as);
+	coremap_disown(as);
+	as_teardown(as);
+}
+
+static void as_destroy_work(void *arg) {
+	as_teardown(arg);
+}
+
+/**
+ * Releases the shared state and disowns the frames right away, then hands
+ * the private teardown (frames, swap slots, page table) to a worker, so that
+ * an exiting process can wake up its parent first. All done here if there is no worker yet.
+*/
+void
+as_destroy_deferred(struct addrspace *as)
+{
+	KASSERT(as != NULL);
+
+	as_release_shared(as);
+	// eviction must not pick its frames while the page table goes away
+	coremap_disown(as);
+	if (system_wq == NULL) {
+		as_teardown(as);
+		return;
+	}
+	work_init(&as->destroy_work, as_destroy_work, as);
+	work_queue(system_wq, &as->destroy_work);
 }
 
 /**
@@ -242,14 +301,14 @@ as_prepare_load(struct addrspace *as)
 
 /**
  * ANCHOR[id=complete_load]
- * No idea, called after each segment load in memory but 
- * this should not be perfomed in demand paging
+ * Called by load_elf() once the segments are defined: with demand paging
+ * nothing is loaded here, unless the prefault policy of the address space
+ * asks for some pages to be brought in before the program starts
 */
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
-	return 0;
+	return prefault_load(as);
 }
 
 /**
@@ -14,6 +14,8 @@
 #include <vmc1.h>
 #include <swapfile.h>
 #include <vm_tlb.h>
+#include <kmem_cache.h>
+#include "opt-ptswap.h"
 
 /**
  * Lower layer of the whole system, here we manage all the physical pages keeping track of which as they refer to
@@ -67,7 +69,8 @@ static int get_victim_coremap(int size) {
 
         victim = current_victim;
         current_victim = (current_victim + 1) % nRamFrames;
-        if(coremap[victim].status != fixed && coremap[victim].status != clean) {
+        if(coremap[victim].status != fixed && coremap[victim].status != clean && coremap[victim].status != shared &&
+           coremap[victim].status != dying) {
             len += 1; 
         }
         else len = 0;
@@ -97,9 +100,13 @@ void coremap_init() {
         coremap[i].as = NULL;
         coremap[i].alloc_size = 0;
         coremap[i].vaddr = 0; 
+        coremap[i].ref_count = 0;
+        coremap[i].kmref = NULL;
         //the physical address  = i * PAGE_SIZE
     }
 
+    spinlock_setname(&freemem_lock, "freemem_lock");
+
     // let it be usable
     spinlock_acquire(&freemem_lock);
     coremapActive = 1;
@@ -175,11 +182,33 @@ static int freeppages(paddr_t addr, unsigned long npages) {
     coremap[i].status = free;
     coremap[i].as = NULL;
     coremap[i].alloc_size = 0;
+    coremap[i].kmref = NULL;
   }
   spinlock_release(&freemem_lock);
 
   return 1;
 }
+/**
+ * Drops the TLB entry of an evicted page. The page of another process may be
+ * cached in the TLB of the CPU it runs on, so every CPU is told to drop it.
+*/
+static void victim_tlb_remove(struct addrspace *victim_as, vaddr_t victim_va) {
+    struct tlbshootdown ts;
+    int result;
+
+    if (victim_as == proc_getas()) {
+        result = tlb_remove_by_va(victim_va);
+        KASSERT(result == 0);
+        return;
+    }
+
+    ts.ts_vaddr = victim_va;
+    ts.ts_npages = 1;
+    ts.ts_pending = NULL;
+    vm_tlbshootdown(&ts);
+    ipi_tlbshootdown_all(&ts);
+}
+
 /**
  * Same behavior of dumbvm's getppages adapted to the coremap structure
 */
@@ -191,7 +220,7 @@ static paddr_t getppages(unsigned long npages) {
     vaddr_t victim_va;
     int result_swap_out;
     struct addrspace* as;
-    int result;
+    struct addrspace *victim_as;
 
     /* try freed pages first */
     addr = getfreeppages(npages);
@@ -205,17 +234,18 @@ static paddr_t getppages(unsigned long npages) {
 
         if(addr == 0) {
 
-            victim = get_victim_coremap(npages);
-
             as = proc_getas();
             if (as == NULL) {
                 /*
                 * Kernel thread without an address space; leave the
-                * prior address space in place.
+                * prior address space in place (and the victim
+                * pointer where it is).
                 */
                 return 0;
             }
 
+            victim = get_victim_coremap(npages);
+
             for(i = 0; i < npages; i++) {
                 pos = victim + i;
                 //here we should add the call to swap out
@@ -223,12 +253,13 @@ static paddr_t getppages(unsigned long npages) {
 
 
                 victim_va = coremap[pos].vaddr;
+                // each victim frame may belong to another process
+                victim_as = coremap[pos].as != NULL ? coremap[pos].as : as;
                 result_swap_out = swap_out(victim_pa, victim_va);
 
-                pt_set_offset(as->pt, victim_va, result_swap_out);
-                pt_set_pa(as->pt, victim_va, 0);
-                result = tlb_remove_by_va(victim_va);
-                KASSERT(result != -1);
+                pt_set_offset(victim_as->pt, victim_va, result_swap_out);
+                pt_set_pa(victim_as->pt, victim_va, 0);
+                victim_tlb_remove(victim_as, victim_va);
             }
             addr = victim * PAGE_SIZE;
 
@@ -262,8 +293,8 @@ static paddr_t getppage_user(vaddr_t va, struct addrspace *as) {
     paddr_t pa;
     paddr_t victim_pa;
     vaddr_t victim_va;
+    struct addrspace *victim_as;
     int result_swap_out;
-    int result;
     
 
     // looks for a previously freed page using a linear search
@@ -286,7 +317,12 @@ static paddr_t getppage_user(vaddr_t va, struct addrspace *as) {
         pa = ram_stealmem(1);
         spinlock_release(&stealmem_lock);
 
-        
+#if OPT_PTSWAP
+        // before evicting a user page, give back the frames of a page table nobody is using
+        if(pa == 0 && pt_swap_out_inner(as->pt)) {
+            return getppage_user(va, as);
+        }
+#endif
        
         //if no physical memory is found we need to choose a victim entry by round robin
         if(pa == 0)
@@ -297,17 +333,18 @@ static paddr_t getppage_user(vaddr_t va, struct addrspace *as) {
             victim_pa = pos * PAGE_SIZE;
 
             victim_va = coremap[pos].vaddr;
+            // the victim may belong to another process
+            victim_as = coremap[pos].as != NULL ? coremap[pos].as : as;
 
             result_swap_out = swap_out(victim_pa, victim_va);
 
-            pt_set_offset(as->pt, victim_va, result_swap_out);
-            pt_set_pa(as->pt, victim_va, 0);
+            pt_set_offset(victim_as->pt, victim_va, result_swap_out);
+            pt_set_pa(victim_as->pt, victim_va, 0);
             
             pa = victim_pa;
 
             pos = victim_pa / PAGE_SIZE;
-            result = tlb_remove_by_va(victim_va);
-            KASSERT(result == 0);
+            victim_tlb_remove(victim_as, victim_va);
         }
         else
         { 
@@ -356,6 +393,7 @@ void page_free(paddr_t addr) {
     pos = addr / PAGE_SIZE;
 
     KASSERT(coremap[pos].status != fixed);
+    KASSERT(coremap[pos].status != shared);
 
     spinlock_acquire(&freemem_lock);
     coremap[pos].status = free;
@@ -367,6 +405,82 @@ void page_free(paddr_t addr) {
     ///check if dirty swap_out()
 }
 
+/**
+ * User side, called before AS is torn down: its frames are no longer evictable
+ * (nobody must touch its page table from now on) until page_free() gives them back.
+*/
+void coremap_disown(struct addrspace *as) {
+    int i;
+
+    KASSERT(as != NULL);
+    if (!isMapActive()) return;
+
+    spinlock_acquire(&freemem_lock);
+    for (i = 0; i < nRamFrames; i++) {
+        if (coremap[i].as == as && coremap[i].status == dirty) {
+            coremap[i].status = dying;
+            coremap[i].as = NULL;
+        }
+    }
+    spinlock_release(&freemem_lock);
+}
+
+/**
+ * User side, turns a frame just loaded by its first user into a shared one.
+ * Shared frames have no owner address space and are never chosen as victims.
+*/
+void page_share(paddr_t addr) {
+    int pos;
+
+    pos = addr / PAGE_SIZE;
+
+    spinlock_acquire(&freemem_lock);
+    KASSERT(coremap[pos].status == dirty);
+    coremap[pos].status = shared;
+    coremap[pos].as = NULL;
+    coremap[pos].ref_count = 1;
+    spinlock_release(&freemem_lock);
+}
+
+/**
+ * User side, one more address space maps the shared frame
+*/
+void page_ref(paddr_t addr) {
+    int pos;
+
+    pos = addr / PAGE_SIZE;
+
+    spinlock_acquire(&freemem_lock);
+    KASSERT(coremap[pos].status == shared);
+    coremap[pos].ref_count++;
+    spinlock_release(&freemem_lock);
+}
+
+/**
+ * User side, one address space no longer maps the shared frame.
+ * The frame is freed with its last reference, the remaining references are returned.
+*/
+unsigned int page_unref(paddr_t addr) {
+    int pos;
+    unsigned int refs;
+
+    pos = addr / PAGE_SIZE;
+
+    spinlock_acquire(&freemem_lock);
+    KASSERT(coremap[pos].status == shared);
+    KASSERT(coremap[pos].ref_count > 0);
+    refs = --coremap[pos].ref_count;
+    if (refs == 0) {
+        coremap[pos].status = free;
+        coremap[pos].as = NULL;
+        coremap[pos].alloc_size = 0;
+        coremap[pos].vaddr = 0;
+    }
+    spinlock_release(&freemem_lock);
+
+    return refs;
+}
+
 /**
  * Kernel side, wrapper of getppages
 */
@@ -375,6 +489,11 @@ vaddr_t alloc_kpages(unsigned long npages) {
 
 	vm_can_sleep();
 	pa = getppages(npages);
+	if (pa==0) {
+		// free objects kept by the object caches are the first thing to give up
+		kmem_cache_reap();
+		pa = getppages(npages);
+	}
 	if (pa==0) {
 		return 0;
 	}
@@ -395,3 +514,33 @@ void free_kpages(vaddr_t addr) {
   }
 }
 
+/**
+ * Kernel side, kmalloc attaches its pageref to each page of the subpage allocator
+ * (NULL when the page goes back), so that kfree() finds it without a list walk.
+ * Plain stores: the entry of a fixed page belongs to whoever allocated it.
+*/
+void coremap_set_kmref(vaddr_t kvaddr, void *ref) {
+    long pos;
+
+    if (!coremapActive) return;
+    pos = (kvaddr - MIPS_KSEG0) / PAGE_SIZE;
+    KASSERT(pos < nRamFrames);
+    KASSERT(coremap[pos].status == fixed);
+    coremap[pos].kmref = ref;
+}
+
+/**
+ * Kernel side, returns -1 if the page is not tracked by the coremap (coremap
+ * not active, or page taken before coremap_init) so the caller has to look
+ * for it on its own, otherwise 0 with the kmalloc pageref (possibly NULL) in REF.
+ * No lock is taken: kfree() only asks about pages holding a live block.
+*/
+int coremap_get_kmref(vaddr_t kvaddr, void **ref) {
+    long pos;
+
+    if (!coremapActive) return -1;
+    pos = (kvaddr - MIPS_KSEG0) / PAGE_SIZE;
+    if (pos >= nRamFrames || coremap[pos].status != fixed) return -1;
+    *ref = coremap[pos].kmref;
+    return 0;
+}
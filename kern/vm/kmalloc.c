@@ -30,10 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
 	#include <coremap.h>
+	#include <vmalloc.h>
 #endif
 
 /*
@@ -164,14 +167,56 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their freelists. The common case
+ * of allocating and freeing small blocks is kept off it by the per-cpu
+ * magazines below, which only come here in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a small stack (magazine) of
+//    free blocks that it hands out and takes back under its own
+//    spinlock only, so the common kmalloc/kfree pairs of thread, proc
+//    and page table structures never meet on kmalloc_spinlock. The
+//    global freelists are only visited when a magazine runs empty
+//    (refill MAG_BATCH blocks at once) or full (give back MAG_BATCH
+//    blocks at once).
+//
+//    Blocks sitting in a magazine are free for the client but still
+//    allocated as far as their page is concerned, so such a page is
+//    not released. kheap_printstats() reports how many there are.
+//
+//    Magazines need the pageref of a pointer without kmalloc_spinlock,
+//    which the coremap gives (not available with dumbvm), and are off
+//    with GUARDS and LABELS so that every block goes through the full
+//    bookkeeping.
+//
+
+#if !OPT_DUMBVM && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#define MAG_SIZE  16
+#define MAG_BATCH (MAG_SIZE / 2)
+
+struct kmalloc_magazine {
+	struct spinlock km_lock;
+	unsigned km_count[NSIZES];
+	void *km_blocks[NSIZES][MAG_SIZE];
+	unsigned km_hits;		/* served by the magazine */
+	unsigned km_misses;		/* served by the freelists */
+	struct kmalloc_magazine *km_next;	/* all magazines */
+};
+
+#ifdef MAGAZINES
+/* List of all magazines, for kheap_printstats. Protected by kmalloc_spinlock. */
+static struct kmalloc_magazine *allmagazines;
+#endif
+
 ////////////////////////////////////////
 
 /*
@@ -701,6 +746,15 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+/*
+ * Name the heap lock for the lock profiler.
+ */
+void
+kheap_bootstrap(void)
+{
+	spinlock_setname(&kmalloc_spinlock, "kmalloc_spinlock");
+}
+
 void
 kheap_nextgeneration(void)
 {
@@ -815,7 +869,30 @@ kheap_printstats(void)
 		subpage_stats(pr);
 	}
 
+#ifdef MAGAZINES
+	{
+		struct kmalloc_magazine *mag;
+		unsigned i, cached;
+
+		for (mag = allmagazines; mag != NULL; mag = mag->km_next) {
+			spinlock_acquire(&mag->km_lock);
+			cached = 0;
+			for (i=0; i<NSIZES; i++) {
+				cached += mag->km_count[i];
+			}
+			kprintf("magazine at %p: %u blocks cached, "
+				"%u hits, %u misses\n", mag, cached,
+				mag->km_hits, mag->km_misses);
+			spinlock_release(&mag->km_lock);
+		}
+	}
+#endif
+
 	spinlock_release(&kmalloc_spinlock);
+
+#if !OPT_DUMBVM
+	vmalloc_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -848,6 +925,147 @@ remove_lists(struct pageref *pr, int blktype)
 	}
 }
 
+/*
+ * Find the pageref of the heap page holding PTRADDR, or NULL if it is
+ * not on any heap page we recognize. Pages taken after the coremap is
+ * up carry their pageref in their coremap entry; only the few pages
+ * allocated earlier in boot need the walk of the list of all pages.
+ *
+ * Must be called holding kmalloc_spinlock, unless the caller knows the
+ * page holds a live block (so it cannot go away) and the coremap answers.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+#if !OPT_DUMBVM
+	void *ref;
+
+	if (coremap_get_kmref(ptraddr, &ref) == 0) {
+		pr = ref;
+		KASSERT(pr == NULL ||
+			(ptraddr & PAGE_FRAME) == PR_PAGEADDR(pr));
+		return pr;
+	}
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= PR_PAGEADDR(pr) &&
+		    ptraddr < PR_PAGEADDR(pr) + PAGE_SIZE) {
+			break;
+		}
+	}
+	return pr;
+}
+
+/*
+ * Take one block off the freelist of the page PR, which must have one.
+ */
+static
+void *
+takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR back on the freelist of its page PR.
+ * Returns true if this makes the whole page free, in which case the
+ * page has been taken off the lists and the caller must hand it to
+ * free_kpages once it has released kmalloc_spinlock.
+ */
+static
+bool
+putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+	KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree < PAGE_SIZE / sizes[blktype]) {
+		return false;
+	}
+
+	/* Whole page is free. */
+	remove_lists(pr, blktype);
+#if !OPT_DUMBVM
+	coremap_set_kmref(prpage, NULL);
+#endif
+	freepageref(pr);
+	return true;
+}
+
 /*
  * Given a requested client size, return the block type, that is, the
  * index into the sizes[] array for the block size to use.
@@ -925,25 +1143,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1017,6 +1217,10 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+#if !OPT_DUMBVM
+	coremap_set_kmref(prpage, pr);
+#endif
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -1033,8 +1237,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1069,30 +1271,15 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1112,40 +1299,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (putblock(pr, ptraddr)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1166,6 +1320,227 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * Make the magazine of a new cpu (see cpu_create).
+ */
+struct kmalloc_magazine *
+kmalloc_magazine_create(void)
+{
+#ifdef MAGAZINES
+	struct kmalloc_magazine *mag;
+	unsigned i;
+
+	mag = kmalloc(sizeof(*mag));
+	if (mag == NULL) {
+		return NULL;
+	}
+	spinlock_init(&mag->km_lock);
+	for (i=0; i<NSIZES; i++) {
+		mag->km_count[i] = 0;
+	}
+	mag->km_hits = 0;
+	mag->km_misses = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	mag->km_next = allmagazines;
+	allmagazines = mag;
+	spinlock_release(&kmalloc_spinlock);
+
+	return mag;
+#else
+	return NULL;
+#endif
+}
+
+#ifdef MAGAZINES
+
+/*
+ * Magazine of the cpu we are running on, if any. We might be moved
+ * to another cpu before taking its lock; that is harmless, the lock
+ * and not the cpu is what protects it.
+ */
+static
+struct kmalloc_magazine *
+curmagazine(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	return curcpu->c_kmalloc_mag;
+}
+
+/*
+ * Take up to N free blocks of type BLKTYPE from the pages we already
+ * have. Never allocates a new page: when this finds nothing the caller
+ * goes through subpage_kmalloc, which does.
+ */
+static
+unsigned
+getbatch(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	unsigned got = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = takeblock(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	return got;
+}
+
+/*
+ * Give N blocks (already deadbeefed) back to their pages, releasing
+ * the pages that become completely free.
+ */
+static
+void
+putbatch(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_SIZE];
+	struct pageref *pr;
+	unsigned i, nfreepages = 0;
+
+	KASSERT(n <= MAG_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		pr = findpageref((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL);
+		if (putblock(pr, (vaddr_t)blocks[i])) {
+			freepages[nfreepages++] = PR_PAGEADDR(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE through the magazine of this cpu.
+ * Returns NULL if the caller should fall back to subpage_kmalloc.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct kmalloc_magazine *mag;
+	void *batch[MAG_BATCH];
+	void *retptr;
+	unsigned n;
+
+	mag = curmagazine();
+	if (mag == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&mag->km_lock);
+	if (mag->km_count[blktype] > 0) {
+		retptr = mag->km_blocks[blktype][--mag->km_count[blktype]];
+		mag->km_hits++;
+		spinlock_release(&mag->km_lock);
+		return retptr;
+	}
+	mag->km_misses++;
+	spinlock_release(&mag->km_lock);
+
+	/* Empty: refill from the freelists without holding the magazine. */
+	n = getbatch(blktype, batch, MAG_BATCH);
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = batch[--n];
+
+	mag = curmagazine();
+	if (mag != NULL) {
+		spinlock_acquire(&mag->km_lock);
+		while (n > 0 && mag->km_count[blktype] < MAG_SIZE) {
+			mag->km_blocks[blktype][mag->km_count[blktype]++] =
+				batch[--n];
+		}
+		spinlock_release(&mag->km_lock);
+	}
+
+	/* Somebody refilled it meanwhile; return what does not fit. */
+	if (n > 0) {
+		putbatch(batch, n);
+	}
+	return retptr;
+}
+
+/*
+ * Free PTR into the magazine of this cpu. Returns -1 if the pointer
+ * is not known to be a subpage block, so that the caller goes the
+ * long way (subpage_kfree).
+ */
+static
+int
+magazine_free(void *ptr)
+{
+	struct kmalloc_magazine *mag;
+	struct pageref *pr;
+	void *ref;
+	void *batch[MAG_BATCH];
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	unsigned blktype, i;
+
+	mag = curmagazine();
+	if (mag == NULL) {
+		return -1;
+	}
+
+	/*
+	 * The block is live, so its page cannot go away and its type
+	 * cannot change: no need for kmalloc_spinlock here.
+	 */
+	if (coremap_get_kmref(ptraddr, &ref) || ref == NULL) {
+		return -1;
+	}
+	pr = ref;
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	if ((ptraddr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spinlock_acquire(&mag->km_lock);
+	if (mag->km_count[blktype] < MAG_SIZE) {
+		mag->km_blocks[blktype][mag->km_count[blktype]++] = ptr;
+		spinlock_release(&mag->km_lock);
+		return 0;
+	}
+
+	/* Full: keep this block and give back the oldest half. */
+	for (i=0; i<MAG_BATCH; i++) {
+		batch[i] = mag->km_blocks[blktype][i];
+	}
+	for (i=MAG_BATCH; i<MAG_SIZE; i++) {
+		mag->km_blocks[blktype][i - MAG_BATCH] =
+			mag->km_blocks[blktype][i];
+	}
+	mag->km_count[blktype] = MAG_SIZE - MAG_BATCH;
+	mag->km_blocks[blktype][mag->km_count[blktype]++] = ptr;
+	spinlock_release(&mag->km_lock);
+
+	putbatch(batch, MAG_BATCH);
+	return 0;
+}
+
+#endif /* MAGAZINES */
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
@@ -1195,6 +1570,15 @@ kmalloc(size_t sz)
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
+#if !OPT_DUMBVM
+			/*
+			 * No run of free frames long enough: use scattered
+			 * ones mapped in kseg2 instead.
+			 */
+			if (npages > 1) {
+				return vmalloc(sz);
+			}
+#endif
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
@@ -1202,6 +1586,16 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		void *ptr = magazine_alloc(blocktype(checksz));
+
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1220,7 +1614,19 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if !OPT_DUMBVM
+	else if (VMALLOC_OWNS(ptr)) {
+		vfree(ptr);
+		return;
+	}
+#endif
+#ifdef MAGAZINES
+	else if (magazine_free(ptr) == 0) {
+		return;
+	}
+#endif
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,246 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+/*
+ * Kernel object caches. See kmem_cache.h.
+ *
+ * Each cache is a small stack of constructed objects in front of
+ * kmalloc. The constructor and destructor run without the cache lock
+ * held, since they are allowed to allocate (e.g. a semaphore).
+ */
+
+/* All caches that have been used, for printstats and reap. */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Finish setting up a cache on its first use. Static caches come here
+ * straight from their initializer.
+ */
+static
+void
+kmem_cache_register(struct kmem_cache *kc)
+{
+	unsigned maxfree;
+
+	maxfree = KMEM_CACHE_MAXBYTES / kc->kc_size;
+	if (maxfree > KMEM_CACHE_MAXFREE) {
+		maxfree = KMEM_CACHE_MAXFREE;
+	}
+	if (maxfree < 2) {
+		maxfree = 2;
+	}
+
+	spinlock_acquire(&allcaches_lock);
+	spinlock_acquire(&kc->kc_lock);
+	if (!kc->kc_registered) {
+		kc->kc_maxfree = maxfree;
+		kc->kc_registered = true;
+		kc->kc_next = allcaches;
+		allcaches = kc;
+	}
+	spinlock_release(&kc->kc_lock);
+	spinlock_release(&allcaches_lock);
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_maxfree = 0;
+	kc->kc_registered = false;
+	kc->kc_next = NULL;
+	kc->kc_allocs = 0;
+	kc->kc_hits = 0;
+	kc->kc_inuse = 0;
+	kc->kc_constructed = 0;
+	kc->kc_destructed = 0;
+
+	kmem_cache_register(kc);
+	return kc;
+}
+
+/*
+ * Run the destructor and give the memory back.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Drop all the ready objects of one cache.
+ */
+static
+void
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *obj;
+
+	while (1) {
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_nfree == 0) {
+			spinlock_release(&kc->kc_lock);
+			break;
+		}
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_destructed++;
+		spinlock_release(&kc->kc_lock);
+
+		kmem_cache_release(kc, obj);
+	}
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	KASSERT(kc->kc_inuse == 0);
+
+	kmem_cache_drain(kc);
+
+	spinlock_acquire(&allcaches_lock);
+	for (p = &allcaches; *p != NULL; p = &(*p)->kc_next) {
+		if (*p == kc) {
+			*p = kc->kc_next;
+			break;
+		}
+	}
+	spinlock_release(&allcaches_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree((char *)kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	if (!kc->kc_registered) {
+		kmem_cache_register(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		kc->kc_inuse++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Nothing ready: make a new one. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_constructed++;
+	kc->kc_inuse++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_destructed++;
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_release(kc, obj);
+}
+
+/*
+ * Give back to kmalloc all the ready objects. Called when the kernel
+ * runs out of pages; the caches refill as they are used again.
+ *
+ * Caches are never unlinked except by kmem_cache_destroy, which must
+ * not race with users of the cache, so walking the list without the
+ * list lock while draining is safe.
+ */
+void
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&allcaches_lock);
+	kc = allcaches;
+	spinlock_release(&allcaches_lock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		kmem_cache_drain(kc);
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&allcaches_lock);
+	kprintf("Object caches:\n");
+	kprintf("    %-12s %6s %8s %8s %6s %6s %6s %6s\n", "name", "size",
+		"allocs", "hits", "inuse", "free", "ctor", "dtor");
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("    %-12s %6lu %8u %8u %6u %6u %6u %6u\n",
+			kc->kc_name, (unsigned long) kc->kc_size,
+			kc->kc_allocs, kc->kc_hits, kc->kc_inuse,
+			kc->kc_nfree, kc->kc_constructed,
+			kc->kc_destructed);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+}
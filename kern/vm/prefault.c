@@ -0,0 +1,261 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+
+#include <addrspace.h>
+#include <segments.h>
+#include <pt.h>
+#include <vmc1.h>
+#include <prefault.h>
+
+/**
+ * Prefault policies.
+ *
+ * With plain demand paging every page of a program costs a TLB fault and a
+ * trip through vm_fault() the first time it is touched. as_complete_load()
+ * asks this module which pages should instead be brought in right away,
+ * according to the policy the address space was created with:
+ *  - text/all load whole segments, good for small programs run to completion
+ *  - learned replays the working set of the last run of the same executable:
+ *    as_destroy() records here which code/data pages were touched (resident
+ *    or swapped out) and the next exec of that vnode loads just those pages
+ *
+ * The history is a small table of PREFAULT_HISTORY executables, replaced
+ * round robin; each entry holds a reference to its vnode so that the pointer
+ * cannot be reused by another file while the entry is alive.
+*/
+
+struct prefault_history {
+    struct vnode *vn;
+    vaddr_t *pages;
+    unsigned npages;
+};
+
+static const char *policy_names[PREFAULT_NPOLICIES] = {
+    "demand", "text", "all", "learned"
+};
+
+static struct prefault_history history[PREFAULT_HISTORY];
+static unsigned history_next = 0;
+static struct lock *history_lock = NULL;
+
+static int prefault_policy = PREFAULT_DEMAND;
+
+void prefault_bootstrap(void) {
+    unsigned i;
+
+    for (i = 0; i < PREFAULT_HISTORY; i++) {
+        history[i].vn = NULL;
+        history[i].pages = NULL;
+        history[i].npages = 0;
+    }
+    history_next = 0;
+
+    history_lock = lock_create("prefault");
+    if (history_lock == NULL) {
+        panic("prefault: cannot create the history lock\n");
+    }
+}
+
+static void history_clear(struct prefault_history *h) {
+    if (h->vn != NULL) {
+        VOP_DECREF(h->vn);
+        h->vn = NULL;
+    }
+    if (h->pages != NULL) {
+        kfree(h->pages);
+        h->pages = NULL;
+    }
+    h->npages = 0;
+}
+
+void prefault_shutdown(void) {
+    unsigned i;
+
+    if (history_lock == NULL) {
+        return;
+    }
+    lock_acquire(history_lock);
+    for (i = 0; i < PREFAULT_HISTORY; i++) {
+        history_clear(&history[i]);
+    }
+    lock_release(history_lock);
+}
+
+int prefault_get_policy(void) {
+    return prefault_policy;
+}
+
+int prefault_set_policy(int policy) {
+    if (policy < 0 || policy >= PREFAULT_NPOLICIES) {
+        return EINVAL;
+    }
+    prefault_policy = policy;
+    return 0;
+}
+
+const char *prefault_policy_name(int policy) {
+    KASSERT(policy >= 0 && policy < PREFAULT_NPOLICIES);
+    return policy_names[policy];
+}
+
+int prefault_policy_by_name(const char *name) {
+    int i;
+
+    for (i = 0; i < PREFAULT_NPOLICIES; i++) {
+        if (!strcmp(name, policy_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Must be called holding history_lock
+*/
+static struct prefault_history *history_find(struct vnode *vn) {
+    unsigned i;
+
+    KASSERT(lock_do_i_hold(history_lock));
+
+    for (i = 0; i < PREFAULT_HISTORY; i++) {
+        if (history[i].vn == vn) {
+            return &history[i];
+        }
+    }
+    return NULL;
+}
+
+static int prefault_segment(struct addrspace *as, struct segment *seg) {
+    vaddr_t va, top;
+    int result;
+
+    if (seg->p_memsz == 0) {
+        return 0;
+    }
+
+    top = seg->p_vaddr + seg->p_memsz;
+    for (va = seg->p_vaddr & PAGE_FRAME; va < top; va += PAGE_SIZE) {
+        result = vm_prefault(as, va);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+static int prefault_learned(struct addrspace *as) {
+    struct prefault_history *h;
+    vaddr_t *pages = NULL;
+    unsigned npages = 0, i;
+    int result;
+
+    // copy the list out, the pages are loaded without holding the lock
+    lock_acquire(history_lock);
+    h = history_find(as->code->vnode);
+    if (h != NULL && h->npages > 0) {
+        pages = kmalloc(h->npages * sizeof(vaddr_t));
+        if (pages != NULL) {
+            memcpy(pages, h->pages, h->npages * sizeof(vaddr_t));
+            npages = h->npages;
+        }
+    }
+    lock_release(history_lock);
+
+    result = 0;
+    for (i = 0; i < npages; i++) {
+        result = vm_prefault(as, pages[i]);
+        if (result) {
+            break;
+        }
+    }
+
+    if (pages != NULL) {
+        kfree(pages);
+    }
+    return result;
+}
+
+int prefault_load(struct addrspace *as) {
+    int result;
+
+    KASSERT(as != NULL);
+
+    switch (as->prefault) {
+        case PREFAULT_DEMAND:
+            return 0;
+        case PREFAULT_EAGER_TEXT:
+            return prefault_segment(as, as->code);
+        case PREFAULT_EAGER_ALL:
+            result = prefault_segment(as, as->code);
+            if (result) {
+                return result;
+            }
+            return prefault_segment(as, as->data);
+        case PREFAULT_LEARNED:
+            return prefault_learned(as);
+    }
+    panic("prefault: unknown policy %d\n", as->prefault);
+    return EINVAL;
+}
+
+/**
+ * Appends to PAGES the pages of SEG touched by the process, at most PREFAULT_MAX_PAGES
+*/
+static void prefault_collect(struct addrspace *as, struct segment *seg,
+    vaddr_t *pages, unsigned *npages)
+{
+    vaddr_t va, top;
+
+    if (seg->p_memsz == 0) {
+        return;
+    }
+
+    top = seg->p_vaddr + seg->p_memsz;
+    for (va = seg->p_vaddr & PAGE_FRAME; va < top && *npages < PREFAULT_MAX_PAGES; va += PAGE_SIZE) {
+        if (pt_get_pa(as->pt, va) != PFN_NOT_USED || pt_get_offset(as->pt, va) >= 0) {
+            pages[(*npages)++] = va;
+        }
+    }
+}
+
+void prefault_record(struct addrspace *as) {
+    struct prefault_history *h;
+    struct vnode *vn;
+    vaddr_t *pages;
+    unsigned npages = 0;
+
+    KASSERT(as != NULL);
+
+    vn = as->code->vnode;
+    if (vn == NULL || history_lock == NULL) {
+        return;
+    }
+
+    pages = kmalloc(PREFAULT_MAX_PAGES * sizeof(vaddr_t));
+    if (pages == NULL) {
+        // just keep the previous history
+        return;
+    }
+    prefault_collect(as, as->code, pages, &npages);
+    prefault_collect(as, as->data, pages, &npages);
+
+    lock_acquire(history_lock);
+    h = history_find(vn);
+    if (h == NULL) {
+        h = &history[history_next];
+        history_next = (history_next + 1) % PREFAULT_HISTORY;
+        history_clear(h);
+        VOP_INCREF(vn);
+        h->vn = vn;
+    }
+    else if (h->pages != NULL) {
+        kfree(h->pages);
+    }
+    h->pages = pages;
+    h->npages = npages;
+    lock_release(history_lock);
+}
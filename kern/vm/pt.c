@@ -12,6 +12,10 @@
 #include <pt.h>
 #include <vmc1.h>
 #include <coremap.h>
+#include <swapfile.h>
+#include <kmem_cache.h>
+#include <vmalloc.h>
+#include "opt-ptswap.h"
 
 /**
  * TLB structure is define into:
@@ -20,7 +24,33 @@
  * Right away tlb is defined as a global handler to the structure.
  * It has 64 entries to be deactivated at each context switch [as_activate()]
  * 
+ * Each inner table keeps how many of its entries are valid (count) and how
+ * many have a frame (resident): a table is freed as soon as its last entry
+ * is cleared by pt_clear() instead of waiting for pt_destroy(), and with OPT_PTSWAP a table
+ * whose pages are all swapped out is itself written to swap under memory
+ * pressure, giving back its PT_INNER_NPAGES `fixed` frames.
 */
+/**
+ * Inner tables come from an object cache whose free tables have all entries
+ * invalid already, so defining a new inner table does not clear 1024 entries:
+ * a table must be given back with all its entries invalid.
+*/
+static int pt_inner_ctor(void *obj) {
+    struct pt_inner_entry *pages = obj;
+    unsigned int i;
+
+    for(i = 0; i < SIZE_PT_INNER; i++) {
+        pages[i].valid = 0;
+        pages[i].pfn = PFN_NOT_USED;
+        pages[i].swap_offset = -1;
+    }
+    return 0;
+}
+
+static struct kmem_cache pt_inner_cache =
+    KMEM_CACHE_INITIALIZER("pt_inner", sizeof(struct pt_inner_entry)*SIZE_PT_INNER,
+        pt_inner_ctor, NULL);
+
 static int get_p1(vaddr_t va) {
     return (va & P1_MASK) >> 22;
 }
@@ -49,24 +79,148 @@ struct pt_directory* pt_create(void) {
     for(i = 0; i < pt->size; i++) {
         pt->pages[i].pages = NULL;
         pt->pages[i].valid = 0;
+        pt->pages[i].count = 0;
+        pt->pages[i].resident = 0;
+#if OPT_PTSWAP
+        pt->pages[i].swapped = NULL;
+#endif
     }
 
     return pt;
 }
 
+#if OPT_PTSWAP
+/**
+ * Brings back into memory an inner table written to swap by pt_swap_out_inner(),
+ * ENOMEM if there are no frames for it (the table stays in swap)
+*/
+static int pt_swap_in_inner(struct pt_outer_entry *pt_inner) {
+    unsigned int i;
+    vaddr_t kva;
+    int result;
+
+    KASSERT(pt_inner->valid);
+    KASSERT(pt_inner->swapped != NULL);
+    KASSERT(pt_inner->pages == NULL);
+
+    pt_inner->pages = kmem_cache_alloc(&pt_inner_cache);
+    if(pt_inner->pages == NULL)
+        return ENOMEM;
+    kva = (vaddr_t) pt_inner->pages;
+    KASSERT((kva & ~PAGE_FRAME) == 0);
+
+    for(i = 0; i < PT_INNER_NPAGES; i++) {
+        result = swap_in(kvaddr_to_paddr(kva + i * PAGE_SIZE), pt_inner->swapped[i]);
+        KASSERT(result == 0);
+    }
 
-void pt_destroy_inner(struct pt_outer_entry pt_inner) {
+    kfree(pt_inner->swapped);
+    pt_inner->swapped = NULL;
+    return 0;
+}
 
-    unsigned int i;    
-    KASSERT(pt_inner.pages != NULL);
-    KASSERT(pt_inner.size != 0);
-    KASSERT(pt_inner.valid != 0);
+int pt_swap_out_inner(struct pt_directory* pt) {
+    unsigned int i, j;
+    struct pt_outer_entry *pt_inner;
+    vaddr_t kva;
+    int *offsets;
+
+    KASSERT(pt != NULL);
+
+    for(i = 0; i < pt->size; i++) {
+        pt_inner = &pt->pages[i];
+        if(!pt_inner->valid || pt_inner->swapped != NULL || pt_inner->resident != 0)
+            continue;
+
+        offsets = kmalloc(sizeof(int) * PT_INNER_NPAGES);
+        if(offsets == NULL)
+            return 0;
+
+        kva = (vaddr_t) pt_inner->pages;
+        KASSERT((kva & ~PAGE_FRAME) == 0);
+        for(j = 0; j < PT_INNER_NPAGES; j++) {
+            offsets[j] = swap_out(kvaddr_to_paddr(kva + j * PAGE_SIZE), kva + j * PAGE_SIZE);
+        }
+
+        // its content lives in swap now, back to the cache as an empty table;
+        // the point is to get frames back, so the caches must let it go
+        pt_inner_ctor(pt_inner->pages);
+        kmem_cache_free(&pt_inner_cache, pt_inner->pages);
+        kmem_cache_reap();
+        pt_inner->pages = NULL;
+        pt_inner->swapped = offsets;
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Returns the inner table indexed by p1, NULL if there is none.
+ * A swapped out table is brought back first, NULL if that is not possible:
+ * whoever needs the table for sure loads it with pt_load_inner() beforehand.
+*/
+static struct pt_inner_entry* pt_get_inner(struct pt_directory* pt, unsigned int p1) {
+    KASSERT(p1 < SIZE_PT_OUTER);
+
+    if(!pt->pages[p1].valid)
+        return NULL;
+#if OPT_PTSWAP
+    if(pt->pages[p1].swapped != NULL && pt_swap_in_inner(&pt->pages[p1]))
+        return NULL;
+#endif
+    return pt->pages[p1].pages;
+}
+
+int pt_load_inner(struct pt_directory* pt, vaddr_t va) {
+    unsigned int p1;
+
+    p1 = get_p1(va);
+    KASSERT(p1 < SIZE_PT_OUTER);
+
+    if(!pt->pages[p1].valid)
+        return pt_define_inner(pt, va);
+#if OPT_PTSWAP
+    if(pt->pages[p1].swapped != NULL)
+        return pt_swap_in_inner(&pt->pages[p1]);
+#endif
+    return 0;
+}
 
-    for(i = 0; i < pt_inner.size; i++) {
-        if(pt_inner.pages[i].valid && pt_inner.pages[i].swap_offset != 1) 
-            page_free(pt_inner.pages[i].pfn);
+void pt_destroy_inner(struct pt_outer_entry *pt_inner) {
+
+    unsigned int i;    
+    KASSERT(pt_inner->size != 0);
+    KASSERT(pt_inner->valid != 0);
+
+#if OPT_PTSWAP
+    // the swap slots of its entries are written into the table itself,
+    // pt_destroy() leaves these tables last so that frames are available
+    if(pt_inner->swapped != NULL) {
+        int result = pt_swap_in_inner(pt_inner);
+        KASSERT(result == 0);
     }
-    kfree(pt_inner.pages);
+#endif
+    KASSERT(pt_inner->pages != NULL);
+
+    for(i = 0; i < pt_inner->size; i++) {
+        if(!pt_inner->pages[i].valid)
+            continue;
+        // swap areas outlive the process, so its swapped out pages must be released
+        if(pt_inner->pages[i].swap_offset >= 0)
+            swap_free(pt_inner->pages[i].swap_offset);
+        else if(pt_inner->pages[i].pfn != PFN_NOT_USED)
+            page_free(pt_inner->pages[i].pfn);
+        pt_inner->pages[i].valid = 0;
+        pt_inner->pages[i].pfn = PFN_NOT_USED;
+        pt_inner->pages[i].swap_offset = -1;
+    }
+    kmem_cache_free(&pt_inner_cache, pt_inner->pages);
+    pt_inner->pages = NULL;
+    pt_inner->valid = 0;
+    pt_inner->count = 0;
+    pt_inner->resident = 0;
 }
 
 void pt_destroy(struct pt_directory* pt) {
@@ -74,32 +228,42 @@ void pt_destroy(struct pt_directory* pt) {
 
     KASSERT(pt != NULL);
     for(i = 0; i < pt->size; i++) {
-        if(pt->pages[i].pages != NULL && pt->pages[i].valid) 
-            pt_destroy_inner(pt->pages[i]); 
+#if OPT_PTSWAP
+        // reading these back needs frames, give the others back first
+        if(pt->pages[i].swapped != NULL)
+            continue;
+#endif
+        if(pt->pages[i].valid) 
+            pt_destroy_inner(&pt->pages[i]); 
         
     }
+#if OPT_PTSWAP
+    for(i = 0; i < pt->size; i++) {
+        if(pt->pages[i].valid)
+            pt_destroy_inner(&pt->pages[i]);
+    }
+#endif
     kfree(pt->pages);
     kfree(pt);
 
 }
 
-void pt_define_inner(struct pt_directory* pt, vaddr_t va) {
-    unsigned int index, i;
+int pt_define_inner(struct pt_directory* pt, vaddr_t va) {
+    unsigned int index;
 
     index = get_p1(va);
 
     KASSERT(pt->pages[index].valid == 0);
 
+    // entries are already invalid, see pt_inner_ctor()
+    pt->pages[index].pages = kmem_cache_alloc(&pt_inner_cache);
+    if(pt->pages[index].pages == NULL)
+        return ENOMEM;
     pt->pages[index].size = SIZE_PT_INNER;
-    pt->pages[index].pages = kmalloc(sizeof(struct pt_inner_entry)*SIZE_PT_INNER);
-    KASSERT(pt->pages[index].pages != NULL);
     pt->pages[index].valid = 1;
-    
-    for(i = 0; i < pt->pages[index].size; i++) {
-        pt->pages[index].pages[i].valid = 0;
-        pt->pages[index].pages[i].pfn = PFN_NOT_USED;
-        pt->pages[index].pages[i].swap_offset = -1;
-    }
+    pt->pages[index].count = 0;
+    pt->pages[index].resident = 0;
+    return 0;
 }
 
 /**
@@ -114,6 +278,7 @@ void pt_define_inner(struct pt_directory* pt, vaddr_t va) {
 */
 int pt_get_pa(struct pt_directory* pt, vaddr_t va) {
     unsigned int p1, p2, d;
+    struct pt_inner_entry *inner;
 
     paddr_t pa;
 
@@ -125,9 +290,10 @@ int pt_get_pa(struct pt_directory* pt, vaddr_t va) {
 
     d = get_d(va);
     KASSERT(d < PAGE_SIZE);
-    if(pt->pages[p1].valid) {
-        if(pt->pages[p1].pages[p2].valid) {
-            pa = pt->pages[p1].pages[p2].pfn;
+    inner = pt_get_inner(pt, p1);
+    if(inner != NULL) {
+        if(inner[p2].valid) {
+            pa = inner[p2].pfn;
         }
         else {
             return PFN_NOT_USED;
@@ -146,6 +312,7 @@ int pt_get_pa(struct pt_directory* pt, vaddr_t va) {
 
 off_t pt_get_offset(struct pt_directory* pt, vaddr_t va) {
     unsigned int p1, p2, d;
+    struct pt_inner_entry *inner;
 
     off_t flag;
 
@@ -158,9 +325,10 @@ off_t pt_get_offset(struct pt_directory* pt, vaddr_t va) {
     d = get_d(va);
     KASSERT(d < PAGE_SIZE);
 
-    if(pt->pages[p1].valid) {
-        if(pt->pages[p1].pages[p2].valid) {
-            flag = pt->pages[p1].pages[p2].swap_offset;
+    inner = pt_get_inner(pt, p1);
+    if(inner != NULL) {
+        if(inner[p2].valid) {
+            flag = inner[p2].swap_offset;
         }
         else {
             return -1;
@@ -175,6 +343,7 @@ off_t pt_get_offset(struct pt_directory* pt, vaddr_t va) {
 
 void pt_set_offset(struct pt_directory* pt, vaddr_t va, off_t offset) {
     volatile unsigned int p1, p2, d;
+    struct pt_inner_entry *inner;
 
     p1 = get_p1(va);
     KASSERT(p1 < SIZE_PT_OUTER);
@@ -185,14 +354,13 @@ void pt_set_offset(struct pt_directory* pt, vaddr_t va, off_t offset) {
     d = get_d(va);
     KASSERT(d < PAGE_SIZE);
 
-    if(!pt->pages[p1].valid) {
-        pt_define_inner(pt, va);
-    }
-
-    // should be valid even after creation
-    KASSERT(pt->pages[p1].valid == 1);
-    pt->pages[p1].pages[p2].valid = 1;
-    pt->pages[p1].pages[p2].swap_offset = offset;
+    // the caller has loaded the table with pt_load_inner()
+    inner = pt_get_inner(pt, p1);
+    KASSERT(inner != NULL);
+    if(!inner[p2].valid)
+        pt->pages[p1].count++;
+    inner[p2].valid = 1;
+    inner[p2].swap_offset = offset;
 
     // if offset is greater than 0 it means that the page has been swapped out
     // pt->pages[p1].pages[p2].pfn = pa;
@@ -207,11 +375,12 @@ void pt_set_offset(struct pt_directory* pt, vaddr_t va, off_t offset) {
 /**
  * This function is going to set a physical address (PFN) into 
  * the pagetable using the given virtual address as the one above
- * defining p1 and p2. If the system wants an entry of a still 
- * `undefined` inner pagetable, it is managed by initializing it  
+ * defining p1 and p2. The inner pagetable must be in memory, see
+ * pt_load_inner()
 */
 void pt_set_pa(struct pt_directory* pt, vaddr_t va, paddr_t pa) {
     unsigned int p1, p2, d;
+    struct pt_inner_entry *inner;
 
     p1 = get_p1(va);
     KASSERT(p1 < SIZE_PT_OUTER);
@@ -222,13 +391,47 @@ void pt_set_pa(struct pt_directory* pt, vaddr_t va, paddr_t pa) {
     d = get_d(va);
     KASSERT(d < PAGE_SIZE);
 
-    if(!pt->pages[p1].valid) {
-        pt_define_inner(pt, va);
-    }
-
-    // should be valid even after creation
-    KASSERT(pt->pages[p1].valid == 1);
-    pt->pages[p1].pages[p2].valid = 1;
-    pt->pages[p1].pages[p2].pfn = pa;
+    // the caller has loaded the table with pt_load_inner()
+    inner = pt_get_inner(pt, p1);
+    KASSERT(inner != NULL);
+    if(!inner[p2].valid)
+        pt->pages[p1].count++;
+    if(inner[p2].pfn == PFN_NOT_USED && pa != PFN_NOT_USED)
+        pt->pages[p1].resident++;
+    else if(inner[p2].pfn != PFN_NOT_USED && pa == PFN_NOT_USED)
+        pt->pages[p1].resident--;
+    inner[p2].valid = 1;
+    inner[p2].pfn = pa;
     
-}
\ No newline at end of file
+}
+
+void pt_clear(struct pt_directory* pt, vaddr_t va) {
+    unsigned int p1, p2;
+    struct pt_inner_entry *inner;
+
+    p1 = get_p1(va);
+    p2 = get_p2(va);
+    KASSERT(p1 < SIZE_PT_OUTER);
+    KASSERT(p2 < SIZE_PT_INNER);
+
+    inner = pt_get_inner(pt, p1);
+    if(inner == NULL || !inner[p2].valid)
+        return;
+
+    if(inner[p2].pfn != PFN_NOT_USED)
+        pt->pages[p1].resident--;
+    inner[p2].valid = 0;
+    inner[p2].pfn = PFN_NOT_USED;
+    inner[p2].swap_offset = -1;
+
+    KASSERT(pt->pages[p1].count > 0);
+    pt->pages[p1].count--;
+    // no reason to keep 16KB of `fixed` kernel memory for an empty table
+    if(pt->pages[p1].count == 0) {
+        KASSERT(pt->pages[p1].resident == 0);
+        // every entry is invalid again, as the cache wants it
+        kmem_cache_free(&pt_inner_cache, pt->pages[p1].pages);
+        pt->pages[p1].pages = NULL;
+        pt->pages[p1].valid = 0;
+    }
+}
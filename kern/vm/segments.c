@@ -16,6 +16,7 @@
 #include <vnode.h>
 #include <uio.h>
 #include <statistics.h>
+#include <kmem_cache.h>
 
 /**
  * Module for segment mgmt, a segment is defined as a section of an address space which is going to be loaded
@@ -36,10 +37,14 @@ void zero(paddr_t paddr, size_t n)
 /**
  * Create a new empty segment struct and set to zero every field (TOBE checked)
 */
+// three segments for each address space, created and destroyed at every fork/exec/exit
+static struct kmem_cache seg_cache =
+    KMEM_CACHE_INITIALIZER("segment", sizeof(struct segment), NULL, NULL);
+
 struct segment* seg_create(void) {
     struct segment* seg;
 
-    seg = kmalloc(sizeof(struct segment));
+    seg = kmem_cache_alloc(&seg_cache);
     KASSERT(seg != NULL);
 
     seg->p_type = 0;
@@ -84,7 +89,7 @@ int seg_define(struct segment* seg, uint32_t p_type, uint32_t p_offset, uint32_t
 void seg_destroy(struct segment* seg) {
 
     KASSERT(seg != NULL);
-    kfree(seg);
+    kmem_cache_free(&seg_cache, seg);
 }
 
 /**
@@ -18,6 +18,8 @@ static const char *statistics_names[] = {
     "Page Faults from ELF",
     "Page Faults from Swapfile",
     "Swapfile Writes",
+    "Page Faults (Shared)",
+    "Pages Prefaulted",
 };
 
 static unsigned int is_active = 0;
@@ -47,16 +49,28 @@ void increment_statistics(unsigned int stat) {
     spinlock_release(&statistics_spinlock);
 }
 
+unsigned int get_statistics(unsigned int stat) {
+    unsigned int value;
+
+    KASSERT(stat < N_STATS);
+    spinlock_acquire(&statistics_spinlock);
+    value = counters[stat];
+    spinlock_release(&statistics_spinlock);
+
+    return value;
+}
+
 void print_all_statistics(void) {
     int i = 0;
     // TLB Faults with Free and TLB Faults with Replace
     int fr = 0;
-    // TLB Reloads and Page Faults (Disk) and Page Faults (Zeroed)”
+    // TLB Reloads and Page Faults (Disk) and Page Faults (Zeroed) and Page Faults (Shared)
     int tlbr_pfd_pfz = 0;
     // Page Faults from ELF and Page Faults from Swapfile
     int pfelf_pfswp = 0;
 
     int tlb_faults = 0;
+    int tlb_faults_prefault = 0;
     int pf_disk = 0;
 
     if (is_active == 0)
@@ -68,10 +82,13 @@ void print_all_statistics(void) {
     }
 
     tlb_faults = counters[STATISTICS_TLB_FAULT];
+    // a prefaulted page is loaded without a TLB fault, its first access is then a reload
+    tlb_faults_prefault = tlb_faults + counters[STATISTICS_PREFAULT];
     pf_disk = counters[STATISTICS_PAGE_FAULT_DISK];
 
     fr = counters[STATISTICS_TLB_FAULT_FREE] + counters[STATISTICS_TLB_FAULT_REPLACE];
-    tlbr_pfd_pfz = counters[STATISTICS_TLB_RELOAD] + counters[STATISTICS_PAGE_FAULT_DISK] + counters[STATISTICS_PAGE_FAULT_ZERO];
+    tlbr_pfd_pfz = counters[STATISTICS_TLB_RELOAD] + counters[STATISTICS_PAGE_FAULT_DISK] + counters[STATISTICS_PAGE_FAULT_ZERO]
+        + counters[STATISTICS_PAGE_FAULT_SHARED];
     pfelf_pfswp = counters[STATISTICS_ELF_FILE_READ] + counters[STATISTICS_SWAP_FILE_READ];
     
     /* consistency assertions */
@@ -82,9 +99,9 @@ void print_all_statistics(void) {
     }
 
     //kprintf("STATISTICS TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) = %d\n", tlbr_pfd_pfz);
-    if (tlb_faults != tlbr_pfd_pfz)
+    if (tlb_faults_prefault != tlbr_pfd_pfz)
     {
-        kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n", tlb_faults, tlbr_pfd_pfz);
+        kprintf("WARNING: TLB Faults + Pages Prefaulted (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Shared) (%d)\n", tlb_faults_prefault, tlbr_pfd_pfz);
     }
 
     //kprintf("STATISTICS ELF File reads + Swapfile reads = %d\n", pfelf_pfswp);
@@ -0,0 +1,210 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <device.h>
+#include <vm.h>
+
+#include <swapfile.h>
+#include <swap_backend.h>
+
+/**
+ * Backing stores for the swap system, see swap_backend.h.
+ *
+ * The file backend is the original behavior: the swap area is a regular file
+ * on emufs, so each page is marshalled by the VFS and by the emu device buffer.
+ *
+ * The raw backend takes a whole disk (e.g. lhd1:, the one not holding a
+ * filesystem) through vfs_swapon() and talks to the driver directly with
+ * DEVOP_IO: a page is a single uio of PAGE_SIZE bytes at a page aligned
+ * offset, that the lhd driver splits in LHD_SECTSIZE transfers.
+*/
+
+/* ====================== file backend ====================== */
+
+static int swapbe_file_open(struct swap_backend *sb, const char *path) {
+    char *name;
+    int result;
+
+    // vfs_open is allowed to mangle its path argument
+    name = kstrdup(path);
+    if (name == NULL) {
+        return ENOMEM;
+    }
+
+    //if does not exist it will be created
+    result = vfs_open(name, O_RDWR | O_CREAT, 0, &sb->sb_vnode);
+    kfree(name);
+    if (result) {
+        return result;
+    }
+
+    sb->sb_size = FILE_SIZE;
+    return 0;
+}
+
+static int swapbe_file_io(struct swap_backend *sb, paddr_t pa, off_t offset, enum uio_rw rw) {
+    struct iovec iov;
+    struct uio u;
+    int result;
+
+    uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(pa), PAGE_SIZE, offset, rw);
+    if (rw == UIO_WRITE) {
+        result = VOP_WRITE(sb->sb_vnode, &u);
+    }
+    else {
+        result = VOP_READ(sb->sb_vnode, &u);
+    }
+    if (result) {
+        return result;
+    }
+
+    return u.uio_resid == 0 ? 0 : EIO;
+}
+
+static void swapbe_file_close(struct swap_backend *sb) {
+    vfs_close(sb->sb_vnode);
+}
+
+static const struct swap_backend_ops swapbe_file_ops = {
+    .sbo_open = swapbe_file_open,
+    .sbo_io = swapbe_file_io,
+    .sbo_close = swapbe_file_close,
+};
+
+/* ====================== raw backend ====================== */
+
+static int swapbe_raw_open(struct swap_backend *sb, const char *path) {
+    struct device *dev;
+    int result;
+
+    result = vfs_swapon(path, &sb->sb_vnode);
+    if (result) {
+        return result;
+    }
+
+    // raw device vnodes carry their struct device as vnode data (see dev_create_vnode)
+    dev = sb->sb_vnode->vn_data;
+    KASSERT(dev != NULL);
+
+    if (dev->d_blocksize == 0 || PAGE_SIZE % dev->d_blocksize != 0) {
+        kprintf("swap: %s block size %u does not divide a page\n",
+            path, (unsigned) dev->d_blocksize);
+        vfs_close(sb->sb_vnode);
+        vfs_swapoff(sb->sb_path);
+        return EINVAL;
+    }
+
+    sb->sb_device = dev;
+    sb->sb_size = ((off_t) dev->d_blocks * dev->d_blocksize) & ~(off_t)(PAGE_SIZE - 1);
+    return 0;
+}
+
+static int swapbe_raw_io(struct swap_backend *sb, paddr_t pa, off_t offset, enum uio_rw rw) {
+    struct iovec iov;
+    struct uio u;
+    int result;
+
+    KASSERT(sb->sb_device != NULL);
+    KASSERT((offset & (PAGE_SIZE - 1)) == 0);
+    KASSERT(offset + PAGE_SIZE <= sb->sb_size);
+
+    // one request for the whole page, no VFS and no emu buffer in between
+    uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(pa), PAGE_SIZE, offset, rw);
+    result = DEVOP_IO(sb->sb_device, &u);
+    if (result) {
+        return result;
+    }
+
+    return u.uio_resid == 0 ? 0 : EIO;
+}
+
+static void swapbe_raw_close(struct swap_backend *sb) {
+    vfs_close(sb->sb_vnode);
+    vfs_swapoff(sb->sb_path);
+    sb->sb_device = NULL;
+}
+
+static const struct swap_backend_ops swapbe_raw_ops = {
+    .sbo_open = swapbe_raw_open,
+    .sbo_io = swapbe_raw_io,
+    .sbo_close = swapbe_raw_close,
+};
+
+/* ====================== common ====================== */
+
+struct swap_backend *swap_backend_create(const char *kind) {
+    struct swap_backend *sb;
+    const struct swap_backend_ops *ops;
+
+    if (!strcmp(kind, "file")) {
+        ops = &swapbe_file_ops;
+    }
+    else if (!strcmp(kind, "raw")) {
+        ops = &swapbe_raw_ops;
+    }
+    else {
+        return NULL;
+    }
+
+    sb = kmalloc(sizeof(struct swap_backend));
+    if (sb == NULL) {
+        return NULL;
+    }
+
+    sb->sb_name = ops == &swapbe_file_ops ? "file" : "raw";
+    sb->sb_ops = ops;
+    sb->sb_vnode = NULL;
+    sb->sb_device = NULL;
+    sb->sb_path = NULL;
+    sb->sb_size = 0;
+
+    return sb;
+}
+
+/**
+ * Attach the backend to PATH. A trailing colon on raw device names
+ * is dropped so that both "lhd1" and "lhd1:" can be given.
+*/
+int swap_backend_open(struct swap_backend *sb, const char *path) {
+    size_t len;
+    int result;
+
+    KASSERT(sb != NULL);
+    KASSERT(sb->sb_vnode == NULL);
+
+    sb->sb_path = kstrdup(path);
+    if (sb->sb_path == NULL) {
+        return ENOMEM;
+    }
+    len = strlen(sb->sb_path);
+    if (sb->sb_ops == &swapbe_raw_ops && len > 0 && sb->sb_path[len - 1] == ':') {
+        sb->sb_path[len - 1] = 0;
+    }
+
+    result = SWAPBE_OPEN(sb, sb->sb_path);
+    if (result) {
+        sb->sb_vnode = NULL;
+        kfree(sb->sb_path);
+        sb->sb_path = NULL;
+        return result;
+    }
+
+    return 0;
+}
+
+void swap_backend_destroy(struct swap_backend *sb) {
+    KASSERT(sb != NULL);
+
+    if (sb->sb_vnode != NULL) {
+        SWAPBE_CLOSE(sb);
+        sb->sb_vnode = NULL;
+    }
+    if (sb->sb_path != NULL) {
+        kfree(sb->sb_path);
+    }
+    kfree(sb);
+}
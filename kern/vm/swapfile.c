@@ -1,175 +1,382 @@
 #include <types.h>
-#include <kern/fcntl.h>
-#include <vnode.h>
-#include <vfs.h>
-#include <uio.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
 #include <vm.h>
 #include <bitmap.h>
 #include <swapfile.h>
+#include <swap_backend.h>
 #include <statistics.h>
 
+/**
+ * Swap space manager.
+ *
+ * Swap space is made of up to SWAP_MAX_AREAS swap areas, each one backed by a
+ * swap backend (a file or a raw disk, see swap_backend.h). Areas are opened
+ * once: the default one in vm_bootstrap(), the others at runtime with the
+ * `swapon` menu command, so neither process creation pays a VFS open nor the
+ * swapped-out pages of a process are lost when another process is created.
+ *
+ * New pages go to the active area with the highest priority that has room.
+ *
+ * The offset handed back by swap_out() (and kept into the page table) encodes
+ * both the area and the page slot inside it:
+ *      offset = (area * SWAP_AREA_MAXPAGES + slot) * PAGE_SIZE
+*/
+
+struct swap_area {
+    struct swap_backend *sa_backend;
+    struct bitmap *sa_map;      /* 1: slot taken 0: free */
+    unsigned sa_npages;         /* usable slots */
+    unsigned sa_used;           /* taken slots, the area can be removed when 0 */
+    int sa_priority;
+    int sa_active;              /* 0 while being removed, no new pages */
+};
+
+//the index inside this table is the area number encoded into the offsets
+static struct swap_area *swap_areas[SWAP_MAX_AREAS];
+
+//protects swap_areas and the bookkeeping of each area, never held across I/O
+static struct spinlock filelock = SPINLOCK_INITIALIZER;
 
+static int timesOut = 0;
+static int timesIn = 0;
 
-//we created a list of entries
-static struct swap_page swap_list[NUM_PAGES];
+#define SWAP_OFFSET(area, slot) \
+    ((off_t)((area) * SWAP_AREA_MAXPAGES + (slot)) * PAGE_SIZE)
+#define SWAP_OFFSET_AREA(off)   ((unsigned)((off) / PAGE_SIZE) / SWAP_AREA_MAXPAGES)
+#define SWAP_OFFSET_SLOT(off)   ((unsigned)((off) / PAGE_SIZE) % SWAP_AREA_MAXPAGES)
+#define SWAP_AREA_OFFSET(off)   ((off_t)SWAP_OFFSET_SLOT(off) * PAGE_SIZE)
 
+static void swap_area_destroy(struct swap_area *sa) {
+    swap_backend_destroy(sa->sa_backend);
+    if (sa->sa_map != NULL) {
+        bitmap_destroy(sa->sa_map);
+    }
+    kfree(sa);
+}
 
+/**
+ * Looks for a free slot into the best area, the slot is marked as taken.
+ * Must be called holding filelock.
+*/
+static int swap_get_slot(unsigned *area, unsigned *slot) {
+    struct swap_area *sa;
+    int best = -1;
+    unsigned i;
+
+    KASSERT(spinlock_do_i_hold(&filelock));
+
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        sa = swap_areas[i];
+        if (sa == NULL || !sa->sa_active || sa->sa_used == sa->sa_npages) {
+            continue;
+        }
+        if (best < 0 || sa->sa_priority > swap_areas[best]->sa_priority) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return ENOSPC;
+    }
 
+    sa = swap_areas[best];
+    if (bitmap_alloc(sa->sa_map, slot)) {
+        return ENOSPC;
+    }
+    KASSERT(*slot < sa->sa_npages);
+    sa->sa_used++;
+    *area = best;
 
-//the swapfile should be accessed by one process at a time so we will need a spinlock
-static struct spinlock filelock = SPINLOCK_INITIALIZER;
+    return 0;
+}
 
-//initialize the swapfile
-//everything is set to 0 at the begining
+/**
+ * Releases the slot encoded into OFFSET.
+ * Must be called holding filelock.
+*/
+static void swap_put_slot(off_t offset) {
+    struct swap_area *sa;
+    unsigned area, slot;
 
+    KASSERT(spinlock_do_i_hold(&filelock));
 
+    area = SWAP_OFFSET_AREA(offset);
+    slot = SWAP_OFFSET_SLOT(offset);
+    KASSERT(area < SWAP_MAX_AREAS);
 
-static struct vnode *v = NULL; // The vnode for the swapfile
-static int timesOut = 0;
-static int timesIn = 0;
+    sa = swap_areas[area];
+    KASSERT(sa != NULL);
+    KASSERT(bitmap_isset(sa->sa_map, slot));
+
+    bitmap_unmark(sa->sa_map, slot);
+    sa->sa_used--;
+}
+
+/**
+ * Adds a swap area of the given kind ("file" or "raw") on PATH.
+ * Fails with EEXIST if PATH is already used for swapping and with ENOSPC
+ * if all SWAP_MAX_AREAS areas are in use.
+*/
+int swapfile_add(const char *kind, const char *path, int priority) {
+    struct swap_area *sa;
+    unsigned i;
+    int result;
+
+    sa = kmalloc(sizeof(struct swap_area));
+    if (sa == NULL) {
+        return ENOMEM;
+    }
+    sa->sa_map = NULL;
+    sa->sa_used = 0;
+    sa->sa_priority = priority;
+    sa->sa_active = 1;
+
+    sa->sa_backend = swap_backend_create(kind);
+    if (sa->sa_backend == NULL) {
+        kfree(sa);
+        return EINVAL;
+    }
+
+    result = swap_backend_open(sa->sa_backend, path);
+    if (result) {
+        swap_area_destroy(sa);
+        return result;
+    }
+
+    sa->sa_npages = sa->sa_backend->sb_size / PAGE_SIZE;
+    if (sa->sa_npages > SWAP_AREA_MAXPAGES) {
+        sa->sa_npages = SWAP_AREA_MAXPAGES;
+    }
+    if (sa->sa_npages == 0) {
+        swap_area_destroy(sa);
+        return ENOSPC;
+    }
 
+    sa->sa_map = bitmap_create(sa->sa_npages);
+    if (sa->sa_map == NULL) {
+        swap_area_destroy(sa);
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&filelock);
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i] != NULL &&
+            !strcmp(swap_areas[i]->sa_backend->sb_path, sa->sa_backend->sb_path)) {
+            spinlock_release(&filelock);
+            swap_area_destroy(sa);
+            return EEXIST;
+        }
+    }
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i] == NULL) {
+            swap_areas[i] = sa;
+            break;
+        }
+    }
+    spinlock_release(&filelock);
+
+    if (i == SWAP_MAX_AREAS) {
+        swap_area_destroy(sa);
+        return ENOSPC;
+    }
+
+    kprintf("swap: added %s area %u on %s, %u pages, priority %d\n",
+        kind, i, sa->sa_backend->sb_path, sa->sa_npages, priority);
+    return 0;
+}
+
+/**
+ * Removes the swap area attached to PATH. An area still holding pages is
+ * just disabled (no new pages go there) and EBUSY is returned: it can be
+ * removed once its pages have been swapped back in or their processes ended.
+*/
+int swapfile_remove(const char *path) {
+    struct swap_area *sa = NULL;
+    char *name;
+    size_t len;
+    unsigned i;
+
+    // raw areas are stored without the trailing colon
+    name = kstrdup(path);
+    if (name == NULL) {
+        return ENOMEM;
+    }
+    len = strlen(name);
+    if (len > 0 && name[len - 1] == ':') {
+        name[len - 1] = 0;
+    }
+
+    spinlock_acquire(&filelock);
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i] != NULL &&
+            !strcmp(swap_areas[i]->sa_backend->sb_path, name)) {
+            sa = swap_areas[i];
+            break;
+        }
+    }
+    kfree(name);
+    if (sa == NULL) {
+        spinlock_release(&filelock);
+        return ENOENT;
+    }
+
+    sa->sa_active = 0;
+    if (sa->sa_used > 0) {
+        spinlock_release(&filelock);
+        kprintf("swap: area %u still holds %u pages, disabled\n", i, sa->sa_used);
+        return EBUSY;
+    }
+    swap_areas[i] = NULL;
+    spinlock_release(&filelock);
+
+    kprintf("swap: removed area %u on %s\n", i, sa->sa_backend->sb_path);
+    swap_area_destroy(sa);
+    return 0;
+}
+
+/**
+ * Prints the swap areas and their usage
+*/
+void swapfile_print(void) {
+    struct swap_area *sa;
+    unsigned i;
+
+    spinlock_acquire(&filelock);
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        sa = swap_areas[i];
+        if (sa == NULL) {
+            continue;
+        }
+        kprintf("swap area %u: %-4s %-16s prio %3d  %5u/%5u pages%s\n",
+            i, sa->sa_backend->sb_name, sa->sa_backend->sb_path,
+            sa->sa_priority, sa->sa_used, sa->sa_npages,
+            sa->sa_active ? "" : "  (disabled)");
+    }
+    spinlock_release(&filelock);
+}
+
+/**
+ * Called once by vm_bootstrap(): the default swap area is the swap file
+ * on emufs. If it cannot be opened the system goes on without swap until
+ * an area is added by hand.
+*/
 void swapfile_init(void)
 {
     int result;
     int i;
-    for(i=0; i<NUM_PAGES; i++)
-    {
-        swap_list[i].ppadd = 0;
-        swap_list[i].pvadd = 0;
-        swap_list[i].swap_offset = 0;
-        swap_list[i].free = 1;
+
+    spinlock_setname(&filelock, "filelock");
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        swap_areas[i] = NULL;
     }
+
     //if does not exist it will be created
     //The swap file is where all the pages will be written
     //when at run time more than 9MB is needed => panic is called
-    result = vfs_open((char *)"emu0:/SWAPFILE", O_RDWR | O_CREAT, 0,  &v);
-    KASSERT(result == 0);
-    return;
-
-   
+    result = swapfile_add("file", SWAP_DEFAULT_FILE, 0);
+    if (result) {
+        kprintf("swap: cannot open %s: %s\n", SWAP_DEFAULT_FILE, strerror(result));
+    }
 }
 
 //first we need to perform the swap out
 //SWAP OUT: swap out of the Physical address the page and put it in the swap file
 int swap_out(paddr_t ppaddr, vaddr_t pvaddr){
 //given the physical address of the page to be swapped out
-//we return the offset where we save it in the swap file 
-    int free_index = -1;
-    
-    struct iovec iov;
-    struct uio u;
-    int i;
-    struct swap_page *entry;
+//we return the offset where we save it in the swap area
+    unsigned area, slot;
+    int result;
     off_t page_offset;
 
-
+    (void)pvaddr;
 
     spinlock_acquire(&filelock);
-    for(i=0; i< NUM_PAGES; i++)
-    {
-        entry = &swap_list[i];
-        if(entry->free)
-        {
-            free_index = i;
-            break;
-        }
-    }
+    result = swap_get_slot(&area, &slot);
     spinlock_release(&filelock);
 
-    if(free_index == -1)
+    if(result)
     {
         kprintf("Total SWAPOUT: %d -- Total SWAPIN: %d\n", timesOut, timesIn);
         panic("swapfile.c : Out of swap space \n");
         return -1;
     }
 
-    // kprintf("SWAPOUT %d at pa:O0x%x va:0x%x in position %d\n", timesOut, ppaddr, pvaddr, free_index);
     timesOut++;
-    page_offset = free_index * PAGE_SIZE;
-    KASSERT(page_offset < FILE_SIZE);
+    page_offset = SWAP_OFFSET(area, slot);
     KASSERT((ppaddr & PAGE_FRAME) == ppaddr);
 
-    uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(ppaddr), PAGE_SIZE, page_offset, UIO_WRITE);
-    VOP_WRITE(v, &u);
+    // the area cannot go away while one of its slots is taken
+    result = SWAPBE_IO(swap_areas[area]->sa_backend, ppaddr, SWAP_AREA_OFFSET(page_offset), UIO_WRITE);
 
-    if(u.uio_resid != 0)
+    if(result)
     {
         panic("swapfile.c: Cannot write to swap file");
         return -1;
     }
-    else{
-        spinlock_acquire(&filelock);
-        swap_list[free_index].free = 0;
-        swap_list[free_index].ppadd = ppaddr;
-        swap_list[free_index].pvadd = pvaddr;
-        swap_list[free_index].swap_offset = page_offset;
-        spinlock_release(&filelock);
-
-        increment_statistics(STATISTICS_SWAP_FILE_WRITE);
-        return swap_list[free_index].swap_offset;
-    }
-
-
 
+    increment_statistics(STATISTICS_SWAP_FILE_WRITE);
+    return page_offset;
 }
 
-//SWAP IN: Swapping from the swap file to the physical memory
-//we need to reset the page to free in the swapfile
-
-//the vadd given is the vadd of the 
-
+//SWAP IN: Swapping from the swap area to the physical memory
+//the slot is released only after the page has been read back
 int swap_in(paddr_t ppadd, off_t offset){
 
-    struct iovec iov;
-    struct uio u;
-    int page_index;
+    unsigned area;
     int result;
 
-    // kprintf("SWAPIN %d at pa:0x%x va:0x%x in position %lld\n", timesIn, ppadd, pvadd, offset/PAGE_SIZE);
     timesIn++;
 
     KASSERT(offset >= 0);
-    
-    page_index = offset/PAGE_SIZE;
-    spinlock_acquire(&filelock);
-    //fix the swap file descriptor
-    swap_list[page_index].ppadd =  0;
-    swap_list[page_index].pvadd  = 0;
-    swap_list[page_index].free  = 1;
-    swap_list[page_index].swap_offset = 0;
-    //now copy in its new ppadd
-    spinlock_release(&filelock);
 
-    uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(ppadd), PAGE_SIZE, offset, UIO_READ);
-    result = VOP_READ(v, &u);
-    KASSERT(result==0);
+    area = SWAP_OFFSET_AREA(offset);
+    KASSERT(area < SWAP_MAX_AREAS);
+    KASSERT(swap_areas[area] != NULL);
+
+    result = SWAPBE_IO(swap_areas[area]->sa_backend, ppadd, SWAP_AREA_OFFSET(offset), UIO_READ);
 
-    if(u.uio_resid != 0)
+    if(result)
     {
         kprintf("Total SWAPOUT: %d -- Total SWAPIN: %d\n", timesOut, timesIn);
         panic("swapfile.c: Cannot read from swap file");
         return -1;
     }
-    
+
+    spinlock_acquire(&filelock);
+    swap_put_slot(offset);
+    spinlock_release(&filelock);
+
     increment_statistics(STATISTICS_PAGE_FAULT_DISK);
-    // increment_statistics(STATISTICS_ELF_FILE_READ);
     increment_statistics(STATISTICS_SWAP_FILE_READ);
-    return swap_list[page_index].swap_offset;
-    
+    return 0;
 }
 
+/**
+ * Drops a swapped out page that is no longer needed (its address space is gone)
+*/
+void swap_free(off_t offset) {
+    KASSERT(offset >= 0);
+
+    spinlock_acquire(&filelock);
+    swap_put_slot(offset);
+    spinlock_release(&filelock);
+}
 
 void swap_shutdown(void)
 {
+    struct swap_area *sa;
     int i;
-    vfs_close(v);
 
-    for(i=0; i<NUM_PAGES; i++)
-    {
-        swap_list[i].ppadd = 0;
-        swap_list[i].pvadd = 0;
-        swap_list[i].swap_offset = 0;
-        swap_list[i].free = 1;
+    for (i = 0; i < SWAP_MAX_AREAS; i++) {
+        spinlock_acquire(&filelock);
+        sa = swap_areas[i];
+        swap_areas[i] = NULL;
+        spinlock_release(&filelock);
+
+        if (sa != NULL) {
+            swap_area_destroy(sa);
+        }
     }
 }
 
@@ -179,4 +386,4 @@ int getIn(void) {
 }
 int getOut(void) {
     return timesOut;
-}
\ No newline at end of file
+}
@@ -0,0 +1,262 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <elf.h>
+
+#include <pt.h>
+#include <segments.h>
+#include <coremap.h>
+#include <textcache.h>
+
+/**
+ * Shared text pages.
+ *
+ * The first process faulting on a page of a read-only segment loads it as
+ * usual with seg_load_page() and then publishes the frame here; the frame
+ * becomes `shared` into the coremap, so it is no longer owned by any address
+ * space and is never chosen as a victim. The following processes running the
+ * same executable find the frame here and just map it: no ELF read, no new frame.
+ *
+ * Each mapping holds a reference on the frame (coremap ref_count), dropped by
+ * textcache_unmap_segment() when the address space goes away; the entry is
+ * removed together with the last reference. Since the mapping processes keep
+ * the executable open, a cached vnode cannot be reclaimed while in the cache.
+ *
+ * Entries belong to a cached file carrying a generation, bumped by
+ * textcache_invalidate() whenever the file is written or truncated: entries
+ * of an older generation are not handed out anymore, they just live until
+ * their current mappers go away. Shared frames cannot be evicted, so at most
+ * 1/TEXTCACHE_RAM_SHARE of the RAM is shared, past that pages stay private.
+*/
+
+#define TEXTCACHE_BUCKETS 64
+#define TEXTCACHE_RAM_SHARE 4
+
+struct textcache_file {
+    struct vnode *vn;
+    unsigned int gen;
+    unsigned int nentries;
+    struct textcache_file *next;
+};
+
+struct textcache_entry {
+    struct textcache_file *file;
+    unsigned int gen;
+    vaddr_t va;
+    paddr_t pa;
+    struct textcache_entry *next;
+};
+
+static struct textcache_entry *buckets[TEXTCACHE_BUCKETS];
+static struct textcache_file *files;
+static unsigned int textcache_npages;
+static struct spinlock textcache_lock = SPINLOCK_INITIALIZER;
+
+static unsigned int textcache_hash(struct vnode *vn, vaddr_t va) {
+    return (((uintptr_t)vn >> 4) ^ (va / PAGE_SIZE)) % TEXTCACHE_BUCKETS;
+}
+
+/**
+ * Must be called holding textcache_lock
+*/
+static struct textcache_file *textcache_find_file(struct vnode *vn) {
+    struct textcache_file *f;
+
+    KASSERT(spinlock_do_i_hold(&textcache_lock));
+
+    for (f = files; f != NULL; f = f->next) {
+        if (f->vn == vn) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Must be called holding textcache_lock, stale entries are skipped
+*/
+static struct textcache_entry *textcache_find(struct vnode *vn, vaddr_t va) {
+    struct textcache_entry *e;
+
+    KASSERT(spinlock_do_i_hold(&textcache_lock));
+
+    for (e = buckets[textcache_hash(vn, va)]; e != NULL; e = e->next) {
+        if (e->file->vn == vn && e->va == va && e->gen == e->file->gen) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+int textcache_shareable(struct segment *seg) {
+    return seg->vnode != NULL && seg->p_permission != PF_S &&
+        (seg->p_permission & PF_W) == 0;
+}
+
+paddr_t textcache_lookup(struct vnode *vn, vaddr_t va) {
+    struct textcache_entry *e;
+    paddr_t pa = 0;
+
+    KASSERT((va & PAGE_FRAME) == va);
+
+    spinlock_acquire(&textcache_lock);
+    e = textcache_find(vn, va);
+    if (e != NULL) {
+        page_ref(e->pa);
+        pa = e->pa;
+    }
+    spinlock_release(&textcache_lock);
+
+    return pa;
+}
+
+paddr_t textcache_insert(struct vnode *vn, vaddr_t va, paddr_t pa) {
+    struct textcache_entry *e, *newe;
+    struct textcache_file *f, *newf;
+    unsigned int h;
+
+    KASSERT((va & PAGE_FRAME) == va);
+
+    // cannot kmalloc holding a spinlock
+    newe = kmalloc(sizeof(struct textcache_entry));
+    newf = kmalloc(sizeof(struct textcache_file));
+    if (newe == NULL || newf == NULL) {
+        // not shared, the page stays private to this process
+        kfree(newe);
+        kfree(newf);
+        return pa;
+    }
+
+    spinlock_acquire(&textcache_lock);
+    e = textcache_find(vn, va);
+    if (e != NULL) {
+        // someone else loaded the same page meanwhile, use theirs
+        page_ref(e->pa);
+        newe->pa = e->pa;
+        spinlock_release(&textcache_lock);
+        page_free(pa);
+        pa = newe->pa;
+        kfree(newe);
+        kfree(newf);
+        return pa;
+    }
+    if (textcache_npages >= ram_getsize() / PAGE_SIZE / TEXTCACHE_RAM_SHARE) {
+        // enough frames that cannot be evicted, this one stays private
+        spinlock_release(&textcache_lock);
+        kfree(newe);
+        kfree(newf);
+        return pa;
+    }
+
+    f = textcache_find_file(vn);
+    if (f == NULL) {
+        f = newf;
+        newf = NULL;
+        f->vn = vn;
+        f->gen = 0;
+        f->nentries = 0;
+        f->next = files;
+        files = f;
+    }
+    f->nentries++;
+    textcache_npages++;
+
+    newe->file = f;
+    newe->gen = f->gen;
+    newe->va = va;
+    newe->pa = pa;
+    h = textcache_hash(vn, va);
+    newe->next = buckets[h];
+    buckets[h] = newe;
+    page_share(pa);
+    spinlock_release(&textcache_lock);
+
+    kfree(newf);
+    return pa;
+}
+
+void textcache_invalidate(struct vnode *vn) {
+    struct textcache_file *f;
+
+    spinlock_acquire(&textcache_lock);
+    f = textcache_find_file(vn);
+    if (f != NULL) {
+        f->gen++;
+    }
+    spinlock_release(&textcache_lock);
+}
+
+/**
+ * Must be called holding textcache_lock, unlinks E and returns its file if
+ * that was its last entry (the caller frees both out of the lock)
+*/
+static struct textcache_file *textcache_remove(struct textcache_entry **prev) {
+    struct textcache_entry *e = *prev;
+    struct textcache_file *f = e->file, **fprev;
+
+    KASSERT(spinlock_do_i_hold(&textcache_lock));
+
+    *prev = e->next;
+    textcache_npages--;
+    KASSERT(f->nentries > 0);
+    if (--f->nentries > 0) {
+        return NULL;
+    }
+    for (fprev = &files; *fprev != f; fprev = &(*fprev)->next) {
+        KASSERT(*fprev != NULL);
+    }
+    *fprev = f->next;
+    return f;
+}
+
+/**
+ * Drops one reference on the frame PA caching VA of VN, removing the entry with
+ * the last one. Returns 0 if PA is not a cached frame (a private page).
+*/
+static int textcache_release(struct vnode *vn, vaddr_t va, paddr_t pa) {
+    struct textcache_entry *e, **prev;
+    struct textcache_file *f;
+
+    spinlock_acquire(&textcache_lock);
+    for (prev = &buckets[textcache_hash(vn, va)]; *prev != NULL; prev = &(*prev)->next) {
+        e = *prev;
+        // stale entries included, their frames are still mapped
+        if (e->file->vn != vn || e->va != va || e->pa != pa) {
+            continue;
+        }
+        if (page_unref(e->pa) == 0) {
+            f = textcache_remove(prev);
+            spinlock_release(&textcache_lock);
+            kfree(e);
+            kfree(f);
+            return 1;
+        }
+        spinlock_release(&textcache_lock);
+        return 1;
+    }
+    spinlock_release(&textcache_lock);
+
+    return 0;
+}
+
+void textcache_unmap_segment(struct segment *seg, struct pt_directory *pt) {
+    vaddr_t va, top;
+    paddr_t pa;
+
+    if (!textcache_shareable(seg)) {
+        return;
+    }
+
+    top = seg->p_vaddr + seg->p_memsz;
+    for (va = seg->p_vaddr & PAGE_FRAME; va < top; va += PAGE_SIZE) {
+        pa = pt_get_pa(pt, va);
+        if (pa == PFN_NOT_USED) {
+            continue;
+        }
+        // private copies (cache entry allocation failed) are left to pt_destroy()
+        if (textcache_release(seg->vnode, va, pa)) {
+            pt_clear(pt, va);
+        }
+    }
+}
@@ -0,0 +1,233 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <mips/tlb.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmalloc.h>
+
+/**
+ * vmalloc: large kernel allocations made of single frames, see vmalloc.h.
+ *
+ * The window [VMALLOC_BASE, VMALLOC_END) is described by a flat kernel page
+ * table with one entry per page. An allocation takes a run of free entries
+ * (first fit), then one frame per page with alloc_kpages(1), so that it only
+ * fails when memory is really short and not when it is just fragmented.
+ * The first entry of a run records its length, for vfree().
+ *
+ * Nothing is mapped in advance: a kernel access to the window misses in the
+ * TLB and vm_fault() loads the entry from vmalloc_lookup().
+*/
+
+#define VP_USED     0x1     /* entry belongs to an allocation (frame may still be missing) */
+#define VMALLOC_FREE_BATCH  16  /* pages unmapped per TLB shootdown */
+
+struct vmalloc_pte {
+    paddr_t vp_pa;          /* frame | VP_USED */
+    unsigned vp_npages;     /* length of the allocation starting here, 0 elsewhere */
+};
+
+static struct vmalloc_pte *kpt = NULL;
+
+//protects kpt, never held across alloc_kpages/free_kpages
+static struct spinlock vmalloc_lock = SPINLOCK_INITIALIZER;
+
+static unsigned vmalloc_used = 0;       /* entries taken */
+static unsigned vmalloc_allocs = 0;     /* live allocations */
+
+#define VMALLOC_SLOT(va)    (((vaddr_t)(va) - VMALLOC_BASE) / PAGE_SIZE)
+#define VMALLOC_VADDR(slot) (VMALLOC_BASE + (vaddr_t)(slot) * PAGE_SIZE)
+
+void vmalloc_bootstrap(void) {
+    unsigned i;
+
+    spinlock_setname(&vmalloc_lock, "vmalloc_lock");
+
+    kpt = kmalloc(sizeof(struct vmalloc_pte) * VMALLOC_NPAGES);
+    if (kpt == NULL) {
+        panic("vmalloc: cannot allocate the kernel page table\n");
+    }
+    for (i = 0; i < VMALLOC_NPAGES; i++) {
+        kpt[i].vp_pa = 0;
+        kpt[i].vp_npages = 0;
+    }
+}
+
+/**
+ * Looks for NPAGES free consecutive entries and marks them as used.
+ * Returns the first one, -1 if the window is full.
+*/
+static int vmalloc_reserve(unsigned npages) {
+    unsigned i, run;
+
+    spinlock_acquire(&vmalloc_lock);
+    for (i = 0, run = 0; i < VMALLOC_NPAGES; i++) {
+        if (kpt[i].vp_pa & VP_USED) {
+            run = 0;
+            continue;
+        }
+        if (++run == npages) {
+            break;
+        }
+    }
+    if (i == VMALLOC_NPAGES) {
+        spinlock_release(&vmalloc_lock);
+        return -1;
+    }
+
+    i = i + 1 - npages;
+    kpt[i].vp_npages = npages;
+    for (run = 0; run < npages; run++) {
+        kpt[i + run].vp_pa = VP_USED;
+    }
+    vmalloc_used += npages;
+    vmalloc_allocs++;
+    spinlock_release(&vmalloc_lock);
+
+    return i;
+}
+
+/**
+ * Drops the mapping of page SLOT and returns its frame (0 if it had none).
+ * Other CPUs may still have it in their TLB, see vmalloc_release().
+*/
+static paddr_t vmalloc_unmap(unsigned slot) {
+    paddr_t pa;
+
+    spinlock_acquire(&vmalloc_lock);
+    pa = kpt[slot].vp_pa & PAGE_FRAME;
+    kpt[slot].vp_pa = 0;
+    kpt[slot].vp_npages = 0;
+    vmalloc_used--;
+    spinlock_release(&vmalloc_lock);
+
+    return pa;
+}
+
+/**
+ * Unmaps NPAGES pages from slot FIRST and frees their frames. The TLB entries
+ * are dropped on every CPU (kernel threads never flush their TLB, so a stale
+ * entry could live on anywhere) before a frame can be reused, a batch at a time.
+*/
+static void vmalloc_release(unsigned first, unsigned npages) {
+    paddr_t pas[VMALLOC_FREE_BATCH];
+    struct tlbshootdown ts;
+    unsigned done, n, i;
+
+    for (done = 0; done < npages; done += n) {
+        n = npages - done;
+        if (n > VMALLOC_FREE_BATCH) {
+            n = VMALLOC_FREE_BATCH;
+        }
+        for (i = 0; i < n; i++) {
+            pas[i] = vmalloc_unmap(first + done + i);
+        }
+
+        ts.ts_vaddr = VMALLOC_VADDR(first + done);
+        ts.ts_npages = n;
+        ts.ts_pending = NULL;
+        vm_tlbshootdown(&ts);
+        ipi_tlbshootdown_all(&ts);
+
+        for (i = 0; i < n; i++) {
+            if (pas[i] != 0) {
+                free_kpages(PADDR_TO_KVADDR(pas[i]));
+            }
+        }
+    }
+}
+
+void *vmalloc(size_t size) {
+    unsigned npages, i;
+    int first;
+    vaddr_t kva;
+
+    if (kpt == NULL || size == 0) {
+        return NULL;
+    }
+    npages = DIVROUNDUP(size, PAGE_SIZE);
+    if (npages > VMALLOC_NPAGES) {
+        return NULL;
+    }
+
+    first = vmalloc_reserve(npages);
+    if (first < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < npages; i++) {
+        kva = alloc_kpages(1);
+        if (kva == 0) {
+            break;
+        }
+        spinlock_acquire(&vmalloc_lock);
+        kpt[first + i].vp_pa = (kva - MIPS_KSEG0) | VP_USED;
+        spinlock_release(&vmalloc_lock);
+    }
+
+    if (i < npages) {
+        // give back what has been taken, the allocation is still not visible
+        vmalloc_release(first, npages);
+        spinlock_acquire(&vmalloc_lock);
+        vmalloc_allocs--;
+        spinlock_release(&vmalloc_lock);
+        return NULL;
+    }
+
+    return (void *) VMALLOC_VADDR(first);
+}
+
+void vfree(void *ptr) {
+    unsigned slot, npages;
+
+    KASSERT(VMALLOC_OWNS(ptr));
+    KASSERT(((vaddr_t)ptr & ~PAGE_FRAME) == 0);
+
+    slot = VMALLOC_SLOT(ptr);
+
+    spinlock_acquire(&vmalloc_lock);
+    npages = kpt[slot].vp_npages;
+    KASSERT(npages > 0);
+    KASSERT(slot + npages <= VMALLOC_NPAGES);
+    vmalloc_allocs--;
+    spinlock_release(&vmalloc_lock);
+
+    vmalloc_release(slot, npages);
+}
+
+paddr_t vmalloc_lookup(vaddr_t va) {
+    paddr_t pa;
+
+    if (!VMALLOC_OWNS(va) || kpt == NULL) {
+        return 0;
+    }
+
+    spinlock_acquire(&vmalloc_lock);
+    pa = kpt[VMALLOC_SLOT(va)].vp_pa & PAGE_FRAME;
+    spinlock_release(&vmalloc_lock);
+
+    return pa;
+}
+
+paddr_t kvaddr_to_paddr(vaddr_t kva) {
+    paddr_t pa;
+
+    if (VMALLOC_OWNS(kva)) {
+        pa = vmalloc_lookup(kva);
+        KASSERT(pa != 0);
+        return pa | (kva & ~PAGE_FRAME);
+    }
+
+    KASSERT(kva >= MIPS_KSEG0 && kva < MIPS_KSEG1);
+    return kva - MIPS_KSEG0;
+}
+
+void vmalloc_printstats(void) {
+    spinlock_acquire(&vmalloc_lock);
+    kprintf("vmalloc: %u allocations, %u/%u pages of the window in use\n",
+        vmalloc_allocs, vmalloc_used, VMALLOC_NPAGES);
+    spinlock_release(&vmalloc_lock);
+}
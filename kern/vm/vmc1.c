@@ -16,6 +16,9 @@
 #include <vmc1.h>
 #include <swapfile.h>
 #include <statistics.h>
+#include <textcache.h>
+#include <prefault.h>
+#include <vmalloc.h>
 
 
 static unsigned int current_victim;
@@ -36,6 +39,10 @@ void vm_bootstrap(void)
     coremap_init();
     current_victim = 0;
     init_statistics();
+    // swap areas live as long as the system, not as a single process
+    swapfile_init();
+    prefault_bootstrap();
+    vmalloc_bootstrap();
 
 }
 
@@ -43,6 +50,7 @@ void vm_shutdown(void)
 {
     coremap_shutdown();
     swap_shutdown();
+    prefault_shutdown();
     print_all_statistics();
 }
 
@@ -59,17 +67,148 @@ void vm_can_sleep(void)
 }
 
 
+/**
+ * Makes the page containing FAULTADDRESS of segment SEG resident in AS, whatever
+ * its state: already resident, shared by another process, never touched (zero
+ * filled or loaded from the ELF file) or swapped out. The frame is returned in PA.
+ * Used both by vm_fault() and by the prefault policies at load time.
+*/
+static int vm_page_in(struct addrspace *as, struct segment *seg, vaddr_t faultaddress, paddr_t *ret)
+{
+    int new_page, result;
+    paddr_t pa; 
+    vaddr_t pageallign_va;
+    off_t swap_offset;
+    off_t result_swap_in;
+
+    new_page = -1;
+    pageallign_va = faultaddress & PAGE_FRAME;
+
+    // the inner table may have been written to swap, or never been there
+    result = pt_load_inner(as->pt, faultaddress);
+    if (result)
+        return result;
+
+    // look into the pagetable
+    pa = pt_get_pa(as->pt, faultaddress);
+    swap_offset = pt_get_offset(as->pt, faultaddress);
+    
+    // read-only pages of the same executable may already be resident for another process
+    if(pa == PFN_NOT_USED && swap_offset == -1 && textcache_shareable(seg)) {
+        pa = textcache_lookup(seg->vnode, pageallign_va);
+        if (pa != PFN_NOT_USED) {
+            pt_set_pa(as->pt, pageallign_va, pa);
+            increment_statistics(STATISTICS_PAGE_FAULT_SHARED);
+        }
+    }
+
+    // if not exists then allocate a new frame
+    if(pa == PFN_NOT_USED && swap_offset == -1) { 
+        //the page was not used before
+        // asks for a new frame from the coremap
+        pa = page_alloc(pageallign_va);
+        KASSERT((pa & PAGE_FRAME) == pa);
+        // making room may have swapped the inner table out again
+        result = pt_load_inner(as->pt, faultaddress);
+        if (result) {
+            page_free(pa);
+            return result;
+        }
+        // update the pagetable with the new PFN 
+        pt_set_pa(as->pt, faultaddress, pa);
+
+        if (seg->p_permission == PF_S) //if the fault is in the stack segment we need to zero-out the page
+        {   
+
+            //In C, uninitialized variables are not guaranteed to be set to any particular value. 
+            //Therefore, if a new page is not zeroed-out before it is used, it may contain arbitrary 
+            //data that could cause the program to behave unpredictably. By zeroing-out the new page, 
+            //we ensure that it is initialized to a known state of all zeroes 1
+            bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+            increment_statistics(STATISTICS_PAGE_FAULT_ZERO);
+        }
+
+        new_page = 1;
+    }
+    else if(swap_offset >= 0){
+
+        //here we check if the page has been swapped out from the RAM so we will load it from the SWAPFILE
+        //call swap_in
+        pa = page_alloc(pageallign_va);
+        result = pt_load_inner(as->pt, faultaddress);
+        if (result) {
+            page_free(pa);
+            return result;
+        }
+        
+        result_swap_in = swap_in(pa, swap_offset);
+        KASSERT(result_swap_in == 0);
+        pt_set_offset(as->pt, pageallign_va, -1);
+        pt_set_pa(as->pt, pageallign_va, pa);
+
+    }
+
+    if(new_page == 1 && seg->p_permission != PF_S) {
+        // kprintf("LOAD at pa:0x%x va:0x%x\n", pa, pageallign_va);
+
+        result = seg_load_page(seg, faultaddress, pa); 
+        if (result) {
+            // drop the entry, its inner table goes away too if it was the only one
+            pt_clear(as->pt, pageallign_va);
+            page_free(pa);
+            return result;
+        }
+
+        if (textcache_shareable(seg)) {
+            // from now on the frame is shared, a concurrent loader may have won the race
+            paddr_t cached = textcache_insert(seg->vnode, pageallign_va, pa);
+            if (cached != pa) {
+                pt_set_pa(as->pt, pageallign_va, cached);
+                pa = cached;
+            }
+        }
+    }    
+
+
+    *ret = pa;
+    return 0;
+}
+
+/**
+ * Brings in the page at VA of the current address space without touching the TLB,
+ * the access that follows is just a TLB reload. Pages outside any segment are skipped.
+*/
+int vm_prefault(struct addrspace *as, vaddr_t va)
+{
+    struct segment *seg;
+    paddr_t pa;
+    int result;
+
+    seg = as_get_segment(as, va);
+    if (seg == NULL || seg->p_memsz == 0) {
+        return 0;
+    }
+    if (pt_get_pa(as->pt, va) != PFN_NOT_USED) {
+        return 0;
+    }
+
+    result = vm_page_in(as, seg, va, &pa);
+    if (result) {
+        return result;
+    }
+    increment_statistics(STATISTICS_PREFAULT);
+    return 0;
+}
+
 int vm_fault(int faulttype, vaddr_t faultaddress)
 {
-    int spl, new_page, result; //i, found;
+    int spl, result; //i, found;
     unsigned int victim;
 	uint32_t ehi, elo, victim_ehi, victim_elo;
 	struct addrspace *as;
     paddr_t pa; 
     struct segment * seg;
     vaddr_t pageallign_va;
-    off_t swap_offset;
-    off_t result_swap_in;
     
    	pageallign_va = faultaddress & PAGE_FRAME;
 
@@ -87,6 +226,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
             return EINVAL;
     }
 
+    if (VMALLOC_OWNS(faultaddress)) {
+        // kernel memory from vmalloc(), the same for every process
+        pa = vmalloc_lookup(faultaddress);
+        if (pa == 0) {
+            return EFAULT;
+        }
+        spl = splhigh();
+        tlb_write(pageallign_va, pa | TLBLO_VALID | TLBLO_DIRTY, tlb_get_rr_victim());
+        splx(spl);
+        return 0;
+    }
+
     if (curproc == NULL) {
 		/*
 		 * No process. This is probably a kernel fault early
@@ -105,7 +256,6 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-    new_page = -1;
     seg = as_get_segment(as, faultaddress);
     if (seg == NULL)
     {
@@ -113,56 +263,12 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
     }
     // segment found
 
-    // look into the pagetable
-    pa = pt_get_pa(as->pt, faultaddress);
-    if (pa > 0) {
+    if (pt_get_pa(as->pt, faultaddress) != PFN_NOT_USED) {
         increment_statistics(STATISTICS_TLB_RELOAD);
     }
-    swap_offset = pt_get_offset(as->pt, faultaddress);
-    
-    // if not exists then allocate a new frame
-    if(pa == PFN_NOT_USED && swap_offset == -1) { 
-        //the page was not used before
-        // asks for a new frame from the coremap
-        pa = page_alloc(pageallign_va);
-        // update the pagetable with the new PFN 
-        KASSERT((pa & PAGE_FRAME) == pa);
-        pt_set_pa(as->pt, faultaddress, pa);
-
-        if (seg->p_permission == PF_S) //if the fault is in the stack segment we need to zero-out the page
-        {   
-
-            //In C, uninitialized variables are not guaranteed to be set to any particular value. 
-            //Therefore, if a new page is not zeroed-out before it is used, it may contain arbitrary 
-            //data that could cause the program to behave unpredictably. By zeroing-out the new page, 
-            //we ensure that it is initialized to a known state of all zeroes 1
-            bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
-            increment_statistics(STATISTICS_PAGE_FAULT_ZERO);
-        }
-
-        new_page = 1;
-    }
-    else if(swap_offset >= 0){
-
-        //here we check if the page has been swapped out from the RAM so we will load it from the SWAPFILE
-        //call swap_in
-        pa = page_alloc(pageallign_va);
-       
-        
-        result_swap_in = swap_in(pa, swap_offset);
-        KASSERT(result_swap_in == 0);
-        pt_set_offset(as->pt, pageallign_va, -1);
-        pt_set_pa(as->pt, pageallign_va, pa);
-
-    }
-
-    if(new_page == 1 && seg->p_permission != PF_S) {
-        // kprintf("LOAD at pa:0x%x va:0x%x\n", pa, pageallign_va);
-
-        result = seg_load_page(seg, faultaddress, pa); 
-        if (result)
-            return EFAULT;
-    }    
+    result = vm_page_in(as, seg, faultaddress, &pa);
+    if (result)
+        return result;
 
     increment_statistics(STATISTICS_TLB_FAULT);
     // otherwise update the TLB
@@ -192,10 +298,29 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 	return 0;
 }
 
-//TODO - Just a copy of the dumbvm one till now
+/*
+ * Drop the TLB entries of TS_NPAGES pages (vmalloc or evicted user pages,
+ * all ASID 0) from TS_VADDR on; past the size of the TLB the whole of it goes.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	unsigned i;
+	int index, spl;
+
+	spl = splhigh();
+	if (ts->ts_npages >= NUM_TLB) {
+		for (i = 0; i < NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	else {
+		for (i = 0; i < ts->ts_npages; i++) {
+			index = tlb_probe(ts->ts_vaddr + i * PAGE_SIZE, 0);
+			if (index >= 0) {
+				tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+			}
+		}
+	}
+	splx(spl);
 }
\ No newline at end of file